@@ -0,0 +1,43 @@
+/**
+ * @description: Small helpers shared by the standalone benchmark
+ * programs in this directory. Each program defines
+ * FTGL_IMPLEMENTATION itself and includes font.h from the parent
+ * directory; see the top of each file for its compile line.
+ */
+
+#ifndef FTGL_BENCH_H_
+#define FTGL_BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Returns a monotonic timestamp in seconds.
+ */
+static inline double bench_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * A xorshift generator so runs are reproducible across libcs.
+ */
+static inline uint32_t bench_random(uint32_t *state)
+{
+        uint32_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return *state = x;
+}
+
+/**
+ * Keeps the compiler from discarding a value computed in a timed loop.
+ */
+static volatile uintptr_t bench_sink;
+
+#endif /* FTGL_BENCH_H_ */
@@ -0,0 +1,297 @@
+/**
+ * @description: Compares the single precision distance map
+ * ftgl_distance_mapf and the linear-time ftgl_distance_map_edt against
+ * the double precision EDTAA3 reference ftgl_distance_mapb on the
+ * rasterized glyphs of a real font. Reports the time per glyph, the
+ * speedup, the maximum and mean absolute difference of the output
+ * bytes, with the glyph and pixel where the maximum occurs so it can
+ * be reproduced, and the maximum difference of the distance itself in
+ * pixels. The byte error depends on each glyph's range, as every map
+ * scales the field by its deepest interior distance.
+ *
+ * cc -O2 -I.. distance.c -o distance $(pkg-config --cflags --libs freetype2) \
+ *    -lGLEW -lGLU -lGL -lm -lpthread
+ * ./distance font.ttf
+ */
+
+#define FTGL_IMPLEMENTATION
+#include "../font.h"
+#include "bench.h"
+
+#define BENCH_FIRST  0x20
+#define BENCH_LAST   0x17f
+#define BENCH_ROUNDS 5
+
+/**
+ * A glyph bitmap padded by @pad pixels on every side, the way
+ * ftgl_font_rasterize hands it to the distance maps.
+ */
+struct bench_glyph_t {
+        uint32_t codepoint;
+        unsigned int width;
+        unsigned int height;
+        unsigned char *pixels;
+        unsigned char *reference;
+        double *field;
+};
+
+typedef ftgl_return_t (*bench_map_t)(ftgl_sdf_t sdf, const unsigned char *img,
+                                     unsigned char *out, unsigned int width,
+                                     unsigned int height);
+
+static const struct {
+        const char *name;
+        bench_map_t map;
+} bench_maps[] = {
+        { "mapf", ftgl_distance_mapf },
+        { "edt", ftgl_distance_map_edt },
+};
+
+static size_t bench_collect(FT_Face face, int pixel_size, int pad,
+                            struct bench_glyph_t *glyphs)
+{
+        uint32_t codepoint;
+        unsigned int y;
+        size_t count;
+        FT_Bitmap *bitmap;
+        struct bench_glyph_t *glyph;
+
+        FT_Set_Pixel_Sizes(face, 0, pixel_size);
+        count = 0;
+        for (codepoint = BENCH_FIRST; codepoint <= BENCH_LAST; codepoint++) {
+                if (!FT_Get_Char_Index(face, codepoint) ||
+                    FT_Load_Char(face, codepoint, FT_LOAD_RENDER)) {
+                        continue;
+                }
+
+                bitmap = &face->glyph->bitmap;
+                if (bitmap->width == 0 || bitmap->rows == 0) {
+                        continue;
+                }
+
+                glyph = &glyphs[count++];
+                glyph->codepoint = codepoint;
+                glyph->width = bitmap->width + 2 * pad;
+                glyph->height = bitmap->rows + 2 * pad;
+                glyph->pixels = calloc(glyph->width * glyph->height, 1);
+                if (!glyph->pixels) {
+                        fprintf(stderr, "out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+
+                for (y = 0; y < bitmap->rows; y++) {
+                        memcpy(glyph->pixels + (y + pad) * glyph->width + pad,
+                               bitmap->buffer + y * bitmap->pitch, bitmap->width);
+                }
+        }
+        return count;
+}
+
+/**
+ * The unscaled EDTAA3 field behind ftgl_distance_mapb, in pixels:
+ * distance outside the glyph minus distance inside it.
+ */
+static double *bench_field(const struct bench_glyph_t *glyph)
+{
+        size_t i, n;
+        unsigned char img_min, img_max;
+        double *data, *gx, *gy, *outside, *inside;
+        short *distx, *disty;
+
+        n = glyph->width * glyph->height;
+        data = malloc(sizeof(*data) * n);
+        gx = calloc(n, sizeof(*gx));
+        gy = calloc(n, sizeof(*gy));
+        outside = malloc(sizeof(*outside) * n);
+        inside = malloc(sizeof(*inside) * n);
+        distx = malloc(sizeof(*distx) * n);
+        disty = malloc(sizeof(*disty) * n);
+        if (!data || !gx || !gy || !outside || !inside || !distx || !disty) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        img_min = 255;
+        img_max = 0;
+        for (i = 0; i < n; i++) {
+                if (glyph->pixels[i] > img_max) img_max = glyph->pixels[i];
+                if (glyph->pixels[i] < img_min) img_min = glyph->pixels[i];
+        }
+
+        for (i = 0; i < n; i++) {
+                data[i] = (glyph->pixels[i] - img_min) / (double) img_max;
+        }
+
+        ftgl_computegradient(data, glyph->width, glyph->height, gx, gy);
+        ftgl_edtaa3(data, gx, gy, glyph->width, glyph->height, distx, disty, outside);
+
+        memset(gx, 0, sizeof(*gx) * n);
+        memset(gy, 0, sizeof(*gy) * n);
+        for (i = 0; i < n; i++) {
+                data[i] = 1.0 - data[i];
+        }
+
+        ftgl_computegradient(data, glyph->width, glyph->height, gx, gy);
+        ftgl_edtaa3(data, gx, gy, glyph->width, glyph->height, distx, disty, inside);
+
+        for (i = 0; i < n; i++) {
+                outside[i] = (outside[i] > 0.0 ? outside[i] : 0.0)
+                        - (inside[i] > 0.0 ? inside[i] : 0.0);
+        }
+
+        free(data);
+        free(gx);
+        free(gy);
+        free(inside);
+        free(distx);
+        free(disty);
+        return outside;
+}
+
+/**
+ * Keeps the output of ftgl_distance_mapb for every glyph as the
+ * reference, then returns its time per glyph over BENCH_ROUNDS more
+ * passes.
+ */
+static double bench_reference(struct bench_glyph_t *glyphs, size_t count)
+{
+        size_t i, round;
+        double start;
+        unsigned char *out;
+
+        for (i = 0; i < count; i++) {
+                glyphs[i].reference = ftgl_distance_mapb(glyphs[i].pixels,
+                                                         glyphs[i].width,
+                                                         glyphs[i].height);
+                glyphs[i].field = bench_field(&glyphs[i]);
+        }
+
+        start = bench_now();
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+                for (i = 0; i < count; i++) {
+                        out = ftgl_distance_mapb(glyphs[i].pixels, glyphs[i].width,
+                                                 glyphs[i].height);
+                        FTGL_FREE(out);
+                }
+        }
+        return (bench_now() - start) / (BENCH_ROUNDS * count);
+}
+
+static void bench_compare(const char *name, bench_map_t map, ftgl_sdf_t sdf,
+                          const struct bench_glyph_t *glyphs, size_t count,
+                          int pixel_size, int pad, double reference)
+{
+        size_t i, j, n, round, pixels, worst_glyph, worst_pixel;
+        int diff, worst;
+        double start, elapsed, total, distance, worst_distance;
+        unsigned char *out;
+
+        n = 0;
+        for (i = 0; i < count; i++) {
+                if (glyphs[i].width * glyphs[i].height > n) {
+                        n = glyphs[i].width * glyphs[i].height;
+                }
+        }
+
+        if (!(out = malloc(n))) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        // The quality pass doubles as the warm-up for the timed one
+        worst = 0;
+        worst_glyph = worst_pixel = 0;
+        total = worst_distance = 0.0;
+        pixels = 0;
+        for (i = 0; i < count; i++) {
+                n = glyphs[i].width * glyphs[i].height;
+                map(sdf, glyphs[i].pixels, out, glyphs[i].width, glyphs[i].height);
+                for (j = 0; j < n; j++) {
+                        // Both maps leave the unscaled field in sdf->outside
+                        distance = fabs(sdf->outside[j] - glyphs[i].field[j]);
+                        if (distance > worst_distance) {
+                                worst_distance = distance;
+                        }
+
+                        diff = abs((int) out[j] - (int) glyphs[i].reference[j]);
+                        total += diff;
+                        if (diff > worst) {
+                                worst = diff;
+                                worst_glyph = i;
+                                worst_pixel = j;
+                        }
+                }
+                pixels += n;
+        }
+
+        start = bench_now();
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+                for (i = 0; i < count; i++) {
+                        map(sdf, glyphs[i].pixels, out, glyphs[i].width, glyphs[i].height);
+                }
+        }
+        elapsed = (bench_now() - start) / (BENCH_ROUNDS * count);
+
+        printf("%-5s %4d %3d %10.2f %10.2f %7.2fx %5d %7.3f %7.3f   U+%04X (%zu,%zu)\n",
+               name, pixel_size, pad, reference * 1e6, elapsed * 1e6,
+               reference / elapsed, worst, total / pixels, worst_distance,
+               glyphs[worst_glyph].codepoint,
+               worst_pixel % glyphs[worst_glyph].width,
+               worst_pixel / glyphs[worst_glyph].width);
+        free(out);
+}
+
+int main(int argc, char **argv)
+{
+        static const int pixel_sizes[] = { 16, 32, 64 };
+        static const int pads[] = { FTGL_GLYPH_OFFSET, 8 };
+        size_t i, j, k, count;
+        double reference;
+        FT_Face face;
+        ftgl_sdf_t sdf;
+        struct bench_glyph_t *glyphs;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: %s font.ttf\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (ftgl_font_library_init() != FTGL_NO_ERROR ||
+            FT_New_Face(ftgl_font_library, argv[1], 0, &face)) {
+                fprintf(stderr, "could not open %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+
+        sdf = ftgl_sdf_create();
+        glyphs = calloc(BENCH_LAST - BENCH_FIRST + 1, sizeof(*glyphs));
+        if (!sdf || !glyphs) {
+                fprintf(stderr, "out of memory\n");
+                return EXIT_FAILURE;
+        }
+
+        printf("%-5s %4s %3s %10s %10s %8s %5s %7s %7s   %s\n", "map", "px", "pad",
+               "mapb us", "us/glyph", "speedup", "max", "mean", "max px", "worst at");
+        for (i = 0; i < sizeof(pixel_sizes) / sizeof(*pixel_sizes); i++) {
+                for (j = 0; j < sizeof(pads) / sizeof(*pads); j++) {
+                        count = bench_collect(face, pixel_sizes[i], pads[j], glyphs);
+                        reference = bench_reference(glyphs, count);
+                        for (k = 0; k < sizeof(bench_maps) / sizeof(*bench_maps); k++) {
+                                bench_compare(bench_maps[k].name, bench_maps[k].map, sdf,
+                                              glyphs, count, pixel_sizes[i], pads[j],
+                                              reference);
+                        }
+
+                        for (k = 0; k < count; k++) {
+                                free(glyphs[k].pixels);
+                                FTGL_FREE(glyphs[k].reference);
+                                free(glyphs[k].field);
+                        }
+                }
+        }
+
+        free(glyphs);
+        ftgl_sdf_free(&sdf);
+        FT_Done_Face(face);
+        ftgl_font_library_free();
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+/**
+ * @description: Compares glyph lookup throughput of the open-addressing
+ * glyphmap in font.h against the chained map it replaced (23 buckets,
+ * one heap node per glyph), at 100, 10k and 60k resident glyphs.
+ *
+ * cc -O2 -I.. glyphmap.c -o glyphmap $(pkg-config --cflags --libs freetype2) \
+ *    -lGLEW -lGLU -lGL -lm -lpthread
+ */
+
+#define FTGL_IMPLEMENTATION
+#include "../font.h"
+#include "bench.h"
+
+#define BENCH_KEYS    (1 << 16)
+#define BENCH_SECONDS 0.5
+
+/* The chained glyphmap as it stood before the open-addressing rewrite */
+#define OLD_GLYPHMAP_CAPACITY 23
+
+struct old_glyph_t {
+        ivec4_t bbox;
+        uint32_t codepoint;
+        GLint offset_x;
+        GLint offset_y;
+        GLfloat advance_x;
+        GLfloat advance_y;
+};
+
+struct old_glyphlist_t {
+        struct old_glyph_t *glyph;
+        struct old_glyphlist_t *next;
+};
+
+struct old_glyphmap_t {
+        struct old_glyphlist_t *map[OLD_GLYPHMAP_CAPACITY];
+};
+
+static struct old_glyph_t *old_glyphmap_find_glyph(struct old_glyphmap_t *glyphmap,
+                                                   uint32_t codepoint)
+{
+        struct old_glyphlist_t *glyphlist;
+
+        glyphlist = glyphmap->map[codepoint % OLD_GLYPHMAP_CAPACITY];
+        while (glyphlist != NULL) {
+                if (glyphlist->glyph->codepoint == codepoint) {
+                        return glyphlist->glyph;
+                }
+                glyphlist = glyphlist->next;
+        }
+        return NULL;
+}
+
+static int old_glyphmap_insert(struct old_glyphmap_t *glyphmap, uint32_t codepoint,
+                               ivec4_t bbox, GLint offset_x, GLint offset_y,
+                               GLfloat advance_x, GLfloat advance_y)
+{
+        size_t hash;
+        struct old_glyph_t *glyph;
+        struct old_glyphlist_t *glyphlist;
+
+        if (old_glyphmap_find_glyph(glyphmap, codepoint)) {
+                return 0;
+        }
+
+        glyph = malloc(sizeof(*glyph));
+        glyphlist = malloc(sizeof(*glyphlist));
+        if (!glyph || !glyphlist) {
+                free(glyph);
+                free(glyphlist);
+                return -1;
+        }
+
+        glyph->bbox = bbox;
+        glyph->codepoint = codepoint;
+        glyph->offset_x = offset_x;
+        glyph->offset_y = offset_y;
+        glyph->advance_x = advance_x;
+        glyph->advance_y = advance_y;
+
+        hash = codepoint % OLD_GLYPHMAP_CAPACITY;
+        glyphlist->glyph = glyph;
+        glyphlist->next = glyphmap->map[hash];
+        glyphmap->map[hash] = glyphlist;
+        return 0;
+}
+
+static void old_glyphmap_free(struct old_glyphmap_t *glyphmap)
+{
+        size_t i;
+        struct old_glyphlist_t *glyphlist, *next;
+
+        for (i = 0; i < OLD_GLYPHMAP_CAPACITY; i++) {
+                for (glyphlist = glyphmap->map[i]; glyphlist; glyphlist = next) {
+                        next = glyphlist->next;
+                        free(glyphlist->glyph);
+                        free(glyphlist);
+                }
+        }
+        free(glyphmap);
+}
+
+/**
+ * Runs one size: inserts @count glyphs starting at U+0020 (so the
+ * Latin-1 direct table is exercised as a real font would), then looks
+ * up keys drawn uniformly from the inserted set for BENCH_SECONDS per
+ * map. Lookups run in passes over the key array so the long chains of
+ * the old map at 60k glyphs don't take minutes.
+ */
+static int bench_size(uint32_t count)
+{
+        uint32_t i, state, *keys;
+        uintptr_t sum;
+        double start, elapsed, old_rate, new_rate;
+        uint64_t lookups;
+        ivec4_t bbox;
+        struct old_glyphmap_t *old;
+        ftgl_glyphmap_t glyphmap;
+
+        keys = malloc(sizeof(*keys) * BENCH_KEYS);
+        old = calloc(1, sizeof(*old));
+        glyphmap = ftgl_glyphmap_create();
+        if (!keys || !old || !glyphmap) {
+                fprintf(stderr, "out of memory\n");
+                return -1;
+        }
+
+        bbox = ll_ivec4_create4i(0, 0, 16, 16);
+        for (i = 0; i < count; i++) {
+                if (old_glyphmap_insert(old, 32 + i, bbox, 1, 12, 9.0f, 0.0f) < 0 ||
+                    !ftgl_glyphmap_insert(glyphmap, 32 + i, 0, bbox, 1, 12, 9.0f, 0.0f)) {
+                        fprintf(stderr, "insert failed at %u\n", i);
+                        return -1;
+                }
+        }
+
+        state = 0x2545f491u;
+        for (i = 0; i < BENCH_KEYS; i++) {
+                keys[i] = 32 + bench_random(&state) % count;
+        }
+
+        sum = 0;
+        lookups = 0;
+        start = bench_now();
+        do {
+                for (i = 0; i < BENCH_KEYS; i++) {
+                        sum += (uintptr_t) old_glyphmap_find_glyph(old, keys[i]);
+                }
+                lookups += BENCH_KEYS;
+        } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+        old_rate = lookups / elapsed;
+        bench_sink = sum;
+
+        sum = 0;
+        lookups = 0;
+        start = bench_now();
+        do {
+                for (i = 0; i < BENCH_KEYS; i++) {
+                        sum += (uintptr_t) ftgl_glyphmap_find_glyph(glyphmap, keys[i]);
+                }
+                lookups += BENCH_KEYS;
+        } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+        new_rate = lookups / elapsed;
+        bench_sink = sum;
+
+        printf("%8u %14.3f %14.3f %9.1fx\n", count, old_rate * 1e-6,
+               new_rate * 1e-6, new_rate / old_rate);
+
+        ftgl_glyphmap_free(&glyphmap);
+        old_glyphmap_free(old);
+        free(keys);
+        return 0;
+}
+
+int main(void)
+{
+        static const uint32_t sizes[] = { 100, 10000, 60000 };
+        size_t i;
+
+        printf("%8s %14s %14s %10s\n", "glyphs", "chained M/s", "open M/s", "speedup");
+        for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+                if (bench_size(sizes[i]) < 0) {
+                        return EXIT_FAILURE;
+                }
+        }
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,246 @@
+/**
+ * @description: Compares FTGL_RENDERMODE_SDF_OUTLINE, where FreeType
+ * computes the field from the vector outline, against the bitmap paths
+ * FTGL_RENDERMODE_SDF_EDT and FTGL_RENDERMODE_SDF, which transform the
+ * rasterized coverage. Reports glyphs per second for loading a range
+ * into a fresh font in each mode and, taking the outline field as the
+ * exact distance, the error of the bitmap fields in pixels: over the
+ * whole band the outline field covers and within one pixel of the
+ * edge, where it decides the rendered antialiasing.
+ *
+ * cc -O2 -I.. outline.c -o outline $(pkg-config --cflags --libs freetype2) \
+ *    -lGLEW -lGLU -lGL -lm -lpthread
+ * ./outline font.ttf [spread]
+ */
+
+#define FTGL_IMPLEMENTATION
+#include "../font.h"
+#include "bench.h"
+
+#define BENCH_FIRST  0x21
+#define BENCH_LAST   0x17f
+
+typedef ftgl_return_t (*bench_map_t)(ftgl_sdf_t sdf, const unsigned char *img,
+                                     unsigned char *out, unsigned int width,
+                                     unsigned int height);
+
+struct bench_error_t {
+        double max;
+        double total;
+        size_t count;
+        double edge_max;
+        double edge_total;
+        size_t edge_count;
+};
+
+/**
+ * Loads BENCH_FIRST..BENCH_LAST into a fresh font in @mode and returns
+ * the glyphs per second, or a negative value on failure.
+ */
+static double bench_load(const char *path, ftgl_rendermode_t mode, float size,
+                         int spread)
+{
+        double start, elapsed;
+        size_t glyphs;
+        ftgl_font_t font;
+
+        if (!(font = ftgl_font_create_headless()) ||
+            ftgl_font_bind(font, path) != FTGL_NO_ERROR ||
+            ftgl_font_set_size(font, size) != FTGL_NO_ERROR ||
+            ftgl_font_set_rendermode(font, mode) != FTGL_NO_ERROR ||
+            ftgl_font_set_sdf_spread(font, spread) != FTGL_NO_ERROR) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                if (font) {
+                        ftgl_font_free(&font);
+                }
+                return -1.0;
+        }
+
+        start = bench_now();
+        if (ftgl_font_load_range(font, BENCH_FIRST, BENCH_LAST) != FTGL_NO_ERROR) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                ftgl_font_free(&font);
+                return -1.0;
+        }
+        elapsed = bench_now() - start;
+
+        glyphs = font->glyphmap->size;
+        ftgl_font_free(&font);
+        return glyphs / elapsed;
+}
+
+/**
+ * Runs @map over the coverage of @codepoint, padded by @spread so it
+ * reaches as far as the outline field, and accumulates how far its
+ * distances are from the ones FreeType computes from the outline.
+ */
+static int bench_compare(FT_Face face, ftgl_sdf_t sdf, bench_map_t map,
+                         uint32_t codepoint, int spread, struct bench_error_t *error)
+{
+        int x, y, u, v, left, top, width, height, ref_left, ref_top;
+        unsigned int ref_width, ref_rows, ref_pitch, row;
+        unsigned char *pixels, *reference;
+        double exact, e;
+        FT_Bitmap *bitmap;
+
+        if (FT_Load_Char(face, codepoint, FT_LOAD_DEFAULT) ||
+            face->glyph->format != FT_GLYPH_FORMAT_OUTLINE ||
+            face->glyph->outline.n_points == 0 ||
+            FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF)) {
+                return 0;
+        }
+
+        bitmap = &face->glyph->bitmap;
+        ref_left = face->glyph->bitmap_left;
+        ref_top = face->glyph->bitmap_top;
+        ref_width = bitmap->width;
+        ref_rows = bitmap->rows;
+        ref_pitch = abs(bitmap->pitch);
+        reference = malloc(ref_pitch * ref_rows);
+        if (!reference) {
+                return -1;
+        }
+        memcpy(reference, bitmap->buffer, ref_pitch * ref_rows);
+
+        if (FT_Load_Char(face, codepoint, FT_LOAD_RENDER)) {
+                free(reference);
+                return 0;
+        }
+
+        bitmap = &face->glyph->bitmap;
+        left = face->glyph->bitmap_left - spread;
+        top = face->glyph->bitmap_top + spread;
+        width = bitmap->width + 2 * spread;
+        height = bitmap->rows + 2 * spread;
+        pixels = calloc((size_t) width * height, 1);
+        if (!pixels) {
+                free(reference);
+                return -1;
+        }
+
+        for (row = 0; row < bitmap->rows; row++) {
+                memcpy(pixels + (row + spread) * width + spread,
+                       bitmap->buffer + row * bitmap->pitch, bitmap->width);
+        }
+
+        // The unscaled field, positive outside, is left in sdf->outside
+        map(sdf, pixels, pixels, width, height);
+
+        for (v = 0; v < (int) ref_rows; v++) {
+                for (u = 0; u < (int) ref_width; u++) {
+                        // Skip where the outline field saturates
+                        if (reference[v * ref_pitch + u] == 0 ||
+                            reference[v * ref_pitch + u] == 255) {
+                                continue;
+                        }
+
+                        x = ref_left + u - left;
+                        y = top - (ref_top - v);
+                        if (x < 0 || y < 0 || x >= width || y >= height) {
+                                continue;
+                        }
+
+                        exact = (reference[v * ref_pitch + u] - 128) * spread / 128.0;
+                        e = fabs(-sdf->outside[y * width + x] - exact);
+                        if (e > error->max) error->max = e;
+                        error->total += e;
+                        error->count++;
+                        if (fabs(exact) < 1.0) {
+                                if (e > error->edge_max) error->edge_max = e;
+                                error->edge_total += e;
+                                error->edge_count++;
+                        }
+                }
+        }
+
+        free(pixels);
+        free(reference);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        static const float sizes[] = { 16.0f, 32.0f, 64.0f };
+        static const struct {
+                const char *name;
+                ftgl_rendermode_t mode;
+                bench_map_t map;
+        } modes[] = {
+                { "outline", FTGL_RENDERMODE_SDF_OUTLINE, NULL },
+                { "sdf_edt", FTGL_RENDERMODE_SDF_EDT, ftgl_distance_map_edt },
+                { "sdf", FTGL_RENDERMODE_SDF, ftgl_distance_mapf },
+        };
+        size_t i, j;
+        uint32_t codepoint;
+        int spread;
+        double rate;
+        FT_Face face;
+        ftgl_sdf_t sdf;
+        struct bench_error_t error;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: %s font.ttf [spread]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        spread = argc > 2 ? atoi(argv[2]) : FTGL_FONT_SDF_SPREAD;
+        if (spread < FTGL_FONT_SDF_SPREAD_MIN || spread > FTGL_FONT_SDF_SPREAD_MAX) {
+                fprintf(stderr, "spread must be within %d-%d\n",
+                        FTGL_FONT_SDF_SPREAD_MIN, FTGL_FONT_SDF_SPREAD_MAX);
+                return EXIT_FAILURE;
+        }
+
+#ifndef FTGL_HAS_SDF_RENDERER
+        fprintf(stderr, "FreeType is too old for FTGL_RENDERMODE_SDF_OUTLINE\n");
+        return EXIT_FAILURE;
+#endif /* FTGL_HAS_SDF_RENDERER */
+
+        if (ftgl_font_library_init() != FTGL_NO_ERROR ||
+            FT_New_Face(ftgl_font_library, argv[1], 0, &face) ||
+            !(sdf = ftgl_sdf_create())) {
+                fprintf(stderr, "could not open %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+
+        printf("spread %d\n", spread);
+        printf("%-8s %4s %10s %10s %10s %10s %10s\n", "mode", "px", "glyphs/s",
+               "max px", "mean px", "edge max", "edge mean");
+        for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+                for (j = 0; j < sizeof(modes) / sizeof(*modes); j++) {
+                        if ((rate = bench_load(argv[1], modes[j].mode, sizes[i], spread)) < 0.0) {
+                                return EXIT_FAILURE;
+                        }
+
+                        if (!modes[j].map) {
+                                printf("%-8s %4.0f %10.0f %10s %10s %10s %10s\n",
+                                       modes[j].name, sizes[i], rate,
+                                       "exact", "-", "-", "-");
+                                continue;
+                        }
+
+                        // The spread is a library property shared with the fonts
+                        FT_Property_Set(ftgl_font_library, "sdf", "spread", &spread);
+                        FT_Property_Set(ftgl_font_library, "bsdf", "spread", &spread);
+                        FT_Set_Pixel_Sizes(face, 0, (FT_UInt) sizes[i]);
+
+                        memset(&error, 0, sizeof(error));
+                        for (codepoint = BENCH_FIRST; codepoint <= BENCH_LAST; codepoint++) {
+                                if (bench_compare(face, sdf, modes[j].map, codepoint,
+                                                  spread, &error) < 0) {
+                                        fprintf(stderr, "out of memory\n");
+                                        return EXIT_FAILURE;
+                                }
+                        }
+
+                        printf("%-8s %4.0f %10.0f %10.3f %10.3f %10.3f %10.3f\n",
+                               modes[j].name, sizes[i], rate, error.max,
+                               error.total / error.count, error.edge_max,
+                               error.edge_total / error.edge_count);
+                }
+        }
+
+        ftgl_sdf_free(&sdf);
+        FT_Done_Face(face);
+        ftgl_font_library_free();
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/**
+ * @description: Packs the rasterized glyph sizes of a real font with
+ * the skyline and MaxRects packers and reports, per mode, how many
+ * glyphs fit on one page in codepoint order, the page occupancy after
+ * that pass, the occupancy when the sizes are fed round-robin until
+ * the first insert fails (the packing efficiency proper) and the mean
+ * cost of a ftgl_packer_insert call.
+ *
+ * cc -O2 -I.. packer.c -o packer $(pkg-config --cflags --libs freetype2) \
+ *    -lGLEW -lGLU -lGL -lm -lpthread
+ * ./packer font.ttf
+ */
+
+#define FTGL_IMPLEMENTATION
+#include "../font.h"
+#include "bench.h"
+
+#define BENCH_ROUNDS 20
+
+struct bench_size_t {
+        int width;
+        int height;
+};
+
+/**
+ * Rasterizes U+0020..U+024F at @pixel_size and appends the padded
+ * cell sizes the atlas would ask the packer for, in codepoint order.
+ */
+static size_t bench_collect(FT_Face face, int pixel_size,
+                            struct bench_size_t *sizes, size_t count)
+{
+        uint32_t codepoint;
+
+        FT_Set_Pixel_Sizes(face, 0, pixel_size);
+        for (codepoint = 0x20; codepoint <= 0x24f; codepoint++) {
+                if (!FT_Get_Char_Index(face, codepoint) ||
+                    FT_Load_Char(face, codepoint, FT_LOAD_RENDER)) {
+                        continue;
+                }
+
+                sizes[count].width = face->glyph->bitmap.width
+                        + 2 * FTGL_GLYPH_OFFSET + FTGL_GLYPH_OFFSET;
+                sizes[count].height = face->glyph->bitmap.rows
+                        + 2 * FTGL_GLYPH_OFFSET + FTGL_GLYPH_OFFSET;
+                count++;
+        }
+        return count;
+}
+
+static void bench_mode(const char *name, ftgl_packmode_t mode, int page,
+                       const struct bench_size_t *sizes, size_t count)
+{
+        size_t i, round, placed;
+        double start, elapsed;
+        float occupancy;
+        ivec4_t rect;
+        ftgl_packer_t packer;
+
+        if (!(packer = ftgl_packer_create(mode, page, page))) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                return;
+        }
+
+        placed = 0;
+        start = bench_now();
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+                ftgl_packer_clear(packer);
+                placed = 0;
+                for (i = 0; i < count; i++) {
+                        if (ftgl_packer_insert(packer, sizes[i].width,
+                                               sizes[i].height, &rect) == FTGL_NO_ERROR) {
+                                placed++;
+                        }
+                }
+        }
+        elapsed = bench_now() - start;
+        occupancy = ftgl_packer_occupancy(packer);
+
+        ftgl_packer_clear(packer);
+        for (i = 0; ; i++) {
+                if (ftgl_packer_insert(packer, sizes[i % count].width,
+                                       sizes[i % count].height, &rect) != FTGL_NO_ERROR) {
+                        break;
+                }
+        }
+
+        printf("%-9s %5d %7zu/%-7zu %9.1f%% %9.1f%% %12.1f\n", name, page, placed,
+               count, 100.0f * occupancy, 100.0f * ftgl_packer_occupancy(packer),
+               elapsed / (BENCH_ROUNDS * count) * 1e9);
+        ftgl_packer_free(&packer);
+}
+
+int main(int argc, char **argv)
+{
+        static const int pixel_sizes[] = { 12, 16, 24, 32, 48, 64 };
+        static const int pages[] = { 512, 1024, 2048 };
+        size_t i, count;
+        FT_Face face;
+        struct bench_size_t *sizes;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: %s font.ttf\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (ftgl_font_library_init() != FTGL_NO_ERROR ||
+            FT_New_Face(ftgl_font_library, argv[1], 0, &face)) {
+                fprintf(stderr, "could not open %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+
+        sizes = malloc(sizeof(*sizes) * (0x250 - 0x20)
+                       * (sizeof(pixel_sizes) / sizeof(*pixel_sizes)));
+        if (!sizes) {
+                fprintf(stderr, "out of memory\n");
+                return EXIT_FAILURE;
+        }
+
+        count = 0;
+        for (i = 0; i < sizeof(pixel_sizes) / sizeof(*pixel_sizes); i++) {
+                count = bench_collect(face, pixel_sizes[i], sizes, count);
+        }
+
+        printf("%-9s %5s %15s %10s %10s %12s\n", "mode", "page", "placed",
+               "occupancy", "when full", "ns/insert");
+        for (i = 0; i < sizeof(pages) / sizeof(*pages); i++) {
+                bench_mode("skyline", FTGL_PACKMODE_SKYLINE, pages[i], sizes, count);
+                bench_mode("maxrects", FTGL_PACKMODE_MAXRECTS, pages[i], sizes, count);
+        }
+
+        free(sizes);
+        FT_Done_Face(face);
+        ftgl_font_library_free();
+        return EXIT_SUCCESS;
+}
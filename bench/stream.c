@@ -0,0 +1,150 @@
+/**
+ * @description: Streams frames of text through a ftgl_renderer_t on
+ * the in-memory stream backend, once persistently mapped and once
+ * orphaning its buffer, and checks what the backend recorded against
+ * what the renderer issued: one draw per atlas page, every queued
+ * index drawn, a fence per mapped frame waited on FTGL_RENDERER_SEGMENTS
+ * frames later and an upload per orphaned frame. Reports the cost of a
+ * frame and of a glyph. Exits with a failure on the first mismatch.
+ *
+ * cc -O2 -I.. stream.c -o stream $(pkg-config --cflags --libs freetype2) \
+ *    -lGLEW -lGLU -lGL -lm -lpthread
+ * ./stream font.ttf
+ */
+
+#define FTGL_IMPLEMENTATION
+#include "../font.h"
+#include "bench.h"
+
+#define BENCH_FRAMES 240
+#define BENCH_LABELS 32
+#define BENCH_QUADS  4096
+
+static int bench_check(const char *what, size_t got, size_t expected, size_t frame)
+{
+        if (got != expected) {
+                fprintf(stderr, "frame %zu: %s %zu, expected %zu\n", frame, what, got,
+                        expected);
+                return 0;
+        }
+        return 1;
+}
+
+static int bench_stream(const char *name, ftgl_stream_backend_t backend, ftgl_font_t small,
+                        ftgl_font_t large)
+{
+        static char labels[BENCH_LABELS][32];
+        static const vec4_t color = { { 1.0f, 1.0f, 1.0f, 1.0f } };
+        size_t frame, i, draws, indices, glyphs;
+        double start, elapsed;
+        struct ftgl_stream_stats_t stats;
+        const struct ftgl_stream_stats_t *recorded;
+        ftgl_renderer_t renderer;
+        ftgl_font_t font;
+        int len;
+
+        if (!(renderer = ftgl_renderer_create(BENCH_QUADS, backend))) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                return 0;
+        }
+
+        memset(&stats, 0, sizeof(stats));
+        glyphs = 0;
+        elapsed = 0.0;
+        for (frame = 0; frame < BENCH_FRAMES; frame++) {
+                start = bench_now();
+                for (i = 0; i < BENCH_LABELS; i++) {
+                        font = i & 1 ? large : small;
+                        len = snprintf(labels[i], sizeof(labels[i]), "label %zu, frame %zu",
+                                       i, frame);
+                        if (ftgl_renderer_add_utf8(renderer, font, labels[i], len,
+                                                   ll_vec2_create2f(0.0f, 20.0f * i),
+                                                   color) != FTGL_NO_ERROR) {
+                                break;
+                        }
+                }
+
+                if (i < BENCH_LABELS || ftgl_renderer_flush(renderer) != FTGL_NO_ERROR) {
+                        fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                        ftgl_renderer_free(&renderer);
+                        return 0;
+                }
+                elapsed += bench_now() - start;
+
+                indices = 0;
+                for (i = 0; i < renderer->ndraws; i++) {
+                        indices += renderer->draws[i].count;
+                }
+                draws = renderer->ndraws;
+                glyphs += indices / 6;
+
+                stats.draws += draws;
+                stats.indices += indices;
+                if (renderer->mapped) {
+                        if (draws > 0) stats.fences++;
+                        stats.waits = stats.fences > FTGL_RENDERER_SEGMENTS
+                                ? stats.fences - FTGL_RENDERER_SEGMENTS : 0;
+                } else if (indices > 0) {
+                        stats.uploads++;
+                }
+
+                recorded = ftgl_memory_buffer_stats(renderer->buffer);
+                if (!recorded ||
+                    !bench_check("draws", recorded->draws, stats.draws, frame) ||
+                    !bench_check("indices", recorded->indices, stats.indices, frame) ||
+                    !bench_check("uploads", recorded->uploads, stats.uploads, frame) ||
+                    !bench_check("fences", recorded->fences, stats.fences, frame) ||
+                    !bench_check("waits", recorded->waits, stats.waits, frame)) {
+                        ftgl_renderer_free(&renderer);
+                        return 0;
+                }
+        }
+
+        printf("%-8s %7zu %7zu %7zu %7zu %7zu %10.2f %10.1f\n", name, stats.draws,
+               stats.indices, stats.uploads, stats.fences, stats.waits,
+               elapsed / BENCH_FRAMES * 1e6, elapsed / glyphs * 1e9);
+        ftgl_renderer_free(&renderer);
+        return 1;
+}
+
+int main(int argc, char **argv)
+{
+        struct ftgl_stream_backend_t orphaning;
+        ftgl_font_t small, large;
+        int ok;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: %s font.ttf\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (ftgl_font_library_init() != FTGL_NO_ERROR ||
+            !(small = ftgl_font_create_headless()) ||
+            !(large = ftgl_font_create_headless()) ||
+            ftgl_font_bind(small, argv[1]) != FTGL_NO_ERROR ||
+            ftgl_font_bind(large, argv[1]) != FTGL_NO_ERROR ||
+            ftgl_font_set_size(small, 14.0f) != FTGL_NO_ERROR ||
+            ftgl_font_set_size(large, 32.0f) != FTGL_NO_ERROR) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                return EXIT_FAILURE;
+        }
+
+        // A non-NULL userdata makes the memory backend refuse to map
+        orphaning = ftgl_stream_backend_memory;
+        orphaning.userdata = &orphaning;
+
+        printf("%-8s %7s %7s %7s %7s %7s %10s %10s\n", "buffer", "draws", "indices",
+               "uploads", "fences", "waits", "us/frame", "ns/glyph");
+        ok = bench_stream("mapped", &ftgl_stream_backend_memory, small, large)
+                && bench_stream("orphaned", &orphaning, small, large);
+
+        ftgl_font_free(&small);
+        ftgl_font_free(&large);
+        ftgl_font_library_free();
+        if (!ok) {
+                return EXIT_FAILURE;
+        }
+
+        printf("ok\n");
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/**
+ * @description: Measures glyphs rasterized per second by
+ * ftgl_font_load_range as the worker pool grows (ftgl_font_set_threads),
+ * for a cheap (NORMAL) and an expensive (SDF_EDT) render mode. Every
+ * run starts from a fresh headless font so no glyph is cached.
+ *
+ * cc -O2 -I.. threads.c -o threads $(pkg-config --cflags --libs freetype2) \
+ *    -lGLEW -lGLU -lGL -lm -lpthread
+ * ./threads font.ttf [max-threads]
+ */
+
+#include <unistd.h>
+
+#define FTGL_IMPLEMENTATION
+#include "../font.h"
+#include "bench.h"
+
+#define BENCH_FIRST 0x20
+#define BENCH_LAST  0x52f
+#define BENCH_SIZE  48.0f
+
+/**
+ * Loads BENCH_FIRST..BENCH_LAST into a fresh font and returns the
+ * glyphs per second, or a negative value on failure.
+ */
+static double bench_run(const char *path, ftgl_rendermode_t mode, size_t threads,
+                        size_t *glyphs)
+{
+        double start, elapsed;
+        ftgl_font_t font;
+
+        if (!(font = ftgl_font_create_headless()) ||
+            ftgl_font_bind(font, path) != FTGL_NO_ERROR ||
+            ftgl_font_set_size(font, BENCH_SIZE) != FTGL_NO_ERROR ||
+            ftgl_font_set_rendermode(font, mode) != FTGL_NO_ERROR ||
+            ftgl_font_set_threads(font, threads) != FTGL_NO_ERROR) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                if (font) {
+                        ftgl_font_free(&font);
+                }
+                return -1.0;
+        }
+
+        start = bench_now();
+        if (ftgl_font_load_range(font, BENCH_FIRST, BENCH_LAST) != FTGL_NO_ERROR) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                ftgl_font_free(&font);
+                return -1.0;
+        }
+        elapsed = bench_now() - start;
+
+        *glyphs = font->glyphmap->size;
+        ftgl_font_free(&font);
+        return *glyphs / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+        static const struct {
+                const char *name;
+                ftgl_rendermode_t mode;
+        } modes[] = {
+                { "normal", FTGL_RENDERMODE_NORMAL },
+                { "sdf_edt", FTGL_RENDERMODE_SDF_EDT },
+        };
+        size_t i, threads, max_threads, glyphs;
+        double rate, base;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: %s font.ttf [max-threads]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        max_threads = argc > 2 ? strtoul(argv[2], NULL, 10)
+                : (size_t) sysconf(_SC_NPROCESSORS_ONLN) * 2;
+        if (max_threads < 1) {
+                max_threads = 1;
+        }
+
+        if (ftgl_font_library_init() != FTGL_NO_ERROR) {
+                fprintf(stderr, "%s\n", ftgl_log_pop_message());
+                return EXIT_FAILURE;
+        }
+
+        printf("%ld cpus online\n", sysconf(_SC_NPROCESSORS_ONLN));
+        printf("%-8s %7s %7s %12s %8s\n", "mode", "threads", "glyphs", "glyphs/s", "scaling");
+        for (i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+                base = 0.0;
+                for (threads = 1; threads <= max_threads; threads <<= 1) {
+                        if ((rate = bench_run(argv[1], modes[i].mode, threads, &glyphs)) < 0.0) {
+                                return EXIT_FAILURE;
+                        }
+
+                        if (threads == 1) {
+                                base = rate;
+                        }
+                        printf("%-8s %7zu %7zu %12.0f %7.2fx\n", modes[i].name, threads,
+                               glyphs, rate, rate / base);
+                }
+        }
+
+        ftgl_font_library_free();
+        return EXIT_SUCCESS;
+}
@@ -21,11 +21,28 @@
 #include FT_STROKER_H
 #include FT_LCD_FILTER_H
 #include FT_TRUETYPE_TABLES_H
+#include FT_ADVANCES_H
+#include FT_MODULE_H
+
+#ifdef FTGL_USE_HARFBUZZ
+#include <hb.h>
+#include <hb-ft.h>
+#endif /* FTGL_USE_HARFBUZZ */
+
+/* FT_RENDER_MODE_SDF and the "sdf" module arrived in FreeType 2.11 */
+#if FREETYPE_MAJOR > 2 || (FREETYPE_MAJOR == 2 && FREETYPE_MINOR >= 11)
+#define FTGL_HAS_SDF_RENDERER
+#endif
 
 #include <GL/glew.h>
 #include <float.h>
+#include <limits.h>
 #include <stdint.h>
 
+#ifndef FTGL_NO_THREADS
+#include <pthread.h>
+#endif /* FTGL_NO_THREADS */
+
 #include "linear.h"
 
 extern FT_Library ftgl_font_library;
@@ -70,8 +87,19 @@ typedef enum ftgl_return_t {
         FTGL_MEMORY_ERROR,
         FTGL_ARGUMENT_ERROR,
         FTGL_FREETYPE_ERROR,
+        FTGL_ATLAS_FULL_ERROR,
+        FTGL_IO_ERROR,
+        FTGL_CACHE_MISS_ERROR,
 } ftgl_return_t;
 
+typedef enum ftgl_glyph_flags_t {
+        /* A placeholder whose bitmap is still being rasterized */
+        FTGL_GLYPH_PENDING = 1 << 0,
+} ftgl_glyph_flags_t;
+
+/* Set on glyph keys that are FreeType glyph indices, not codepoints */
+#define FTGL_GLYPH_INDEX (0x80000000u)
+
 struct ftgl_glyph_t {
         /**
          * The bounding box of the glyph in the texture
@@ -91,6 +119,23 @@ struct ftgl_glyph_t {
          */
         uint32_t codepoint;
 
+        /**
+         * The atlas page whose texture holds the glyph
+         */
+        GLuint page;
+
+        /**
+         * The font generation (frame) in which the glyph was last
+         * used, see ftgl_font_next_frame. Used to pick glyphs for
+         * eviction when the atlas has a page budget.
+         */
+        uint32_t generation;
+
+        /**
+         * A combination of ftgl_glyph_flags_t.
+         */
+        uint32_t flags;
+
         /**
          * Glyph's left bearing expressed in integer pixels.
          */
@@ -119,17 +164,79 @@ struct ftgl_glyph_t {
 
 typedef struct ftgl_glyph_t *ftgl_glyph_t;
 
-struct ftgl_glyphlist_t {
-        ftgl_glyph_t glyph;
-        struct ftgl_glyphlist_t *next;
-};
+#define FTGL_FONT_GLYPHMAP_CAPACITY (64)
+#define FTGL_FONT_GLYPHMAP_RRATIO (0.7)
+#define FTGL_FONT_GLYPHMAP_RESIZEP(glyphmap)                            \
+        (((glyphmap)->used + 1) / (float) (glyphmap)->capacity >= FTGL_FONT_GLYPHMAP_RRATIO)
+#define FTGL_FONT_GLYPHMAP_CHUNK_SHIFT (8)
+#define FTGL_FONT_GLYPHMAP_CHUNK_SIZE (1 << FTGL_FONT_GLYPHMAP_CHUNK_SHIFT)
+#define FTGL_FONT_GLYPHMAP_EMPTY (UINT32_MAX)
+
+/* Codepoints below this value are resolved through a dense array instead of the hash table */
+#ifndef FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY
+#define FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY (256)
+#endif /* FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY */
 
-typedef struct ftgl_glyphlist_t *ftgl_glyphlist_t;
+struct ftgl_glyphslot_t {
+        /**
+         * The codepoint stored in this slot, kept inline so that
+         * probing never has to leave the slot array.
+         */
+        uint32_t codepoint;
 
-#define FTGL_FONT_GLYPHMAP_CAPACITY 23
+        /**
+         * Index of the glyph in the glyph chunks, or
+         * FTGL_FONT_GLYPHMAP_EMPTY when the slot is unused.
+         */
+        uint32_t index;
+};
 
 struct ftgl_glyphmap_t {
-        ftgl_glyphlist_t map[FTGL_FONT_GLYPHMAP_CAPACITY];
+        /**
+         * The number of glyphs stored in the map.
+         */
+        size_t size;
+
+        /**
+         * One past the highest glyph index ever handed out.
+         */
+        size_t top;
+
+        /**
+         * The number of occupied slots in @slots.
+         */
+        size_t used;
+
+        /**
+         * The number of slots, always a power of two.
+         */
+        size_t capacity;
+
+        /**
+         * Open-addressing table probed linearly.
+         */
+        struct ftgl_glyphslot_t *slots;
+
+        /**
+         * Glyphs are stored inline in fixed-size chunks which never
+         * move once allocated, so a glyph handle stays valid when the
+         * slot table grows.
+         */
+        size_t nchunks;
+        struct ftgl_glyph_t **chunks;
+
+        /**
+         * Indices of removed glyphs, reused before @top grows.
+         */
+        size_t nfree;
+        size_t free_capacity;
+        uint32_t *free;
+
+        /**
+         * Direct lookup for low codepoints (ASCII/Latin-1 by default),
+         * these glyphs never enter the hash table.
+         */
+        ftgl_glyph_t direct[FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY];
 };
 
 typedef struct ftgl_glyphmap_t *ftgl_glyphmap_t;
@@ -137,37 +244,416 @@ typedef struct ftgl_glyphmap_t *ftgl_glyphmap_t;
 #define FTGL_FONT_ATLAS_WIDTH  1024
 #define FTGL_FONT_ATLAS_HEIGHT 1024
 
+/* Empty texels kept around each glyph in the atlas */
+#define FTGL_GLYPH_OFFSET (1)
+
+/* FreeType's default spread, and the range its "sdf" module accepts */
+#define FTGL_FONT_SDF_SPREAD (8)
+#define FTGL_FONT_SDF_SPREAD_MIN (2)
+#define FTGL_FONT_SDF_SPREAD_MAX (32)
+
+/* How many times finer FTGL_RENDERMODE_SDF_SUPERSAMPLED rasterizes glyphs */
+#define FTGL_FONT_SDF_SUPERSAMPLE (4)
+#define FTGL_FONT_SDF_SUPERSAMPLE_MAX (16)
+
+/* Output texels per side of the tiles supersampled fields are made in */
+#ifndef FTGL_SDF_TILE
+#define FTGL_SDF_TILE (32)
+#endif /* FTGL_SDF_TILE */
+
+/* Columns transposed at once by the blocked column pass of the EDT */
+#define FTGL_EDT_BLOCK (16)
+
+/* The radius, in output texels, of the Lanczos window */
+#define FTGL_LANCZOS_SUPPORT (2)
+
+typedef enum ftgl_packmode_t {
+        FTGL_PACKMODE_SKYLINE,
+        FTGL_PACKMODE_MAXRECTS,
+} ftgl_packmode_t;
+
+#define FTGL_PACKER_CAPACITY (16)
+
+struct ftgl_packer_t {
+        /**
+         * FTGL_PACKMODE_SKYLINE  - Skyline bottom-left packing
+         * FTGL_PACKMODE_MAXRECTS - MaxRects best short side fit packing
+         */
+        ftgl_packmode_t mode;
+
+        /**
+         * The dimensions of the area being packed.
+         */
+        int width;
+        int height;
+
+        /**
+         * The total area of all rectangles packed so far.
+         */
+        size_t used;
+
+        /**
+         * For FTGL_PACKMODE_SKYLINE the nodes are the skyline segments
+         * stored as (x, y, width, unused), sorted by x.
+         * For FTGL_PACKMODE_MAXRECTS the nodes are the maximal free
+         * rectangles stored as (x, y, width, height).
+         */
+        size_t size;
+        size_t capacity;
+        ivec4_t *nodes;
+
+        /**
+         * Free rectangles below the skyline, made of space handed back
+         * through ftgl_packer_release or ftgl_packer_rebuild. Only used
+         * in FTGL_PACKMODE_SKYLINE, where they are tried before the
+         * skyline itself. In FTGL_PACKMODE_MAXRECTS released space goes
+         * straight back into @nodes.
+         */
+        size_t nfreed;
+        size_t freed_capacity;
+        ivec4_t *freed;
+};
+
+typedef struct ftgl_packer_t *ftgl_packer_t;
+
+#define FTGL_ATLAS_CAPACITY (1)
+#define FTGL_ATLAS_DIRTY_CAPACITY (16)
+
+/* Texels worth wasting on a merged upload to save a separate upload call */
+#define FTGL_ATLAS_DIRTY_SLACK (4096)
+
+typedef enum ftgl_atlas_flags_t {
+        FTGL_ATLAS_DEFERRED = 1 << 0, /* Only upload on ftgl_atlas_flush */
+} ftgl_atlas_flags_t;
+
+/**
+ * The hooks an atlas uses to manage the textures backing its pages.
+ * Texture handles are opaque to the atlas, they only have to be
+ * non-zero on success.
+ */
+struct ftgl_backend_t {
+        /**
+         * Creates a texture of @width by @height texels with @depth
+         * 8-bit channels each (1 or 3) and stores its handle in
+         * @texture.
+         */
+        ftgl_return_t (*create)(void *userdata, int width, int height,
+                                int depth, GLuint *texture);
+
+        /**
+         * Uploads @count regions of @pixels into @texture. @pixels
+         * points at the start of the CPU copy of the whole texture,
+         * @stride is its row length in texels and @depth the number
+         * of bytes per texel.
+         */
+        void (*upload)(void *userdata, GLuint texture, const ivec4_t *rects,
+                       size_t count, const unsigned char *pixels, int stride,
+                       int depth);
+
+        /**
+         * Releases @texture.
+         */
+        void (*destroy)(void *userdata, GLuint texture);
+
+        /**
+         * Passed as-is to every hook.
+         */
+        void *userdata;
+};
+
+typedef const struct ftgl_backend_t *ftgl_backend_t;
+
+extern const struct ftgl_backend_t ftgl_backend_opengl;
+extern const struct ftgl_backend_t ftgl_backend_memory;
+
+/**
+ * The hooks a renderer uses to stream vertices to the GPU. Buffer
+ * handles are opaque to the renderer, they only have to be non-zero
+ * on success.
+ */
+struct ftgl_stream_backend_t {
+        /**
+         * Creates a buffer of @size bytes and stores its handle in
+         * @buffer, and the vertex array its draws go through in
+         * @vertex_array. Stores a persistent, coherent mapping of the
+         * buffer in @mapped, or NULL when it can only be orphaned.
+         */
+        ftgl_return_t (*create)(void *userdata, size_t size, GLuint *buffer,
+                                GLuint *vertex_array, void **mapped);
+
+        /**
+         * Orphans the storage of an unmapped @buffer and fills it with
+         * @size bytes of @data.
+         */
+        void (*upload)(void *userdata, GLuint buffer, const void *data, size_t size);
+
+        /**
+         * Draws @count indices found @index_offset bytes into @buffer,
+         * whose vertices start @vertex_offset bytes into it, sampling
+         * @texture. Leaves the caller's vertex array bound.
+         */
+        void (*draw)(void *userdata, GLuint vertex_array, GLuint buffer, GLuint texture,
+                     size_t vertex_offset, size_t index_offset, size_t count);
+
+        /**
+         * Returns a fence that signals once the draws issued so far
+         * from @buffer are done with its vertices.
+         */
+        void *(*fence)(void *userdata, GLuint buffer);
+
+        /**
+         * Blocks until @fence, made for @buffer, signals, then
+         * releases it.
+         */
+        void (*wait)(void *userdata, GLuint buffer, void *fence);
+
+        /**
+         * Unmaps and releases @buffer and @vertex_array.
+         */
+        void (*destroy)(void *userdata, GLuint vertex_array, GLuint buffer, void *mapped);
+
+        /**
+         * Passed as-is to every hook.
+         */
+        void *userdata;
+};
+
+typedef const struct ftgl_stream_backend_t *ftgl_stream_backend_t;
+
+extern const struct ftgl_stream_backend_t ftgl_stream_backend_opengl;
+extern const struct ftgl_stream_backend_t ftgl_stream_backend_memory;
+
+/* What the memory stream backend saw happen to one of its buffers */
+struct ftgl_stream_stats_t {
+        size_t uploads;
+        size_t draws;
+
+        /**
+         * The indices drawn, summed over @draws.
+         */
+        size_t indices;
+
+        /**
+         * Fences created after draws from the buffer, and waited on.
+         */
+        size_t fences;
+        size_t waits;
+};
+
+struct ftgl_atlas_page_t {
+        /**
+         * Stores the texture for which
+         * the glyphs are stored inside of.
+         */
+        GLuint texture;
+
+        /**
+         * Decides where each glyph is stored inside of the texture.
+         */
+        ftgl_packer_t packer;
+
+        /**
+         * CPU copy of the texture, depth bytes per texel.
+         */
+        unsigned char *pixels;
+
+        /**
+         * Regions of @pixels written since the last flush, merged
+         * as they come in to keep the number of uploads low.
+         */
+        size_t ndirty;
+        ivec4_t dirty[FTGL_ATLAS_DIRTY_CAPACITY];
+};
+
+struct ftgl_atlas_t {
+        /**
+         * The dimensions of every page in the atlas.
+         */
+        int width;
+        int height;
+
+        /**
+         * The number of 8-bit channels per texel, 1 for coverage and
+         * single channel distance fields, 3 for FTGL_RENDERMODE_MSDF.
+         */
+        int depth;
+
+        /**
+         * The packing mode used for every page in the atlas.
+         */
+        ftgl_packmode_t packmode;
+
+        /**
+         * A combination of ftgl_atlas_flags_t values.
+         */
+        int flags;
+
+        /**
+         * Creates, fills and releases the page textures.
+         */
+        ftgl_backend_t backend;
+
+        /**
+         * The pages of the atlas, a new page is added whenever
+         * a glyph doesn't fit in any of the existing ones, so
+         * glyphs that are already resident never move.
+         */
+        size_t size;
+        size_t capacity;
+        struct ftgl_atlas_page_t *pages;
+
+        /**
+         * The maximum number of pages the atlas may grow to, or 0 for
+         * no limit. Once reached, ftgl_atlas_insert reports
+         * FTGL_ATLAS_FULL_ERROR instead of adding a page.
+         */
+        size_t max_pages;
+
+        /**
+         * The number of owners, fonts sharing the atlas through
+         * ftgl_font_set_atlas each hold one. ftgl_atlas_free only
+         * releases the atlas along with the last reference.
+         */
+        size_t refcount;
+};
+
+typedef struct ftgl_atlas_t *ftgl_atlas_t;
+
+struct ftgl_sdf_t {
+        /**
+         * The number of pixels each buffer below holds. Grown to fit
+         * the largest glyph seen so far and never shrunk, so turning
+         * a glyph into a distance field needs no allocations.
+         */
+        size_t capacity;
+
+        float *data;
+        float *gx;
+        float *gy;
+        float *outside;
+        float *inside;
+        short *distx;
+        short *disty;
+        unsigned char *coverage;
+
+        /**
+         * Scanline buffers for ftgl_distance_map_edt, holding one
+         * row or column plus a sentinel.
+         */
+        size_t span;
+        float *line;
+        float *parabola;
+        float *bounds;
+        int *vertices;
+        int *nearest;
+
+        /**
+         * The per-pixel stages, picked for the running CPU unless
+         * turned off with ftgl_sdf_set_simd.
+         */
+        const struct ftgl_sdf_kernels_t *kernels;
+
+        /**
+         * The colored edges of the outline being turned into a
+         * multi-channel field by ftgl_distance_map_msdf.
+         */
+        size_t nedges;
+        size_t edges_capacity;
+        struct ftgl_msdf_edge_t *edges;
+};
+
+typedef struct ftgl_sdf_t *ftgl_sdf_t;
+
+typedef enum ftgl_filter_t {
+        FTGL_FILTER_BOX,
+        FTGL_FILTER_LANCZOS,
+} ftgl_filter_t;
+
 typedef enum ftgl_rendermode_t {
         FTGL_RENDERMODE_NORMAL,
         FTGL_RENDERMODE_SDF,
+        FTGL_RENDERMODE_SDF_EDT,
+        FTGL_RENDERMODE_SDF_OUTLINE,
+        FTGL_RENDERMODE_MSDF,
+        FTGL_RENDERMODE_SDF_SUPERSAMPLED,
 } ftgl_rendermode_t;
 
-struct ftgl_font_t {
+typedef enum ftgl_source_kind_t {
+        FTGL_SOURCE_MAPPED,   /* A font file mapped into memory */
+        FTGL_SOURCE_COPIED,   /* A font file read into memory, without mmap */
+        FTGL_SOURCE_BORROWED, /* A caller-owned or embedded buffer */
+} ftgl_source_kind_t;
+
+/**
+ * The bytes of a font file, handed to FreeType with FT_New_Memory_Face
+ * so that every face opened on them reads the same memory. Sources for
+ * files are shared through a registry, opening the same path again
+ * only takes another reference.
+ */
+struct ftgl_source_t {
         /**
-         * Stores the texture for which
-         * the glyphs are stored inside of.
+         * The path the source was opened from, NULL for borrowed
+         * buffers, which never enter the registry.
          */
-        GLuint texture;
+        char *path;
 
         /**
-         * A face structure used to load glyphs,
-         * and faces.
+         * The font file. Must stay valid and unchanged for as long as
+         * any face uses it.
+         */
+        const unsigned char *data;
+        size_t size;
+
+        /**
+         * Decides how @data is released with the last reference.
+         */
+        ftgl_source_kind_t kind;
+        size_t refcount;
+
+        /**
+         * The face shared by every font bound to the source, each of
+         * them with an FT_Size of its own, and the number of fonts
+         * using it.
          */
         FT_Face face;
+        size_t faces;
+
+        /**
+         * The next source in the registry.
+         */
+        struct ftgl_source_t *next;
+};
+
+typedef struct ftgl_source_t *ftgl_source_t;
+
+#define FTGL_RUN_BUCKETS (64)
+#define FTGL_RUN_CACHE_CAPACITY (256)
+
+/* Runs a font caches even if they were all used in the current frame */
+#define FTGL_RUN_CACHE_LIMIT (1024)
+
+/* The most comma-separated features a run is shaped with */
+#define FTGL_SHAPE_FEATURES (16)
+
+struct ftgl_font_t {
+        /**
+         * Stores the textures for which
+         * the glyphs are stored inside of.
+         */
+        ftgl_atlas_t atlas;
 
         /**
-         * A vector containing the (x, y) coordinates
-         * for the next location to store the next
-         * glyph in the current texture
+         * A face structure used to load glyphs,
+         * and faces. Shared by every font bound to the
+         * same source, see ftgl_font_face.
          */
-        ivec2_t tbox;
+        FT_Face face;
 
         /**
-         * Internal Usage: The maximum height of a glyph in the
-         * currently row. When the current row is full, this value
-         * is used to move @tbox to the next row.
+         * The font's own size on @face, activated before the face is
+         * used on the font's behalf.
          */
-        GLuint tbox_yjump;
+        FT_Size face_size;
 
         /**
          * The factor to scale fonts by.
@@ -219,42 +705,455 @@ struct ftgl_font_t {
         /**
          * FTGL_RENDERMODE_NORMAL - Normal Bitmap rendering
          * FTGL_RENDERMODE_SDF    - Signed Distance Field (SDF) rendering
+         * FTGL_RENDERMODE_SDF_EDT - SDF from a linear-time exact EDT
+         * FTGL_RENDERMODE_SDF_OUTLINE - SDF computed by FreeType from
+         *                               the vector outlines
+         * FTGL_RENDERMODE_MSDF - Multi-channel (RGB) SDF computed from
+         *                        the colored outline edges, needs an
+         *                        RGB atlas, see ftgl_font_set_rendermode
+         * FTGL_RENDERMODE_SDF_SUPERSAMPLED - SDF from an exact EDT of the
+         *                                    outline rasterized at
+         *                                    @sdf_supersample times the
+         *                                    size, then filtered down
          */
         ftgl_rendermode_t rendermode;
-};
 
-typedef struct ftgl_font_t *ftgl_font_t;
+        /**
+         * How far, in pixels, FTGL_RENDERMODE_SDF_OUTLINE,
+         * FTGL_RENDERMODE_MSDF and FTGL_RENDERMODE_SDF_SUPERSAMPLED
+         * distance fields reach on either side of the outline.
+         */
+        int sdf_spread;
 
-#define FTGL_STRING_CAPACITY (4)
+        /**
+         * The supersampling factor and the reduction filter of
+         * FTGL_RENDERMODE_SDF_SUPERSAMPLED.
+         */
+        int sdf_supersample;
+        ftgl_filter_t sdf_filter;
 
-struct ftgl_string_t {
-        GLfloat width;
-        GLfloat height;
-        char updated;
+        /**
+         * Scratch space for distance fields made on the owning thread.
+         */
+        ftgl_sdf_t sdf;
 
-        size_t size;
-        size_t capacity;
-        char *data;
-};
+        /**
+         * The current frame, advanced by ftgl_font_next_frame. Every
+         * glyph lookup stamps the glyph with this value.
+         */
+        uint32_t generation;
 
-typedef struct ftgl_string_t *ftgl_string_t;
+        /**
+         * Non-zero when glyphs may be evicted to make room in an
+         * atlas that has reached its page budget.
+         */
+        char eviction;
 
-FTGLDEF void ftgl_log_message(const char *fmt, ...);
-FTGLDEF const char *ftgl_log_pop_message(void);
+        /**
+         * The number of glyphs evicted so far. Callers caching glyph
+         * UVs can compare this against a saved value to learn that
+         * some of them were invalidated.
+         */
+        size_t evictions;
 
-FTGLDEF ftgl_return_t   ftgl_font_library_init(void);
-FTGLDEF ftgl_return_t   ftgl_font_manager_insert(const char *name, const char *path, size_t ptsize);
-FTGLDEF ftgl_font_t     ftgl_font_manager_find(const char *name);
-FTGLDEF ftgl_font_t     ftgl_font_create(void);
-FTGLDEF ftgl_return_t   ftgl_font_bind(ftgl_font_t font, const char *path);
-FTGLDEF ftgl_return_t   ftgl_font_set_size(ftgl_font_t font, float size);
-FTGLDEF void            ftgl_computegradient(double *img, int w, int h, double *gx, double *gy);
-FTGLDEF double          ftgl_edgedf(double gx, double gy, double a);
+        /**
+         * Called with each glyph just before it is evicted, while
+         * its codepoint and bounding box are still intact.
+         */
+        void (*evict_callback)(struct ftgl_font_t *font,
+                               const struct ftgl_glyph_t *glyph,
+                               void *userdata);
+        void *evict_userdata;
+
+        /**
+         * The source and size the face was set up with, so that
+         * worker threads can open faces of their own on it.
+         */
+        ftgl_source_t source;
+        float size;
+
+        /**
+         * The threads rasterizing glyphs for bulk loads, or NULL
+         * when everything happens on the calling thread.
+         */
+        struct ftgl_pool_t *pool;
+
+        /**
+         * Shaped runs, chained by hash and listed from the most to
+         * the least recently used. Past FTGL_RUN_CACHE_CAPACITY the
+         * least recently used run is dropped if it wasn't used in the
+         * current frame, past FTGL_RUN_CACHE_LIMIT in any case.
+         */
+        struct ftgl_run_t *runs[FTGL_RUN_BUCKETS];
+        struct ftgl_run_t *runs_newest;
+        struct ftgl_run_t *runs_oldest;
+        size_t nruns;
+
+#ifdef FTGL_USE_HARFBUZZ
+        /**
+         * Shapes with @face, created on the first run.
+         */
+        hb_font_t *hb_font;
+#endif /* FTGL_USE_HARFBUZZ */
+};
+
+typedef struct ftgl_font_t *ftgl_font_t;
+
+/* A glyph of a shaped run, positions in pixels */
+struct ftgl_shaped_glyph_t {
+        /**
+         * The glyph's key in the font, a codepoint or a glyph index
+         * marked with FTGL_GLYPH_INDEX.
+         */
+        uint32_t key;
+
+        /**
+         * The byte offset of the text the glyph came from.
+         */
+        uint32_t cluster;
+
+        GLfloat x_advance;
+        GLfloat y_advance;
+        GLfloat x_offset;
+        GLfloat y_offset;
+};
+
+/**
+ * Text shaped by ftgl_font_shape, cached by the font under its text,
+ * size and features.
+ */
+struct ftgl_run_t {
+        uint64_t hash;
+        float size;
+        size_t len;
+        char *text;
+        char *features;
+
+        size_t count;
+        struct ftgl_shaped_glyph_t *glyphs;
+
+        /**
+         * The summed advance, and the tallest glyph once @measured.
+         */
+        GLfloat width;
+        GLfloat height;
+        char measured;
+
+        /**
+         * The frame the run was last used in.
+         */
+        uint32_t generation;
+
+        /**
+         * Renderers holding the run until their next flush. A pinned
+         * run dropped from the cache is freed by the last of them.
+         */
+        size_t pins;
+        char cached;
+
+        /**
+         * The neighbours in the run's hash chain, and in the font's
+         * list of runs by use.
+         */
+        struct ftgl_run_t *next;
+        struct ftgl_run_t *prev;
+        struct ftgl_run_t *newer;
+        struct ftgl_run_t *older;
+};
+
+typedef struct ftgl_run_t *ftgl_run_t;
+
+#define FTGL_STRING_CAPACITY (4)
+
+/* Bytes of a string whose advances are summed together */
+#define FTGL_STRING_CHUNK (64)
+
+/* Substituted for malformed UTF-8 sequences */
+#define FTGL_UTF8_REPLACEMENT (0xfffd)
+
+/* Stored for the bytes of a string that continue a sequence */
+#define FTGL_UTF8_CONTINUATION (0xffffffffu)
+
+/* The number of glyphs rasterized before they are packed and uploaded */
+#define FTGL_FONT_LOAD_BATCH (1024)
+
+/* The number of finished requests ftgl_font_poll commits per upload */
+#define FTGL_FONT_POLL_BATCH (64)
+
+/* The initial size of the request and result queues */
+#define FTGL_POOL_CAPACITY (16)
+
+/* "FTGL" in the byte order that wrote the cache, which must match ours */
+#define FTGL_CACHE_MAGIC (0x4c475446u)
+
+/* Bumped whenever the layout of the cache or of the glyphs in it changes */
+#define FTGL_CACHE_VERSION (1)
+
+struct ftgl_string_t {
+        GLfloat width;
+        GLfloat height;
+        char updated;
+
+        size_t size;
+        size_t capacity;
+        char *data;
+
+        /**
+         * The codepoint starting at every byte, FTGL_UTF8_CONTINUATION
+         * for the bytes following it in the same sequence. Decoded as
+         * the bytes are written.
+         */
+        uint32_t *codepoints;
+
+        /**
+         * The advance and height of every byte, as of the last layout
+         * with @font at @font_size.
+         */
+        vec2_t *metrics;
+        ftgl_font_t font;
+        float font_size;
+
+        /**
+         * The summed advance and tallest height of every chunk of
+         * FTGL_STRING_CHUNK bytes, and a Fenwick tree over their
+         * advances for prefix sums. The tree is kept in doubles so
+         * repeated edits don't drift.
+         */
+        size_t nchunks;
+        vec2_t *chunks;
+        double *tree;
+
+        /**
+         * The bytes edited since the last layout, and the size of the
+         * string back then.
+         */
+        size_t dirty_start;
+        size_t dirty_end;
+        size_t laid_out;
+
+        /**
+         * Shapes the string with these features, see ftgl_font_shape,
+         * when set. @reshape is set by every edit.
+         */
+        char *features;
+        char reshape;
+};
+
+typedef struct ftgl_string_t *ftgl_string_t;
+
+typedef enum ftgl_mesh_flags_t {
+        FTGL_MESH_COLOR  = 1 << 0, /* Vertices are ftgl_color_vertex_t */
+        FTGL_MESH_Y_DOWN = 1 << 1, /* Lines advance towards +y, as on screen */
+} ftgl_mesh_flags_t;
+
+/* The vertex layout written to meshes, positions in pixels */
+struct ftgl_vertex_t {
+        GLfloat x, y;
+        GLfloat u, v;
+};
+
+/* The vertex layout written to meshes created with FTGL_MESH_COLOR */
+struct ftgl_color_vertex_t {
+        GLfloat x, y;
+        GLfloat u, v;
+        GLubyte r, g, b, a;
+};
+
+/**
+ * Caller-owned buffers that laid out text is appended to, four
+ * vertices and six indices per visible glyph. Every glyph consumes
+ * at least one byte of UTF-8, so buffers of 4 vertices and 6 indices
+ * per byte of text always suffice.
+ */
+struct ftgl_mesh_t {
+        /**
+         * ftgl_vertex_t, or ftgl_color_vertex_t with FTGL_MESH_COLOR,
+         * and the number of them written and available.
+         */
+        void *vertices;
+        size_t nvertices;
+        size_t vertex_capacity;
+
+        /**
+         * Two triangles per glyph, counter-clockwise in y-up space.
+         */
+        GLuint *indices;
+        size_t nindices;
+        size_t index_capacity;
+
+        /**
+         * A combination of ftgl_mesh_flags_t values.
+         */
+        int flags;
+
+        /**
+         * Written to every vertex with FTGL_MESH_COLOR.
+         */
+        GLubyte color[4];
+
+        /**
+         * Only glyphs on this atlas page are written, so the mesh is
+         * drawn with a single texture. Visible glyphs on other pages
+         * are counted in @skipped, the text needs a mesh for each of
+         * their pages as well.
+         */
+        GLuint page;
+        size_t skipped;
+};
+
+typedef struct ftgl_mesh_t *ftgl_mesh_t;
+
+/* Frames the GPU may lag behind before a renderer waits on it */
+#define FTGL_RENDERER_SEGMENTS (3)
+#define FTGL_RENDERER_CAPACITY (16)
+
+/* Text queued on a renderer until the next ftgl_renderer_flush */
+struct ftgl_text_run_t {
+        ftgl_font_t font;
+        ftgl_run_t shaped;
+        const char *text;
+        size_t len;
+        vec2_t pen;
+        GLubyte color[4];
+        char done;
+};
+
+/* A single draw of a renderer, the indices of one atlas page */
+struct ftgl_draw_t {
+        GLuint texture;
+        size_t first;
+        size_t count;
+};
+
+/**
+ * Batches text from any number of fonts into a ring of vertex memory,
+ * so every frame costs one upload and one draw per atlas page. The
+ * ring is split into FTGL_RENDERER_SEGMENTS segments, each frame
+ * writes the next one after waiting on the fence of the frame that
+ * last used it. Without persistent mapping a single segment is staged
+ * on the CPU and the buffer is orphaned on every upload instead.
+ */
+struct ftgl_renderer_t {
+        ftgl_stream_backend_t backend;
+        GLuint buffer;
+
+        /**
+         * Holds the attribute layout of @buffer, bound only while the
+         * renderer draws.
+         */
+        GLuint vertex_array;
+
+        /**
+         * The mapped ring, or NULL when the renderer orphans @buffer
+         * and writes to @staging instead.
+         */
+        unsigned char *mapped;
+        unsigned char *staging;
+
+        /**
+         * Each segment holds @quads quads, their vertices first and
+         * their indices @index_offset bytes in.
+         */
+        size_t quads;
+        size_t segment_size;
+        size_t index_offset;
+
+        size_t frame;
+        void *fences[FTGL_RENDERER_SEGMENTS];
+
+        size_t nruns;
+        size_t runs_capacity;
+        struct ftgl_text_run_t *runs;
+
+        /**
+         * The draws issued by the last flush.
+         */
+        size_t ndraws;
+        size_t draws_capacity;
+        struct ftgl_draw_t *draws;
+};
+
+typedef struct ftgl_renderer_t *ftgl_renderer_t;
+
+FTGLDEF void ftgl_log_message(const char *fmt, ...);
+FTGLDEF const char *ftgl_log_pop_message(void);
+FTGLDEF uint32_t ftgl_utf8_decode(const char *s, size_t len, size_t *advance);
+FTGLDEF size_t   ftgl_utf8_decode_string(const char *s, size_t len, uint32_t *codepoints);
+
+FTGLDEF ftgl_packer_t   ftgl_packer_create(ftgl_packmode_t mode, int width, int height);
+FTGLDEF ftgl_return_t   ftgl_packer_insert(ftgl_packer_t packer, int width, int height, ivec4_t *rect);
+FTGLDEF ftgl_return_t   ftgl_packer_release(ftgl_packer_t packer, ivec4_t rect);
+FTGLDEF ftgl_return_t   ftgl_packer_rebuild(ftgl_packer_t packer, const ivec4_t *occupied, size_t count);
+FTGLDEF float           ftgl_packer_occupancy(ftgl_packer_t packer);
+FTGLDEF void            ftgl_packer_clear(ftgl_packer_t packer);
+FTGLDEF void            ftgl_packer_free(ftgl_packer_t *packer);
+FTGLDEF const unsigned char *ftgl_memory_texture_pixels(GLuint texture);
+FTGLDEF const unsigned char *ftgl_memory_buffer_data(GLuint buffer);
+FTGLDEF const struct ftgl_stream_stats_t *ftgl_memory_buffer_stats(GLuint buffer);
+FTGLDEF ftgl_atlas_t    ftgl_atlas_create(int width, int height, int depth, ftgl_packmode_t packmode, int flags, ftgl_backend_t backend);
+FTGLDEF ftgl_atlas_t    ftgl_atlas_retain(ftgl_atlas_t atlas);
+FTGLDEF ftgl_return_t   ftgl_atlas_set_max_pages(ftgl_atlas_t atlas, size_t max_pages);
+FTGLDEF void            ftgl_atlas_set_deferred(ftgl_atlas_t atlas, int deferred);
+FTGLDEF ftgl_return_t   ftgl_atlas_insert(ftgl_atlas_t atlas, int width, int height, ivec4_t *rect, GLuint *page);
+FTGLDEF ftgl_return_t   ftgl_atlas_release(ftgl_atlas_t atlas, GLuint page, ivec4_t rect);
+FTGLDEF ftgl_return_t   ftgl_atlas_rebuild(ftgl_atlas_t atlas, GLuint page, const ivec4_t *occupied, size_t count);
+FTGLDEF void            ftgl_atlas_write(ftgl_atlas_t atlas, GLuint page, ivec4_t rect, const unsigned char *buffer);
+FTGLDEF void            ftgl_atlas_flush(ftgl_atlas_t atlas);
+FTGLDEF float           ftgl_atlas_occupancy(ftgl_atlas_t atlas);
+FTGLDEF void            ftgl_atlas_free(ftgl_atlas_t *atlas);
+FTGLDEF ftgl_return_t   ftgl_font_library_init(void);
+FTGLDEF ftgl_return_t   ftgl_font_manager_insert(const char *name, const char *path, size_t ptsize);
+FTGLDEF ftgl_font_t     ftgl_font_manager_find(const char *name);
+FTGLDEF ftgl_font_t     ftgl_font_create(void);
+FTGLDEF ftgl_font_t     ftgl_font_create_with_backend(ftgl_backend_t backend);
+FTGLDEF ftgl_font_t     ftgl_font_create_headless(void);
+FTGLDEF ftgl_source_t   ftgl_source_open(const char *path);
+FTGLDEF ftgl_source_t   ftgl_source_create_memory(const unsigned char *data, size_t size);
+FTGLDEF void            ftgl_source_release(ftgl_source_t *source);
+FTGLDEF ftgl_return_t   ftgl_font_bind_source(ftgl_font_t font, ftgl_source_t source);
+FTGLDEF ftgl_return_t   ftgl_font_bind_memory(ftgl_font_t font, const unsigned char *data, size_t size);
+FTGLDEF ftgl_return_t   ftgl_font_bind(ftgl_font_t font, const char *path);
+FTGLDEF ftgl_return_t   ftgl_font_set_size(ftgl_font_t font, float size);
+FTGLDEF ftgl_return_t   ftgl_font_set_packmode(ftgl_font_t font, ftgl_packmode_t mode);
+FTGLDEF ftgl_return_t   ftgl_font_set_atlas(ftgl_font_t font, ftgl_atlas_t atlas);
+FTGLDEF ftgl_return_t   ftgl_font_set_sdf_spread(ftgl_font_t font, int spread);
+FTGLDEF ftgl_return_t   ftgl_font_set_rendermode(ftgl_font_t font, ftgl_rendermode_t mode);
+FTGLDEF ftgl_return_t   ftgl_font_set_sdf_supersample(ftgl_font_t font, int factor, ftgl_filter_t filter);
+FTGLDEF float           ftgl_font_atlas_occupancy(ftgl_font_t font);
+FTGLDEF size_t          ftgl_font_page_count(ftgl_font_t font);
+FTGLDEF GLuint          ftgl_font_texture(ftgl_font_t font, GLuint page);
+FTGLDEF const unsigned char *ftgl_font_pixels(ftgl_font_t font, GLuint page);
+FTGLDEF ftgl_return_t   ftgl_font_set_deferred(ftgl_font_t font, int deferred);
+FTGLDEF void            ftgl_font_flush(ftgl_font_t font);
+FTGLDEF ftgl_return_t   ftgl_font_set_eviction(ftgl_font_t font, size_t max_pages);
+FTGLDEF void            ftgl_font_set_evict_callback(ftgl_font_t font, void (*callback)(ftgl_font_t, const struct ftgl_glyph_t *, void *), void *userdata);
+FTGLDEF void            ftgl_font_next_frame(ftgl_font_t font);
+FTGLDEF ftgl_return_t   ftgl_font_set_threads(ftgl_font_t font, size_t threads);
+FTGLDEF ftgl_glyph_t    ftgl_font_request_glyph(ftgl_font_t font, uint32_t codepoint);
+FTGLDEF size_t          ftgl_font_poll(ftgl_font_t font, size_t max);
+FTGLDEF ftgl_return_t   ftgl_font_cache_save(ftgl_font_t font, const char *path);
+FTGLDEF ftgl_return_t   ftgl_font_cache_load(ftgl_font_t font, const char *path);
+FTGLDEF void            ftgl_computegradient(double *img, int w, int h, double *gx, double *gy);
+FTGLDEF double          ftgl_edgedf(double gx, double gy, double a);
 FTGLDEF double          ftgl_distaa3(double *img, double *gximg, double *gyimg, int w, int c, int xc, int yc, int xi, int yi);
 FTGLDEF void            ftgl_edtaa3(double *img, double *gx, double *gy, int w, int h, short *distx, short *disty, double *dist);
 FTGLDEF double *        ftgl_distance_mapd(double *data, unsigned int width, unsigned int height);
 FTGLDEF unsigned char * ftgl_distance_mapb(unsigned char *img, unsigned int width, unsigned int height);
+FTGLDEF void            ftgl_computegradientf(float *img, int w, int h, float *gx, float *gy);
+FTGLDEF float           ftgl_edgedff(float gx, float gy, float a);
+FTGLDEF float           ftgl_distaa3f(float *img, float *gximg, float *gyimg, int w, int c, int xc, int yc, int xi, int yi);
+FTGLDEF void            ftgl_edtaa3f(float *img, float *gx, float *gy, int w, int h, short *distx, short *disty, float *dist);
+FTGLDEF ftgl_sdf_t      ftgl_sdf_create(void);
+FTGLDEF void            ftgl_sdf_set_simd(ftgl_sdf_t sdf, int enabled);
+FTGLDEF ftgl_return_t   ftgl_distance_mapf(ftgl_sdf_t sdf, const unsigned char *img, unsigned char *out, unsigned int width, unsigned int height);
+FTGLDEF ftgl_return_t   ftgl_distance_map_edt(ftgl_sdf_t sdf, const unsigned char *img, unsigned char *out, unsigned int width, unsigned int height);
+FTGLDEF ftgl_return_t   ftgl_distance_map_msdf(ftgl_sdf_t sdf, FT_Library library, FT_Outline *outline, unsigned char *out, unsigned int width, unsigned int height, int left, int top, float spread);
+FTGLDEF ftgl_return_t   ftgl_distance_map_supersampled(ftgl_sdf_t sdf, FT_Library library, FT_Outline *outline, unsigned char *out, unsigned int width, unsigned int height, int left, int top, float spread, int factor, ftgl_filter_t filter);
+FTGLDEF void            ftgl_sdf_free(ftgl_sdf_t *sdf);
 FTGLDEF ftgl_glyph_t    ftgl_font_load_codepoint(ftgl_font_t font, uint32_t codepoint);
+FTGLDEF ftgl_return_t   ftgl_font_load_codepoints(ftgl_font_t font, const uint32_t *codepoints, size_t count);
+FTGLDEF ftgl_return_t   ftgl_font_load_range(ftgl_font_t font, uint32_t first, uint32_t last);
+FTGLDEF ftgl_return_t   ftgl_font_load_utf8(ftgl_font_t font, const char *text, size_t len);
 FTGLDEF ftgl_glyph_t    ftgl_font_find_glyph(ftgl_font_t font, uint32_t codepoint);
 FTGLDEF vec2_t          ftgl_font_string_dimensions(const char *source, ftgl_font_t font);
 FTGLDEF ftgl_string_t   ftgl_string_create(size_t reserve);
@@ -262,16 +1161,47 @@ FTGLDEF ftgl_return_t   ftgl_string_write_at(ftgl_string_t s, ftgl_font_t font,
 FTGLDEF ftgl_return_t   ftgl_string_write(ftgl_string_t s, ftgl_font_t font, char *buffer, size_t buffer_len);
 FTGLDEF ftgl_return_t   ftgl_string_append(ftgl_string_t s, ftgl_font_t font, char *buffer, size_t buffer_len);
 FTGLDEF vec2_t          ftgl_string_dimensions(ftgl_string_t s, ftgl_font_t font);
+FTGLDEF GLfloat         ftgl_string_advance_to(ftgl_string_t s, ftgl_font_t font, size_t pos);
+FTGLDEF ftgl_return_t   ftgl_string_set_features(ftgl_string_t s, const char *features);
+FTGLDEF ftgl_run_t      ftgl_font_shape(ftgl_font_t font, const char *text, size_t len, const char *features);
+FTGLDEF vec2_t          ftgl_run_dimensions(ftgl_font_t font, ftgl_run_t run);
+FTGLDEF void            ftgl_mesh_init(ftgl_mesh_t mesh, void *vertices, size_t vertex_capacity, GLuint *indices, size_t index_capacity, int flags);
+FTGLDEF void            ftgl_mesh_clear(ftgl_mesh_t mesh);
+FTGLDEF ftgl_return_t   ftgl_mesh_utf8(ftgl_mesh_t mesh, ftgl_font_t font, const char *text, size_t len, vec2_t *pen);
+FTGLDEF ftgl_return_t   ftgl_mesh_string(ftgl_mesh_t mesh, ftgl_font_t font, ftgl_string_t s, vec2_t *pen);
+FTGLDEF ftgl_return_t   ftgl_mesh_run(ftgl_mesh_t mesh, ftgl_font_t font, ftgl_run_t run, vec2_t *pen);
+FTGLDEF ftgl_renderer_t ftgl_renderer_create(size_t quads, ftgl_stream_backend_t backend);
+FTGLDEF ftgl_return_t   ftgl_renderer_add_utf8(ftgl_renderer_t renderer, ftgl_font_t font, const char *text, size_t len, vec2_t pen, vec4_t color);
+FTGLDEF ftgl_return_t   ftgl_renderer_add_string(ftgl_renderer_t renderer, ftgl_font_t font, ftgl_string_t s, vec2_t pen, vec4_t color);
+FTGLDEF ftgl_return_t   ftgl_renderer_add_run(ftgl_renderer_t renderer, ftgl_font_t font, ftgl_run_t run, vec2_t pen, vec4_t color);
+FTGLDEF ftgl_return_t   ftgl_renderer_flush(ftgl_renderer_t renderer);
+FTGLDEF void            ftgl_renderer_free(ftgl_renderer_t *renderer);
 FTGLDEF void            ftgl_string_free(ftgl_string_t *s);
 FTGLDEF void            ftgl_font_free(ftgl_font_t *font);
 FTGLDEF void            ftgl_font_library_free(void);
 
 #ifdef FTGL_IMPLEMENTATION
 
+#if !defined(FTGL_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FTGL_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if !defined(FTGL_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define FTGL_HAS_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifdef FTGL_LOG
 static char ftgl_log_stack[FTGL_LOG_STACK_CAPACITY][FTGL_LOG_MESSAGE_CAPACITY];
 static int ftgl_log_stack_ptr;
 static int ftgl_log_stack_size;
+#ifndef FTGL_NO_THREADS
+static pthread_mutex_t ftgl_log_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* FTGL_NO_THREADS */
 
 static int ftgl_log_empty(void)
 {
@@ -288,6 +1218,10 @@ FTGLDEF void ftgl_log_message(const char *fmt, ...)
 {
 #ifdef FTGL_LOG
         va_list args;
+#ifndef FTGL_NO_THREADS
+        // Worker threads may fail while rasterizing
+        pthread_mutex_lock(&ftgl_log_lock);
+#endif /* FTGL_NO_THREADS */
         if (!ftgl_log_full()) {
                 ftgl_log_stack_size++;
         }
@@ -297,6 +1231,9 @@ FTGLDEF void ftgl_log_message(const char *fmt, ...)
                   FTGL_LOG_MESSAGE_CAPACITY - 1, fmt, args);
         va_end(args);
         ftgl_log_stack_ptr = (ftgl_log_stack_ptr + 1) % FTGL_LOG_STACK_CAPACITY;
+#ifndef FTGL_NO_THREADS
+        pthread_mutex_unlock(&ftgl_log_lock);
+#endif /* FTGL_NO_THREADS */
 #else /* !defined(FTGL_LOG) */
         (void) 0;
 #endif /* FTGL_LOG */
@@ -319,6 +1256,131 @@ FTGLDEF const char *ftgl_log_pop_message(void)
 #endif /* FTGL_LOG */
 }
 
+FTGLDEF uint32_t ftgl_utf8_decode(const char *s, size_t len, size_t *advance)
+{
+        const unsigned char *u;
+        uint32_t codepoint, min;
+        size_t i, n;
+
+        u = (const unsigned char *) s;
+        if (len == 0) {
+                *advance = 0;
+                return FTGL_UTF8_REPLACEMENT;
+        }
+
+        if (u[0] < 0x80) {
+                *advance = 1;
+                return u[0];
+        } else if ((u[0] & 0xe0) == 0xc0) {
+                n = 2;
+                min = 0x80;
+                codepoint = u[0] & 0x1f;
+        } else if ((u[0] & 0xf0) == 0xe0) {
+                n = 3;
+                min = 0x800;
+                codepoint = u[0] & 0x0f;
+        } else if ((u[0] & 0xf8) == 0xf0) {
+                n = 4;
+                min = 0x10000;
+                codepoint = u[0] & 0x07;
+        } else {
+                *advance = 1;
+                return FTGL_UTF8_REPLACEMENT;
+        }
+
+        for (i = 1; i < n; i++) {
+                if (i >= len || (u[i] & 0xc0) != 0x80) {
+                        *advance = i;
+                        return FTGL_UTF8_REPLACEMENT;
+                }
+                codepoint = (codepoint << 6) | (u[i] & 0x3f);
+        }
+
+        *advance = n;
+        // Reject overlong forms, surrogates and values past U+10FFFF
+        if (codepoint < min || codepoint > 0x10ffff
+            || (codepoint >= 0xd800 && codepoint <= 0xdfff)) {
+                return FTGL_UTF8_REPLACEMENT;
+        }
+        return codepoint;
+}
+
+/**
+ * Widens the ASCII bytes @u starts with into @codepoints, at most @len
+ * of them, and returns how many there were.
+ */
+static inline size_t ftgl_utf8_widen_ascii(const unsigned char *u, size_t len,
+                                           uint32_t *codepoints)
+{
+        size_t i;
+        uint64_t word;
+#if defined(FTGL_SIMD_X86) && defined(__SSE2__)
+        __m128i zero, bytes, lo, hi;
+        int mask;
+
+        zero = _mm_setzero_si128();
+        for (i = 0; i + 16 <= len; i += 16) {
+                bytes = _mm_loadu_si128((const __m128i *) (u + i));
+                if ((mask = _mm_movemask_epi8(bytes))) {
+                        len = i + __builtin_ctz(mask);
+                        break;
+                }
+
+                lo = _mm_unpacklo_epi8(bytes, zero);
+                hi = _mm_unpackhi_epi8(bytes, zero);
+                _mm_storeu_si128((__m128i *) (codepoints + i), _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128((__m128i *) (codepoints + i + 4), _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128((__m128i *) (codepoints + i + 8), _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128((__m128i *) (codepoints + i + 12), _mm_unpackhi_epi16(hi, zero));
+        }
+#else /* !(FTGL_SIMD_X86 && __SSE2__) */
+        i = 0;
+#endif /* FTGL_SIMD_X86 && __SSE2__ */
+        for (; i + 8 <= len; i += 8) {
+                memcpy(&word, u + i, sizeof(word));
+                if (word & 0x8080808080808080ull) break;
+                codepoints[i] = u[i];
+                codepoints[i + 1] = u[i + 1];
+                codepoints[i + 2] = u[i + 2];
+                codepoints[i + 3] = u[i + 3];
+                codepoints[i + 4] = u[i + 4];
+                codepoints[i + 5] = u[i + 5];
+                codepoints[i + 6] = u[i + 6];
+                codepoints[i + 7] = u[i + 7];
+        }
+
+        for (; i < len && u[i] < 0x80; i++) {
+                codepoints[i] = u[i];
+        }
+        return i;
+}
+
+/**
+ * Decodes @len bytes of UTF-8 into @codepoints, which needs room for
+ * @len entries, and returns how many it wrote. Runs of ASCII are
+ * copied without going through the decoder.
+ */
+FTGLDEF size_t ftgl_utf8_decode_string(const char *s, size_t len, uint32_t *codepoints)
+{
+        const unsigned char *u;
+        size_t i, count, advance;
+
+        u = (const unsigned char *) s;
+        for (i = 0, count = 0; i < len; i += advance) {
+                if (u[i] < 0x80 && (i + 1 == len || u[i + 1] >= 0x80)) {
+                        // Lone ASCII between sequences, not worth a run
+                        codepoints[count++] = u[i];
+                        advance = 1;
+                } else if (u[i] < 0x80) {
+                        advance = ftgl_utf8_widen_ascii(u + i, len - i, codepoints + count);
+                        count += advance;
+                } else {
+                        codepoints[count++] = ftgl_utf8_decode(s + i, len - i, &advance);
+                }
+        }
+        return count;
+}
+
 struct ftgl_font_node_t {
         char *name;
         ftgl_font_t font;
@@ -349,625 +1411,3672 @@ static FT_F26Dot6 ftgl_float_to_F26Dot6(float value)
         return (FT_F26Dot6) (value * 64.0);
 }
 
-static ftgl_glyph_t ftgl_glyph_create4iv(uint32_t codepoint, ivec4_t bbox, GLint offset_x,
-                                         GLint offset_y, GLfloat advance_x, GLfloat advance_y)
+static inline size_t ftgl_glyphmap_hash(uint32_t codepoint, size_t capacity)
 {
-        ftgl_glyph_t glyph;
-        glyph = FTGL_MALLOC(sizeof(*glyph));
-        if (!glyph) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return NULL;
-        }
-
-        glyph->bbox = bbox;
-        glyph->codepoint = codepoint;
-        glyph->offset_x = offset_x;
-        glyph->offset_y = offset_y;
-        glyph->advance_x = advance_x;
-        glyph->advance_y = advance_y;
-        return glyph;
+        uint32_t hash;
+        hash = codepoint * 0x9e3779b1;
+        hash ^= hash >> 16;
+        return hash & (capacity - 1);
 }
 
-static void ftgl_glyph_free(ftgl_glyph_t *glyph)
+static inline ftgl_glyph_t ftgl_glyphmap_glyph(ftgl_glyphmap_t glyphmap, uint32_t index)
 {
-        (*glyph)->bbox = ll_ivec4_create4i(0,0,0,0);
-        (*glyph)->codepoint = 0;
-        (*glyph)->offset_x = 0;
-        (*glyph)->offset_y = 0;
-        (*glyph)->advance_x = 0;
-        (*glyph)->advance_y = 0;
-        FTGL_FREE(*glyph);
+        return &glyphmap->chunks[index >> FTGL_FONT_GLYPHMAP_CHUNK_SHIFT]
+                [index & (FTGL_FONT_GLYPHMAP_CHUNK_SIZE - 1)];
 }
 
-static ftgl_glyphlist_t ftgl_glyphlist_create4iv(uint32_t codepoint, ivec4_t bbox, GLint offset_x,
-                                                 GLint offset_y, GLfloat advance_x, GLfloat advance_y)
+static ftgl_glyphmap_t ftgl_glyphmap_create(void)
 {
-        ftgl_glyphlist_t glyphlist;
-        ftgl_glyph_t glyph;
-
-        glyph = ftgl_glyph_create4iv(codepoint, bbox, offset_x,
-                                     offset_y, advance_x, advance_y);
-        if (!glyph) {
+        size_t i;
+        ftgl_glyphmap_t glyphmap;
+        glyphmap = FTGL_MALLOC(sizeof(*glyphmap));
+        if (!glyphmap) {
                 FTGL_LOG_MESSAGE("Ran out of memory!");
                 return NULL;
         }
 
-        glyphlist = FTGL_MALLOC(sizeof(*glyphlist));
-        if (!glyphlist) {
+        glyphmap->size = 0;
+        glyphmap->top = 0;
+        glyphmap->used = 0;
+        glyphmap->capacity = FTGL_FONT_GLYPHMAP_CAPACITY;
+        glyphmap->slots = FTGL_MALLOC(sizeof(*glyphmap->slots) * glyphmap->capacity);
+        if (!glyphmap->slots) {
                 FTGL_LOG_MESSAGE("Ran out of memory!");
-                ftgl_glyph_free(&glyph);
+                FTGL_FREE(glyphmap);
                 return NULL;
         }
 
-        glyphlist->glyph = glyph;
-        glyphlist->next = NULL;
-        return glyphlist;
-}
-
-static void ftgl_glyphlist_free(ftgl_glyphlist_t *glyphlist)
-{
-        ftgl_glyph_free(&(*glyphlist)->glyph);
-        (*glyphlist)->glyph = NULL;
-        (*glyphlist)->next = NULL;
-        FTGL_FREE(*glyphlist);
-}
-
-static ftgl_glyphmap_t ftgl_glyphmap_create(void)
-{
-        ftgl_glyphmap_t glyphmap;
-        glyphmap = FTGL_MALLOC(sizeof(*glyphmap));
-        if (!glyphmap) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return NULL;
+        for (i = 0; i < glyphmap->capacity; i++) {
+                glyphmap->slots[i].index = FTGL_FONT_GLYPHMAP_EMPTY;
         }
 
-        memset(glyphmap->map, 0, sizeof(*glyphmap->map)
-               * FTGL_FONT_GLYPHMAP_CAPACITY);
+        glyphmap->nchunks = 0;
+        glyphmap->chunks = NULL;
+        glyphmap->nfree = 0;
+        glyphmap->free_capacity = 0;
+        glyphmap->free = NULL;
+        memset(glyphmap->direct, 0, sizeof(glyphmap->direct));
         return glyphmap;
 }
 
-static ftgl_glyph_t ftgl_glyphmap_find_glyph(ftgl_glyphmap_t glyphmap,
-                         uint32_t codepoint)
+static inline ftgl_glyph_t ftgl_glyphmap_find_glyph(ftgl_glyphmap_t glyphmap,
+                                                    uint32_t codepoint)
 {
-        ftgl_glyph_t glyph;
-        ftgl_glyphlist_t glyphlist;
-        size_t hash;
+        size_t idx;
+        struct ftgl_glyphslot_t *slot;
+
+        if (codepoint < FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY) {
+                return glyphmap->direct[codepoint];
+        }
+
+        idx = ftgl_glyphmap_hash(codepoint, glyphmap->capacity);
+        for (;;) {
+                slot = &glyphmap->slots[idx];
+                if (slot->index == FTGL_FONT_GLYPHMAP_EMPTY) {
+                        return NULL;
+                }
 
-        hash = codepoint % FTGL_FONT_GLYPHMAP_CAPACITY;
-        glyphlist = glyphmap->map[hash];
-        while (glyphlist != NULL) {
-                glyph = glyphlist->glyph;
-                if (glyph->codepoint == codepoint) {
-                        return glyph;
+                if (slot->codepoint == codepoint) {
+                        return ftgl_glyphmap_glyph(glyphmap, slot->index);
                 }
-                glyphlist = glyphlist->next;
+                idx = (idx + 1) & (glyphmap->capacity - 1);
         }
-        return NULL;
 }
 
-static ftgl_return_t ftgl_glyphmap_insert(ftgl_glyphmap_t glyphmap,
-                     uint32_t codepoint, ivec4_t bbox, GLint offset_x,
-                     GLint offset_y, GLfloat advance_x, GLfloat advance_y)
+static ftgl_return_t ftgl_glyphmap_resize(ftgl_glyphmap_t glyphmap)
 {
-        size_t hash;
-        ftgl_glyphlist_t glyphlist;
-        if (ftgl_glyphmap_find_glyph(glyphmap, codepoint)) {
-                return FTGL_NO_ERROR;
-        }
+        size_t new_capacity, i, idx;
+        struct ftgl_glyphslot_t *new_slots, *slot;
 
-        glyphlist = ftgl_glyphlist_create4iv(codepoint, bbox, offset_x,
-                                             offset_y, advance_x, advance_y);
-        if (!glyphlist) {
+        new_capacity = glyphmap->capacity << 1;
+        new_slots = FTGL_MALLOC(sizeof(*new_slots) * new_capacity);
+        if (!new_slots) {
                 FTGL_LOG_MESSAGE("Ran out of memory!");
                 return FTGL_MEMORY_ERROR;
         }
 
-        hash = codepoint % FTGL_FONT_GLYPHMAP_CAPACITY;
-        if (glyphmap->map[hash]) {
-                glyphlist->next = glyphmap->map[hash];
-                glyphmap->map[hash] = glyphlist;
-        } else {
-                glyphmap->map[hash] = glyphlist;
+        for (i = 0; i < new_capacity; i++) {
+                new_slots[i].index = FTGL_FONT_GLYPHMAP_EMPTY;
         }
-        return FTGL_NO_ERROR;
-}
-
-static void ftgl_glyphmap_free(ftgl_glyphmap_t *glyphmap)
-{
-        size_t i;
-        ftgl_glyphlist_t glyphlist;
 
-        for (i = 0; i < FTGL_FONT_GLYPHMAP_CAPACITY; i++) {
-                glyphlist = (*glyphmap)->map[i];
-                while (glyphlist != NULL) {
-                        ftgl_glyphlist_t next;
-                        next = glyphlist->next;
-                        ftgl_glyphlist_free(&glyphlist);
-                        glyphlist = next;
+        for (i = 0; i < glyphmap->capacity; i++) {
+                slot = &glyphmap->slots[i];
+                if (slot->index == FTGL_FONT_GLYPHMAP_EMPTY) continue;
+                idx = ftgl_glyphmap_hash(slot->codepoint, new_capacity);
+                while (new_slots[idx].index != FTGL_FONT_GLYPHMAP_EMPTY) {
+                        idx = (idx + 1) & (new_capacity - 1);
                 }
+                new_slots[idx] = *slot;
         }
 
-        memset((*glyphmap)->map, 0, sizeof(*(*glyphmap)->map)
-               * FTGL_FONT_GLYPHMAP_CAPACITY);
-        FTGL_FREE(*glyphmap);
+        FTGL_FREE(glyphmap->slots);
+        glyphmap->slots = new_slots;
+        glyphmap->capacity = new_capacity;
+        return FTGL_NO_ERROR;
 }
 
-// meiyan hash function
-// Source: http://www.sanmayce.com/Fastest_Hash/
-static inline uint32_t ftgl_string_hash(const char *s, size_t len)
+static ftgl_return_t ftgl_glyphmap_reserve_chunk(ftgl_glyphmap_t glyphmap)
 {
-        uint32_t hash = 0x811c9dc5;
-        while (len >= 8) {
-                hash = (hash ^ ((((*(uint32_t *) s) << 5) | ((*(uint32_t *) s) >> 27))
-                                ^ *(uint32_t *)(s + 4))) * 0xad3e7;
-                len -= 8;
-                s += 8;
-        }
+        struct ftgl_glyph_t **new_chunks;
+        struct ftgl_glyph_t *chunk;
 
-        if (len & 4) {
-                hash = (hash ^ *(uint16_t *) s) * 0xad3e7;
-                s += 2;
-                hash = (hash ^ *(uint16_t *) s) * 0xad3e7;
-                s += 2;
+        new_chunks = FTGL_REALLOC(glyphmap->chunks, sizeof(*new_chunks)
+                                  * (glyphmap->nchunks + 1));
+        if (!new_chunks) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
         }
+        glyphmap->chunks = new_chunks;
 
-        if (len & 2) {
-                hash = (hash ^ *(uint16_t *) s) * 0xad3e7;
-                s += 2;
+        chunk = FTGL_MALLOC(sizeof(*chunk) * FTGL_FONT_GLYPHMAP_CHUNK_SIZE);
+        if (!chunk) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
         }
 
-        if (len & 1) {
-                hash = (hash ^ *s) * 0xad3e7;
+        glyphmap->chunks[glyphmap->nchunks++] = chunk;
+        return FTGL_NO_ERROR;
+}
+
+static ftgl_glyph_t ftgl_glyphmap_insert(ftgl_glyphmap_t glyphmap,
+                     uint32_t codepoint, GLuint page, ivec4_t bbox, GLint offset_x,
+                     GLint offset_y, GLfloat advance_x, GLfloat advance_y)
+{
+        size_t idx;
+        uint32_t index;
+        ftgl_glyph_t glyph;
+        if ((glyph = ftgl_glyphmap_find_glyph(glyphmap, codepoint)) != NULL) {
+                return glyph;
         }
 
-        return hash ^ (hash >> 16);
+        if (codepoint >= FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY
+            && FTGL_FONT_GLYPHMAP_RESIZEP(glyphmap)) {
+                if (ftgl_glyphmap_resize(glyphmap) != FTGL_NO_ERROR) {
+                        return NULL;
+                }
+        }
+
+        if (glyphmap->nfree > 0) {
+                index = glyphmap->free[--glyphmap->nfree];
+        } else {
+                index = glyphmap->top;
+                if ((index >> FTGL_FONT_GLYPHMAP_CHUNK_SHIFT) >= glyphmap->nchunks) {
+                        if (ftgl_glyphmap_reserve_chunk(glyphmap) != FTGL_NO_ERROR) {
+                                return NULL;
+                        }
+                }
+                glyphmap->top++;
+        }
+
+        glyph = ftgl_glyphmap_glyph(glyphmap, index);
+        glyph->bbox = bbox;
+        glyph->codepoint = codepoint;
+        glyph->page = page;
+        glyph->offset_x = offset_x;
+        glyph->offset_y = offset_y;
+        glyph->advance_x = advance_x;
+        glyph->advance_y = advance_y;
+        glyph->generation = 0;
+        glyph->flags = 0;
+        glyphmap->size++;
+
+        if (codepoint < FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY) {
+                glyphmap->direct[codepoint] = glyph;
+                return glyph;
+        }
+
+        idx = ftgl_glyphmap_hash(codepoint, glyphmap->capacity);
+        while (glyphmap->slots[idx].index != FTGL_FONT_GLYPHMAP_EMPTY) {
+                idx = (idx + 1) & (glyphmap->capacity - 1);
+        }
+        glyphmap->slots[idx].codepoint = codepoint;
+        glyphmap->slots[idx].index = index;
+        glyphmap->used++;
+        return glyph;
 }
 
-static ftgl_return_t ftgl_font_manager_init(void)
+static uint32_t ftgl_glyphmap_index(ftgl_glyphmap_t glyphmap, ftgl_glyph_t glyph)
 {
-        ftgl_font_manager.size = 0;
-        ftgl_font_manager.capacity = FTGL_FONT_MANAGER_CAPACITY;
-        ftgl_font_manager.nodes = FTGL_CALLOC(ftgl_font_manager.capacity,
-                                              sizeof(*ftgl_font_manager.nodes));
-        if (!ftgl_font_manager.nodes) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return FTGL_MEMORY_ERROR;
+        size_t i;
+        for (i = 0; i < glyphmap->nchunks; i++) {
+                if (glyph >= glyphmap->chunks[i]
+                    && glyph < glyphmap->chunks[i] + FTGL_FONT_GLYPHMAP_CHUNK_SIZE) {
+                        return (i << FTGL_FONT_GLYPHMAP_CHUNK_SHIFT)
+                                + (glyph - glyphmap->chunks[i]);
+                }
         }
-
-        return FTGL_NO_ERROR;
+        return FTGL_FONT_GLYPHMAP_EMPTY;
 }
 
-FTGLDEF ftgl_return_t ftgl_font_library_init(void)
+/**
+ * Removes the glyph for @codepoint from the map. Its storage is reused
+ * by later insertions, so any outstanding handle to it becomes stale.
+ */
+static ftgl_return_t ftgl_glyphmap_remove(ftgl_glyphmap_t glyphmap, uint32_t codepoint)
 {
-        FT_Error ft_error;
-        ftgl_return_t ret;
-        if ((ft_error = FT_Init_FreeType(&ftgl_font_library)) != FT_Err_Ok) {
-                FTGL_LOG_MESSAGE("Failed to initialise FreeType!");
-                return FTGL_FREETYPE_ERROR;
+        size_t i, j, k, mask;
+        uint32_t index, *new_free;
+        size_t new_capacity;
+        ftgl_glyph_t glyph;
+
+        if (glyphmap->nfree == glyphmap->free_capacity) {
+                new_capacity = glyphmap->free_capacity ? glyphmap->free_capacity << 1
+                        : FTGL_FONT_GLYPHMAP_CHUNK_SIZE;
+                new_free = FTGL_REALLOC(glyphmap->free, sizeof(*new_free) * new_capacity);
+                if (!new_free) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        return FTGL_MEMORY_ERROR;
+                }
+
+                glyphmap->free = new_free;
+                glyphmap->free_capacity = new_capacity;
         }
 
-        if ((ret = ftgl_font_manager_init()) != FTGL_NO_ERROR) {
-                return ret;
+        if (codepoint < FTGL_FONT_GLYPHMAP_DIRECT_CAPACITY) {
+                glyph = glyphmap->direct[codepoint];
+                if (!glyph) {
+                        return FTGL_ARGUMENT_ERROR;
+                }
+
+                glyphmap->direct[codepoint] = NULL;
+                index = ftgl_glyphmap_index(glyphmap, glyph);
+        } else {
+                mask = glyphmap->capacity - 1;
+                i = ftgl_glyphmap_hash(codepoint, glyphmap->capacity);
+                while (glyphmap->slots[i].index != FTGL_FONT_GLYPHMAP_EMPTY
+                       && glyphmap->slots[i].codepoint != codepoint) {
+                        i = (i + 1) & mask;
+                }
+
+                index = glyphmap->slots[i].index;
+                if (index == FTGL_FONT_GLYPHMAP_EMPTY) {
+                        return FTGL_ARGUMENT_ERROR;
+                }
+
+                // Backward shift deletion keeps every probe sequence intact
+                glyphmap->slots[i].index = FTGL_FONT_GLYPHMAP_EMPTY;
+                for (j = (i + 1) & mask; glyphmap->slots[j].index != FTGL_FONT_GLYPHMAP_EMPTY;
+                     j = (j + 1) & mask) {
+                        k = ftgl_glyphmap_hash(glyphmap->slots[j].codepoint,
+                                               glyphmap->capacity);
+                        if (((j - k) & mask) >= ((j - i) & mask)) {
+                                glyphmap->slots[i] = glyphmap->slots[j];
+                                glyphmap->slots[j].index = FTGL_FONT_GLYPHMAP_EMPTY;
+                                i = j;
+                        }
+                }
+                glyphmap->used--;
+                glyph = ftgl_glyphmap_glyph(glyphmap, index);
         }
+
+        glyph->codepoint = FTGL_FONT_GLYPHMAP_EMPTY;
+        glyphmap->free[glyphmap->nfree++] = index;
+        glyphmap->size--;
         return FTGL_NO_ERROR;
 }
 
-static ftgl_font_node_t ftgl_font_node_create(const char *name, const char *path,
-                                              size_t ptsize)
+static void ftgl_glyphmap_free(ftgl_glyphmap_t *glyphmap)
 {
-        ftgl_return_t ret;
-        ftgl_font_node_t font_node;
-        font_node = FTGL_MALLOC(sizeof(*font_node));
-        if (!font_node) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return NULL;
-        }
+        size_t i;
 
-        font_node->name = FTGL_STRDUP(name);
-        if (!font_node->name) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                FTGL_FREE(font_node);
-                return NULL;
+        for (i = 0; i < (*glyphmap)->nchunks; i++) {
+                FTGL_FREE((*glyphmap)->chunks[i]);
         }
 
-        font_node->font = ftgl_font_create();
-        if (!font_node->font) {
-                FTGL_FREE(font_node->name);
-                FTGL_FREE(font_node);
+        FTGL_FREE((*glyphmap)->chunks);
+        FTGL_FREE((*glyphmap)->slots);
+        FTGL_FREE((*glyphmap)->free);
+        (*glyphmap)->free = NULL;
+        (*glyphmap)->chunks = NULL;
+        (*glyphmap)->slots = NULL;
+        (*glyphmap)->nchunks = 0;
+        (*glyphmap)->size = 0;
+        (*glyphmap)->used = 0;
+        (*glyphmap)->capacity = 0;
+        FTGL_FREE(*glyphmap);
+}
+
+FTGLDEF ftgl_packer_t ftgl_packer_create(ftgl_packmode_t mode, int width, int height)
+{
+        ftgl_packer_t packer;
+        if (width <= 0 || height <= 0) {
+                FTGL_LOG_MESSAGE("Invalid dimensions for packer!");
                 return NULL;
         }
 
-        ret = ftgl_font_bind(font_node->font, path);
-        if (ret != FTGL_NO_ERROR) {
-                FTGL_FREE(font_node->name);
-                ftgl_font_free(&font_node->font);
-                FTGL_FREE(font_node);
+        packer = FTGL_MALLOC(sizeof(*packer));
+        if (!packer) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
                 return NULL;
         }
 
-        ret = ftgl_font_set_size(font_node->font, ptsize);
-        if (ret != FTGL_NO_ERROR) {
-                FTGL_FREE(font_node->name);
-                ftgl_font_free(&font_node->font);
-                FTGL_FREE(font_node);
+        packer->mode = mode;
+        packer->width = width;
+        packer->height = height;
+        packer->capacity = FTGL_PACKER_CAPACITY;
+        packer->nodes = FTGL_MALLOC(sizeof(*packer->nodes) * packer->capacity);
+        if (!packer->nodes) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                FTGL_FREE(packer);
                 return NULL;
         }
 
-        return font_node;
+        packer->freed_capacity = 0;
+        packer->freed = NULL;
+        ftgl_packer_clear(packer);
+        return packer;
 }
 
-static ftgl_return_t ftgl_font_manager_resize(void)
+FTGLDEF void ftgl_packer_clear(ftgl_packer_t packer)
 {
-        size_t new_capacity, i, j;
-        ftgl_font_node_t *new_nodes;
-        uint32_t idx0, idx1, real_idx;
-        new_capacity = ftgl_font_manager.capacity << 1;
-        new_nodes = FTGL_CALLOC(new_capacity, sizeof(*new_nodes));
-        if (!new_nodes) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return FTGL_MEMORY_ERROR;
+        packer->used = 0;
+        packer->size = 1;
+        packer->nfreed = 0;
+        switch (packer->mode) {
+        case FTGL_PACKMODE_SKYLINE:
+                packer->nodes[0] = ll_ivec4_create4i(0, 0, packer->width, 0);
+                break;
+        case FTGL_PACKMODE_MAXRECTS:
+                packer->nodes[0] = ll_ivec4_create4i(0, 0, packer->width,
+                                                     packer->height);
+                break;
         }
+}
 
-        for (i = 0; i < ftgl_font_manager.capacity; i++) {
-                ftgl_font_node_t font_node = ftgl_font_manager.nodes[i];
-                if (!font_node) continue;
-                idx0 = ftgl_string_hash(font_node->name, strlen(font_node->name))
-                        & (new_capacity - 1);
-                idx1 = idx0 | 1;
-
-                for (j = 0; j <= new_capacity; j++) {
-                        real_idx = (idx0 + idx1 * j) & (new_capacity - 1);
-                        if (new_nodes[real_idx]) continue;
-                        new_nodes[real_idx] = font_node;
-                        break;
+static ftgl_return_t ftgl_rects_insert(ivec4_t **rects, size_t *size, size_t *capacity,
+                                       size_t idx, ivec4_t rect)
+{
+        ivec4_t *new_rects;
+        size_t new_capacity;
+        if (*size == *capacity) {
+                new_capacity = *capacity ? *capacity << 1 : FTGL_PACKER_CAPACITY;
+                new_rects = FTGL_REALLOC(*rects, sizeof(*new_rects) * new_capacity);
+                if (!new_rects) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        return FTGL_MEMORY_ERROR;
                 }
+
+                *rects = new_rects;
+                *capacity = new_capacity;
         }
 
-        FTGL_FREE(ftgl_font_manager.nodes);
-        ftgl_font_manager.nodes = new_nodes;
-        ftgl_font_manager.capacity = new_capacity;
+        memmove(*rects + idx + 1, *rects + idx, sizeof(**rects) * (*size - idx));
+        (*rects)[idx] = rect;
+        (*size)++;
         return FTGL_NO_ERROR;
 }
 
-FTGLDEF ftgl_return_t ftgl_font_manager_insert(const char *name, const char *path,
-                         size_t ptsize)
+static void ftgl_rects_remove(ivec4_t *rects, size_t *size, size_t idx)
+{
+        memmove(rects + idx, rects + idx + 1, sizeof(*rects) * (*size - idx - 1));
+        (*size)--;
+}
+
+static int ftgl_rects_contains(ivec4_t a, ivec4_t b)
+{
+        return b.x >= a.x && b.y >= a.y
+                && b.x + b.z <= a.x + a.z
+                && b.y + b.w <= a.y + a.w;
+}
+
+/**
+ * Splits every free rectangle overlapping @rect into the (up to four)
+ * maximal pieces surrounding it. The untouched rectangles keep their
+ * order at the front and the new pieces are appended from @first on.
+ */
+static ftgl_return_t ftgl_rects_split(ivec4_t **rects, size_t *size, size_t *capacity,
+                                      ivec4_t rect, size_t *first)
 {
+        size_t i, n;
+        ivec4_t f;
         ftgl_return_t ret;
-        size_t idx0, idx1, real_idx, i;
-        ftgl_font_node_t font_node, new_node;
-        if (!name || strlen(name) <= 0 || !path) {
-                FTGL_LOG_MESSAGE("Invalid arguments for font manager insertion!");
-                return FTGL_ARGUMENT_ERROR;
-        }
 
-        if (FTGL_FONT_MANAGER_RESIZEP()) {
-                if ((ret = ftgl_font_manager_resize()) != FTGL_NO_ERROR) {
-                        return ret;
+        n = *size;
+        for (i = 0; i < n; ) {
+                f = (*rects)[i];
+                if (rect.x >= f.x + f.z || rect.x + rect.z <= f.x
+                    || rect.y >= f.y + f.w || rect.y + rect.w <= f.y) {
+                        i++;
+                        continue;
                 }
-        }
 
-        new_node = ftgl_font_node_create(name, path, ptsize);
-        if (!new_node) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return FTGL_MEMORY_ERROR;
-        }
+                ftgl_rects_remove(*rects, size, i);
+                n--;
 
-        idx0 = ftgl_string_hash(name, strlen(name)) & (ftgl_font_manager.capacity - 1);
-        idx1 = idx0 | 1;
-        for (i = 0; i <= ftgl_font_manager.capacity; i++) {
-                real_idx = (idx0 + idx1 * i) & (ftgl_font_manager.capacity - 1);
-                font_node = ftgl_font_manager.nodes[real_idx];
-                if (font_node) {
-                        if (strcmp(font_node->name, name) == 0)
-                                return FTGL_NO_ERROR;
-                        continue;
+                if (rect.x > f.x) {
+                        ret = ftgl_rects_insert(rects, size, capacity, *size,
+                                ll_ivec4_create4i(f.x, f.y, rect.x - f.x, f.w));
+                        if (ret != FTGL_NO_ERROR) return ret;
                 }
 
-                ftgl_font_manager.nodes[real_idx] = new_node;
-                break;
+                if (rect.x + rect.z < f.x + f.z) {
+                        ret = ftgl_rects_insert(rects, size, capacity, *size,
+                                ll_ivec4_create4i(rect.x + rect.z, f.y,
+                                                  f.x + f.z - rect.x - rect.z, f.w));
+                        if (ret != FTGL_NO_ERROR) return ret;
+                }
+
+                if (rect.y > f.y) {
+                        ret = ftgl_rects_insert(rects, size, capacity, *size,
+                                ll_ivec4_create4i(f.x, f.y, f.z, rect.y - f.y));
+                        if (ret != FTGL_NO_ERROR) return ret;
+                }
+
+                if (rect.y + rect.w < f.y + f.w) {
+                        ret = ftgl_rects_insert(rects, size, capacity, *size,
+                                ll_ivec4_create4i(f.x, rect.y + rect.w, f.z,
+                                                  f.y + f.w - rect.y - rect.w));
+                        if (ret != FTGL_NO_ERROR) return ret;
+                }
         }
 
-        ftgl_font_manager.size++;
+        *first = n;
         return FTGL_NO_ERROR;
 }
 
-FTGLDEF ftgl_font_t ftgl_font_manager_find(const char *name)
+/**
+ * Drops the rectangles from @first on that are contained in another
+ * one. The rectangles before @first are already free of containment
+ * among themselves and each lies outside the split rectangles the new
+ * pieces came from, so no new piece can contain one of them and only
+ * the pieces need checking: O(pieces * size) instead of O(size^2).
+ */
+static void ftgl_rects_prune_from(ivec4_t *rects, size_t *size, size_t first)
 {
-        ftgl_font_node_t font_node;
-        size_t idx0, idx1, real_idx, i;
+        size_t i, j;
+        for (i = first; i < *size; ) {
+                for (j = 0; j < *size; j++) {
+                        if (j != i && ftgl_rects_contains(rects[j], rects[i])) {
+                                break;
+                        }
+                }
 
-        idx0 = ftgl_string_hash(name, strlen(name));
-        idx0 = idx0 & (ftgl_font_manager.capacity - 1);
-        idx1 = idx0 | 1;
-        for (i = 0; i < ftgl_font_manager.capacity; i++) {
-                real_idx = (idx0 + idx1 * i) & (ftgl_font_manager.capacity - 1);
-                font_node = ftgl_font_manager.nodes[real_idx];
-                if (!font_node) return NULL;
-                if (font_node && strcmp(name, font_node->name) == 0) {
-                        return font_node->font;
+                if (j < *size) {
+                        ftgl_rects_remove(rects, size, i);
+                } else {
+                        i++;
                 }
         }
-        return NULL;
 }
 
-FTGLDEF ftgl_font_t ftgl_font_create(void)
+/**
+ * Joins the free rectangle at @idx with the ones sharing a complete
+ * edge with it, so that space released piece by piece can host larger
+ * rectangles again, then drops what the result contains, or the result
+ * itself if another rectangle holds it. Only pairs involving @idx are
+ * considered, which costs O(size) per merge; the rest of the list is
+ * left alone and cleaned up by ftgl_packer_rebuild.
+ */
+static void ftgl_rects_merge_one(ivec4_t *rects, size_t *size, size_t idx)
 {
-        GLenum gl_error;
-        ftgl_font_t font;
-
-        font = FTGL_MALLOC(sizeof(*font));
-        if (!font) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return NULL;
-        }
-
-        font->rendermode = FTGL_RENDERMODE_NORMAL;
-
-        font->tbox = ll_ivec2_create2i(5,5);
-        font->tbox_yjump = 0;
+        size_t j;
+        ivec4_t *a, *b;
+
+        for (j = 0; j < *size; j++) {
+                if (j == idx) continue;
+                a = &rects[idx];
+                b = &rects[j];
+                if (a->x == b->x && a->z == b->z
+                    && (a->y + a->w == b->y || b->y + b->w == a->y)) {
+                        a->y = a->y < b->y ? a->y : b->y;
+                        a->w += b->w;
+                } else if (a->y == b->y && a->w == b->w
+                           && (a->x + a->z == b->x || b->x + b->z == a->x)) {
+                        a->x = a->x < b->x ? a->x : b->x;
+                        a->z += b->z;
+                } else {
+                        continue;
+                }
 
-        font->glyphmap = ftgl_glyphmap_create();
-        if (!font->glyphmap) {
-                FTGL_FREE(font);
-                return NULL;
+                // The grown rectangle may now line up with one already passed
+                ftgl_rects_remove(rects, size, j);
+                if (j < idx) idx--;
+                j = (size_t) -1;
         }
 
-        glGenTextures(1, &font->texture);
-        if ((gl_error = glGetError()) != GL_NO_ERROR) {
-                FTGL_LOG_MESSAGE("%s", gluErrorString(gl_error));
-                ftgl_glyphmap_free(&font->glyphmap);
-                FTGL_FREE(font);
-                return NULL;
-        }
+        for (j = 0; j < *size; ) {
+                if (j != idx && ftgl_rects_contains(rects[j], rects[idx])) {
+                        ftgl_rects_remove(rects, size, idx);
+                        return;
+                }
 
-        glBindTexture(GL_TEXTURE_2D, font->texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, FTGL_FONT_ATLAS_WIDTH,
-                     FTGL_FONT_ATLAS_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
-        if ((gl_error = glGetError()) != GL_NO_ERROR) {
-                FTGL_LOG_MESSAGE("%s", gluErrorString(gl_error));
-                glBindTexture(GL_TEXTURE_2D, 0);
-                ftgl_glyphmap_free(&font->glyphmap);
-                FTGL_FREE(font);
-                return NULL;
+                if (j != idx && ftgl_rects_contains(rects[idx], rects[j])) {
+                        ftgl_rects_remove(rects, size, j);
+                        if (j < idx) idx--;
+                } else {
+                        j++;
+                }
         }
-
-        glBindTexture(GL_TEXTURE_2D, 0);
-        font->scale = 1.0;
-        font->face = NULL;
-        return font;
 }
 
-FTGLDEF ftgl_return_t ftgl_font_bind(ftgl_font_t font, const char *path)
+/**
+ * MaxRects best short side fit over the free rectangles in @rects.
+ */
+static ftgl_return_t ftgl_rects_insert_fit(ivec4_t **rects, size_t *size, size_t *capacity,
+                                           int width, int height, ivec4_t *rect)
 {
-        FT_Error ft_error;
+        size_t i, best_idx;
+        int short_side, long_side, best_short, best_long, dw, dh;
+        size_t first;
+        ivec4_t *f;
+        ftgl_return_t ret;
 
-        if (font->face) {
-                if ((ft_error = FT_Done_Face(font->face)) != FT_Err_Ok) {
-                        FTGL_LOG_MESSAGE("Failed to destroy font!");
-                        return FTGL_FREETYPE_ERROR;
+        best_idx = *size;
+        best_short = INT_MAX;
+        best_long = INT_MAX;
+        for (i = 0; i < *size; i++) {
+                f = &(*rects)[i];
+                if (f->z < width || f->w < height) continue;
+                dw = f->z - width;
+                dh = f->w - height;
+                short_side = dw < dh ? dw : dh;
+                long_side = dw < dh ? dh : dw;
+                if (short_side < best_short
+                    || (short_side == best_short && long_side < best_long)) {
+                        best_idx = i;
+                        best_short = short_side;
+                        best_long = long_side;
                 }
+        }
 
-                font->face = NULL;
+        if (best_idx == *size) {
+                return FTGL_ATLAS_FULL_ERROR;
         }
 
-        if ((ft_error = FT_New_Face(ftgl_font_library, path,
-                                    0, &font->face)) != FT_Err_Ok) {
-                FTGL_LOG_MESSAGE("Failed to create font!");
-                return FTGL_FREETYPE_ERROR;
+        *rect = ll_ivec4_create4i((*rects)[best_idx].x, (*rects)[best_idx].y,
+                                  width, height);
+        if ((ret = ftgl_rects_split(rects, size, capacity, *rect, &first)) != FTGL_NO_ERROR) {
+                return ret;
         }
 
+        ftgl_rects_prune_from(*rects, size, first);
         return FTGL_NO_ERROR;
 }
 
-FTGLDEF ftgl_return_t ftgl_font_set_size(ftgl_font_t font, float size)
+/**
+ * Returns the height at which a rectangle of @width and @height could
+ * sit when its left edge is aligned with skyline node @idx, or -1 if
+ * it does not fit there.
+ */
+static int ftgl_packer_skyline_fit(ftgl_packer_t packer, size_t idx,
+                                   int width, int height)
 {
-        FT_Error ft_error;
-        FT_Matrix matrix = {
-                (int)((1.0/FTGL_FONT_HRES)  * 0x10000L),
-                (int)((0.0)                 * 0x10000L),
-                (int)((0.0)                 * 0x10000L),
-                (int)((1.0)                 * 0x10000L)
-        };
+        int x, y, remaining;
+        x = packer->nodes[idx].x;
+        if (x + width > packer->width) {
+                return -1;
+        }
 
-        if (FT_HAS_FIXED_SIZES(font->face)) {
-                FTGL_LOG_MESSAGE("Can't set size for fixed sized fonts!");
-                return FTGL_FREETYPE_ERROR;
-        } else {
-                ft_error = FT_Set_Char_Size(font->face, ftgl_float_to_F26Dot6(size),
-                                            0, FTGL_FONT_DPI * FTGL_FONT_HRES,
-                                            FTGL_FONT_DPI);
-                if (ft_error != FT_Err_Ok) {
-                        FTGL_LOG_MESSAGE("Failed to set font size!");
-                        return FTGL_FREETYPE_ERROR;
+        y = packer->nodes[idx].y;
+        remaining = width;
+        while (remaining > 0) {
+                if (packer->nodes[idx].y > y) {
+                        y = packer->nodes[idx].y;
+                }
+
+                if (y + height > packer->height) {
+                        return -1;
+                }
+                remaining -= packer->nodes[idx].z;
+                idx++;
+        }
+        return y;
+}
+
+static ftgl_return_t ftgl_packer_skyline_insert(ftgl_packer_t packer, int width,
+                                                int height, ivec4_t *rect)
+{
+        size_t i, best_idx;
+        int y, best_y, best_w, shrink;
+        ivec4_t *node, *prev;
+        ftgl_return_t ret;
+
+        best_idx = packer->size;
+        best_y = INT_MAX;
+        best_w = INT_MAX;
+        for (i = 0; i < packer->size; i++) {
+                y = ftgl_packer_skyline_fit(packer, i, width, height);
+                if (y < 0) continue;
+                if (y < best_y || (y == best_y && packer->nodes[i].z < best_w)) {
+                        best_idx = i;
+                        best_y = y;
+                        best_w = packer->nodes[i].z;
                 }
         }
 
-        FT_Size_Metrics metrics = font->face->size->metrics;
-        font->ascender = metrics.ascender >> 6;
-        font->descender = metrics.descender >> 6;
-        font->height = metrics.height >> 6;
-        font->linegap = font->height - font->ascender + font->descender;
+        if (best_idx == packer->size) {
+                return FTGL_ATLAS_FULL_ERROR;
+        }
+
+        *rect = ll_ivec4_create4i(packer->nodes[best_idx].x, best_y,
+                                  width, height);
+        ret = ftgl_rects_insert(&packer->nodes, &packer->size, &packer->capacity,
+                                best_idx, ll_ivec4_create4i(rect->x, best_y + height,
+                                                            width, 0));
+        if (ret != FTGL_NO_ERROR) {
+                return ret;
+        }
 
-        FT_Activate_Size(font->face->size);
-        FT_Set_Transform(font->face, &matrix, NULL);
+        // Shrink or remove the nodes now covered by the new segment
+        for (i = best_idx + 1; i < packer->size; ) {
+                node = &packer->nodes[i];
+                prev = &packer->nodes[i - 1];
+                if (node->x >= prev->x + prev->z) break;
+                shrink = prev->x + prev->z - node->x;
+                node->x += shrink;
+                node->z -= shrink;
+                if (node->z > 0) break;
+                ftgl_rects_remove(packer->nodes, &packer->size, i);
+        }
+
+        // Merge neighbouring segments of the same height
+        for (i = 0; i + 1 < packer->size; ) {
+                if (packer->nodes[i].y == packer->nodes[i + 1].y) {
+                        packer->nodes[i].z += packer->nodes[i + 1].z;
+                        ftgl_rects_remove(packer->nodes, &packer->size, i + 1);
+                } else {
+                        i++;
+                }
+        }
         return FTGL_NO_ERROR;
 }
 
-FTGLDEF void ftgl_computegradient(double *img, int w, int h, double *gx, double *gy)
+FTGLDEF ftgl_return_t ftgl_packer_insert(ftgl_packer_t packer, int width,
+                                         int height, ivec4_t *rect)
 {
-        int i, j, k;
-        double glength;
-#define SQRT2 1.4142136
-        // Avoid edges where the kernels would spill over
-        for (i = 1; i < h - 1; i++) {
-                for (j = 1; j < w - 1; j++) {
-                        k = i*w + j;
-                        // Compute gradient for edge pixels only
-                        if ((img[k] > 0.0) && (img[k] < 1.0)) {
-                                gx[k] = -img[k-w-1] - SQRT2*img[k-1] - img[k+w-1] + img[k-w+1]
-                                        + SQRT2*img[k+1] + img[k+w+1];
-                                gy[k] = -img[k-w-1] - SQRT2*img[k-w] - img[k-w+1] + img[k+w-1]
-                                        + SQRT2*img[k+w] + img[k+w+1];
-                                glength = gx[k]*gx[k] + gy[k]*gy[k];
-                                // Avoid division by zero
-                                if (glength > 0.0) {
-                                        glength = sqrt(glength);
-                                        gx[k] = gx[k] / glength;
-                                        gy[k] = gy[k] / glength;
-                                }
-                        }
+        ftgl_return_t ret;
+        if (width <= 0 || height <= 0) {
+                FTGL_LOG_MESSAGE("Invalid dimensions for packer insertion!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        switch (packer->mode) {
+        case FTGL_PACKMODE_SKYLINE:
+                ret = ftgl_rects_insert_fit(&packer->freed, &packer->nfreed,
+                                            &packer->freed_capacity,
+                                            width, height, rect);
+                if (ret == FTGL_ATLAS_FULL_ERROR) {
+                        ret = ftgl_packer_skyline_insert(packer, width, height, rect);
                 }
+                break;
+        case FTGL_PACKMODE_MAXRECTS:
+                ret = ftgl_rects_insert_fit(&packer->nodes, &packer->size,
+                                            &packer->capacity,
+                                            width, height, rect);
+                break;
+        default:
+                FTGL_LOG_MESSAGE("Unknown packing mode!");
+                return FTGL_ARGUMENT_ERROR;
         }
-#undef SQRT2
+
+        if (ret == FTGL_NO_ERROR) {
+                packer->used += (size_t) width * height;
+        }
+        return ret;
 }
 
-FTGLDEF double ftgl_edgedf(double gx, double gy, double a)
+FTGLDEF ftgl_return_t ftgl_packer_release(ftgl_packer_t packer, ivec4_t rect)
 {
-        double df, glength, temp, a1;
+        ftgl_return_t ret;
+        ivec4_t **rects;
+        size_t *size, *capacity;
 
-        // Either
-        // A) gu or gv are zero, or
-        // B) both
-        if ((gx == 0) || (gy == 0)) {
-                df = 0.5-a;
-        } else {
-                glength = sqrt(gx*gx + gy*gy);
-                if (glength > 0) {
-                        gx = gx/glength;
-                        gy = gy/glength;
-                }
+        packer->used -= (size_t) rect.z * rect.w;
+        if (packer->used == 0) {
+                // Nothing left in use, start over from a single free area
+                ftgl_packer_clear(packer);
+                return FTGL_NO_ERROR;
+        }
 
-                /* Everything is symmetric wrt sign and transposition
-                 * so move to first octant (gx >= 0, gy >= 0, gx >= gy) to
-                 * avoid handling all possible edge cases
-                 */
-                gx = fabs(gx);
-                gy = fabs(gy);
-                if (gx < gy) {
-                        temp = gx;
-                        gx = gy;
-                        gy = temp;
-                }
+        switch (packer->mode) {
+        case FTGL_PACKMODE_SKYLINE:
+                rects = &packer->freed;
+                size = &packer->nfreed;
+                capacity = &packer->freed_capacity;
+                break;
+        case FTGL_PACKMODE_MAXRECTS:
+                rects = &packer->nodes;
+                size = &packer->size;
+                capacity = &packer->capacity;
+                break;
+        default:
+                FTGL_LOG_MESSAGE("Unknown packing mode!");
+                return FTGL_ARGUMENT_ERROR;
+        }
 
-                a1 = 0.5*gy/gx;
-                // 0 <= a < a1
-                if (a < a1) {
-                        df = 0.5*(gx + gy) - sqrt(2.0 * gx * gy * a);
-                } else if (a < (1.0-a1)) {
-                        // a1 <= a <= 1 - a1
-                        df = (0.5-a) * gx;
-                } else {
-                        // 1-a1 < a <= 1
-                        df = -0.5 * (gx + gy) + sqrt(2.0 * gx * gy * (1.0-a));
-                }
+        if ((ret = ftgl_rects_insert(rects, size, capacity, *size, rect)) != FTGL_NO_ERROR) {
+                return ret;
         }
 
-        return df;
+        ftgl_rects_merge_one(*rects, size, *size - 1);
+        return FTGL_NO_ERROR;
 }
 
-FTGLDEF double ftgl_distaa3(double *img, double *gximg, double *gyimg, int w,
-             int c, int xc, int yc, int xi, int yi)
+FTGLDEF ftgl_return_t ftgl_packer_rebuild(ftgl_packer_t packer, const ivec4_t *occupied,
+                                          size_t count)
 {
-        double di, df, dx, dy, gx, gy, a;
-        int closest;
+        size_t i, first;
+        ftgl_return_t ret;
+        ivec4_t **rects;
+        size_t *size, *capacity;
 
-        // Index to the edge pixel pointed to from c
-        closest = c-xc-yc*w;
+        ftgl_packer_clear(packer);
+        if (count == 0) {
+                return FTGL_NO_ERROR;
+        }
 
-        // Grayscale value at the edge pixel
-        a = img[closest];
+        switch (packer->mode) {
+        case FTGL_PACKMODE_SKYLINE:
+                // Close the skyline, all free space is tracked as free rectangles
+                packer->nodes[0].y = packer->height;
+                rects = &packer->freed;
+                size = &packer->nfreed;
+                capacity = &packer->freed_capacity;
+                ret = ftgl_rects_insert(rects, size, capacity, 0,
+                                        ll_ivec4_create4i(0, 0, packer->width,
+                                                          packer->height));
+                if (ret != FTGL_NO_ERROR) {
+                        return ret;
+                }
+                break;
+        case FTGL_PACKMODE_MAXRECTS:
+                rects = &packer->nodes;
+                size = &packer->size;
+                capacity = &packer->capacity;
+                break;
+        default:
+                FTGL_LOG_MESSAGE("Unknown packing mode!");
+                return FTGL_ARGUMENT_ERROR;
+        }
 
-        // X gradient component at the edge pixel
-        gx = gximg[closest];
+        for (i = 0; i < count; i++) {
+                if ((ret = ftgl_rects_split(rects, size, capacity, occupied[i],
+                                            &first)) != FTGL_NO_ERROR) {
+                        return ret;
+                }
+                ftgl_rects_prune_from(*rects, size, first);
+                packer->used += (size_t) occupied[i].z * occupied[i].w;
+        }
+        return FTGL_NO_ERROR;
+}
 
-        // Y gradient component at the edge pixel
-        gy = gyimg[closest];
+FTGLDEF float ftgl_packer_occupancy(ftgl_packer_t packer)
+{
+        return packer->used / ((float) packer->width * packer->height);
+}
 
-        if (a > 1.0) a = 1.0;
+FTGLDEF void ftgl_packer_free(ftgl_packer_t *packer)
+{
+        FTGL_FREE((*packer)->nodes);
+        FTGL_FREE((*packer)->freed);
+        (*packer)->nodes = NULL;
+        (*packer)->freed = NULL;
+        (*packer)->nfreed = 0;
+        (*packer)->size = 0;
+        (*packer)->capacity = 0;
+        FTGL_FREE(*packer);
+}
 
-        // Clip grayscale values outside the range [0, 1]
-        if (a < 0.0) a = 0.0;
+static GLenum ftgl_backend_opengl_format(int depth)
+{
+        return depth == 3 ? GL_RGB : GL_RED;
+}
 
-        // Not an object pixel, return "very far" ("don't know yet")
-        if (a == 0.0) return 1000000.0;
+static ftgl_return_t ftgl_backend_opengl_create(void *userdata, int width, int height,
+                                                int depth, GLuint *texture)
+{
+        GLenum gl_error, format;
 
-        dx = (double) xi;
-        dy = (double) yi;
+        glGenTextures(1, texture);
+        if ((gl_error = glGetError()) != GL_NO_ERROR) {
+                FTGL_LOG_MESSAGE("%s", gluErrorString(gl_error));
+                return FTGL_MEMORY_ERROR;
+        }
 
-        // Length of integer vector, like a traditional EDT
-        di = sqrt(dx*dx + dy*dy);
-        if (di == 0) {
-                //Use local gradient only at edges
-                // Estimate based on local gradient only
-                df = ftgl_edgedf(gx, gy, a);
-        } else {
-                // Estimate gradient based on direction to edge (accurate for large di)
-                df = ftgl_edgedf(dx, dy, a);
+        glBindTexture(GL_TEXTURE_2D, *texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        format = ftgl_backend_opengl_format(depth);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0,
+                     format, GL_UNSIGNED_BYTE, NULL);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if ((gl_error = glGetError()) != GL_NO_ERROR) {
+                FTGL_LOG_MESSAGE("%s", gluErrorString(gl_error));
+                glBindTexture(GL_TEXTURE_2D, 0);
+                glDeleteTextures(1, texture);
+                return FTGL_MEMORY_ERROR;
         }
 
-        // Same metric as ftgl_edtaa3, except at edges (where di = 0)
-        return di + df;
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return FTGL_NO_ERROR;
 }
 
-// Shorthand macro: add ubiquitous parameters dist, gx, gy, img and w and call distaa3()
-#define DISTAA(c,xc,yc,xi,yi) (ftgl_distaa3(img, gx, gy, w, c, xc, yc, xi, yi))
+static void ftgl_backend_opengl_upload(void *userdata, GLuint texture, const ivec4_t *rects,
+                                       size_t count, const unsigned char *pixels, int stride,
+                                       int depth)
+{
+        size_t i;
+        GLenum format;
 
-FTGLDEF void ftgl_edtaa3(double *img, double *gx, double *gy, int w, int h,
-            short *distx, short *disty, double *dist)
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        format = ftgl_backend_opengl_format(depth);
+        for (i = 0; i < count; i++) {
+                glTexSubImage2D(GL_TEXTURE_2D, 0, rects[i].x, rects[i].y,
+                                rects[i].z, rects[i].w, format, GL_UNSIGNED_BYTE,
+                                pixels + ((size_t) rects[i].y * stride + rects[i].x) * depth);
+        }
+
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+static void ftgl_backend_opengl_destroy(void *userdata, GLuint texture)
 {
-        int x, y, i, c;
-        int offset_u, offset_ur, offset_r, offset_rd,
-                offset_d, offset_dl, offset_l, offset_lu;
-        double olddist, newdist;
-        int cdistx, cdisty, newdistx, newdisty;
-        int changed;
-        double epsilon = 1e-3;
+        glDeleteTextures(1, &texture);
+}
 
-        /* Initialize index offsets for the current image width */
-        offset_u = -w;
-        offset_ur = -w+1;
-        offset_r = 1;
-        offset_rd = w+1;
-        offset_d = w;
-        offset_dl = w-1;
-        offset_l = -1;
-        offset_lu = -w-1;
+const struct ftgl_backend_t ftgl_backend_opengl = {
+        ftgl_backend_opengl_create,
+        ftgl_backend_opengl_upload,
+        ftgl_backend_opengl_destroy,
+        NULL,
+};
 
-        /* Initialize the distance images */
-        for(i=0; i<w*h; i++) {
-                // At first, all pixels point to
-                // themselves as the closest known.
-                distx[i] = 0;
-                disty[i] = 0;
-                if(img[i] <= 0.0) {
-                        // Big value, means "not set yet"
-                        dist[i]= 1000000.0;
-                } else if (img[i]<1.0) {
-                        // Gradient-assisted estimate
-                        dist[i] = ftgl_edgedf(gx[i], gy[i], img[i]);
-                } else {
-                        dist[i]= 0.0; // Inside the object
-                }
+#define FTGL_MEMORY_TEXTURES_CAPACITY (4)
+
+/* Textures of the in-memory backend, a handle is its index plus one */
+static struct {
+        size_t size;
+        size_t capacity;
+        unsigned char **textures;
+} ftgl_memory_textures;
+
+static ftgl_return_t ftgl_backend_memory_create(void *userdata, int width, int height,
+                                                int depth, GLuint *texture)
+{
+        size_t i, new_capacity;
+        unsigned char **new_textures;
+
+        for (i = 0; i < ftgl_memory_textures.size; i++) {
+                if (!ftgl_memory_textures.textures[i]) break;
         }
 
-        /* Perform the transformation */
-        do {
-                changed = 0;
+        if (i == ftgl_memory_textures.capacity) {
+                new_capacity = ftgl_memory_textures.capacity
+                        ? ftgl_memory_textures.capacity << 1
+                        : FTGL_MEMORY_TEXTURES_CAPACITY;
+                new_textures = FTGL_REALLOC(ftgl_memory_textures.textures,
+                                            sizeof(*new_textures) * new_capacity);
+                if (!new_textures) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        return FTGL_MEMORY_ERROR;
+                }
 
-                /* Scan rows, except first row */
-                for(y=1; y<h; y++) {
+                ftgl_memory_textures.textures = new_textures;
+                ftgl_memory_textures.capacity = new_capacity;
+        }
 
-                        /* move index to leftmost pixel of current row */
-                        i = y*w;
+        ftgl_memory_textures.textures[i] = FTGL_CALLOC((size_t) width * height * depth,
+                                                       sizeof(**new_textures));
+        if (!ftgl_memory_textures.textures[i]) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
 
-                        /* scan right, propagate distances from above & left */
+        if (i == ftgl_memory_textures.size) {
+                ftgl_memory_textures.size++;
+        }
+        *texture = i + 1;
+        return FTGL_NO_ERROR;
+}
 
-                        /* Leftmost pixel is special, has no left neighbors */
-                        olddist = dist[i];
+static void ftgl_backend_memory_upload(void *userdata, GLuint texture, const ivec4_t *rects,
+                                       size_t count, const unsigned char *pixels, int stride,
+                                       int depth)
+{
+        size_t i, offset;
+        int y;
+        unsigned char *dst;
+
+        dst = ftgl_memory_textures.textures[texture - 1];
+        for (i = 0; i < count; i++) {
+                for (y = rects[i].y; y < rects[i].y + rects[i].w; y++) {
+                        offset = ((size_t) y * stride + rects[i].x) * depth;
+                        memcpy(dst + offset, pixels + offset, (size_t) rects[i].z * depth);
+                }
+        }
+}
+
+static void ftgl_backend_memory_destroy(void *userdata, GLuint texture)
+{
+        FTGL_FREE(ftgl_memory_textures.textures[texture - 1]);
+        ftgl_memory_textures.textures[texture - 1] = NULL;
+        while (ftgl_memory_textures.size > 0
+               && !ftgl_memory_textures.textures[ftgl_memory_textures.size - 1]) {
+                ftgl_memory_textures.size--;
+        }
+
+        if (ftgl_memory_textures.size == 0) {
+                FTGL_FREE(ftgl_memory_textures.textures);
+                memset(&ftgl_memory_textures, 0, sizeof(ftgl_memory_textures));
+        }
+}
+
+const struct ftgl_backend_t ftgl_backend_memory = {
+        ftgl_backend_memory_create,
+        ftgl_backend_memory_upload,
+        ftgl_backend_memory_destroy,
+        NULL,
+};
+
+FTGLDEF const unsigned char *ftgl_memory_texture_pixels(GLuint texture)
+{
+        if (texture == 0 || texture > ftgl_memory_textures.size) {
+                FTGL_LOG_MESSAGE("Not a texture of the memory backend!");
+                return NULL;
+        }
+        return ftgl_memory_textures.textures[texture - 1];
+}
+
+static ftgl_return_t ftgl_stream_opengl_create(void *userdata, size_t size, GLuint *buffer,
+                                               GLuint *vertex_array, void **mapped)
+{
+        GLenum gl_error;
+        GLbitfield flags;
+        GLint previous;
+
+        *mapped = NULL;
+        glGenBuffers(1, buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, *buffer);
+        if (GLEW_ARB_buffer_storage) {
+                flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+                *mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+                if (glGetError() != GL_NO_ERROR || !*mapped) {
+                        // Advertised but refused, orphan a mutable buffer instead
+                        glDeleteBuffers(1, buffer);
+                        glGenBuffers(1, buffer);
+                        glBindBuffer(GL_ARRAY_BUFFER, *buffer);
+                        *mapped = NULL;
+                }
+        }
+
+        if (!*mapped) {
+                glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // The element binding and enabled attributes live in the vertex
+        // array, so drawing never touches the caller's one
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous);
+        glGenVertexArrays(1, vertex_array);
+        glBindVertexArray(*vertex_array);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *buffer);
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glBindVertexArray(previous);
+
+        if ((gl_error = glGetError()) != GL_NO_ERROR) {
+                FTGL_LOG_MESSAGE("%s", gluErrorString(gl_error));
+                glDeleteVertexArrays(1, vertex_array);
+                glDeleteBuffers(1, buffer);
+                return FTGL_MEMORY_ERROR;
+        }
+        return FTGL_NO_ERROR;
+}
+
+static void ftgl_stream_opengl_upload(void *userdata, GLuint buffer, const void *data,
+                                      size_t size)
+{
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* Position and texture coordinates go to attribute 0, the color to 1 */
+static void ftgl_stream_opengl_draw(void *userdata, GLuint vertex_array, GLuint buffer,
+                                    GLuint texture, size_t vertex_offset, size_t index_offset,
+                                    size_t count)
+{
+        GLsizei stride;
+        GLint previous;
+
+        stride = sizeof(struct ftgl_color_vertex_t);
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous);
+        glBindVertexArray(vertex_array);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, stride, (const void *) vertex_offset);
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                              (const void *) (vertex_offset + 4 * sizeof(GLfloat)));
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, (const void *) index_offset);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(previous);
+}
+
+static void *ftgl_stream_opengl_fence(void *userdata, GLuint buffer)
+{
+        return glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+static void ftgl_stream_opengl_wait(void *userdata, GLuint buffer, void *fence)
+{
+        GLenum status;
+
+        do {
+                status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while (status == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fence);
+}
+
+static void ftgl_stream_opengl_destroy(void *userdata, GLuint vertex_array, GLuint buffer,
+                                       void *mapped)
+{
+        if (mapped) {
+                glBindBuffer(GL_ARRAY_BUFFER, buffer);
+                glUnmapBuffer(GL_ARRAY_BUFFER);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        glDeleteVertexArrays(1, &vertex_array);
+        glDeleteBuffers(1, &buffer);
+}
+
+const struct ftgl_stream_backend_t ftgl_stream_backend_opengl = {
+        ftgl_stream_opengl_create,
+        ftgl_stream_opengl_upload,
+        ftgl_stream_opengl_draw,
+        ftgl_stream_opengl_fence,
+        ftgl_stream_opengl_wait,
+        ftgl_stream_opengl_destroy,
+        NULL,
+};
+
+struct ftgl_memory_buffer_t {
+        unsigned char *data;
+        struct ftgl_stream_stats_t stats;
+};
+
+/**
+ * Buffers of the in-memory stream backend, a handle is its index plus
+ * one. They are mapped unless the backend's userdata is non-NULL,
+ * which emulates a driver without persistent mapping.
+ */
+static struct {
+        size_t size;
+        size_t capacity;
+        struct ftgl_memory_buffer_t *buffers;
+} ftgl_memory_buffers;
+
+static ftgl_return_t ftgl_stream_memory_create(void *userdata, size_t size, GLuint *buffer,
+                                               GLuint *vertex_array, void **mapped)
+{
+        size_t i, new_capacity;
+        struct ftgl_memory_buffer_t *new_buffers;
+
+        for (i = 0; i < ftgl_memory_buffers.size; i++) {
+                if (!ftgl_memory_buffers.buffers[i].data) break;
+        }
+
+        if (i == ftgl_memory_buffers.capacity) {
+                new_capacity = ftgl_memory_buffers.capacity
+                        ? ftgl_memory_buffers.capacity << 1
+                        : FTGL_MEMORY_TEXTURES_CAPACITY;
+                new_buffers = FTGL_REALLOC(ftgl_memory_buffers.buffers,
+                                           sizeof(*new_buffers) * new_capacity);
+                if (!new_buffers) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        return FTGL_MEMORY_ERROR;
+                }
+
+                ftgl_memory_buffers.buffers = new_buffers;
+                ftgl_memory_buffers.capacity = new_capacity;
+        }
+
+        memset(&ftgl_memory_buffers.buffers[i], 0, sizeof(*ftgl_memory_buffers.buffers));
+        ftgl_memory_buffers.buffers[i].data = FTGL_CALLOC(size, 1);
+        if (!ftgl_memory_buffers.buffers[i].data) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        if (i == ftgl_memory_buffers.size) {
+                ftgl_memory_buffers.size++;
+        }
+        *buffer = i + 1;
+        *vertex_array = 0;
+        *mapped = userdata ? NULL : ftgl_memory_buffers.buffers[i].data;
+        return FTGL_NO_ERROR;
+}
+
+static void ftgl_stream_memory_upload(void *userdata, GLuint buffer, const void *data,
+                                      size_t size)
+{
+        memcpy(ftgl_memory_buffers.buffers[buffer - 1].data, data, size);
+        ftgl_memory_buffers.buffers[buffer - 1].stats.uploads++;
+}
+
+static void ftgl_stream_memory_draw(void *userdata, GLuint vertex_array, GLuint buffer,
+                                    GLuint texture, size_t vertex_offset, size_t index_offset,
+                                    size_t count)
+{
+        ftgl_memory_buffers.buffers[buffer - 1].stats.draws++;
+        ftgl_memory_buffers.buffers[buffer - 1].stats.indices += count;
+}
+
+static void *ftgl_stream_memory_fence(void *userdata, GLuint buffer)
+{
+        // Any non-NULL fence, there is nothing to wait for
+        ftgl_memory_buffers.buffers[buffer - 1].stats.fences++;
+        return &ftgl_memory_buffers;
+}
+
+static void ftgl_stream_memory_wait(void *userdata, GLuint buffer, void *fence)
+{
+        ftgl_memory_buffers.buffers[buffer - 1].stats.waits++;
+}
+
+static void ftgl_stream_memory_destroy(void *userdata, GLuint vertex_array, GLuint buffer,
+                                       void *mapped)
+{
+        FTGL_FREE(ftgl_memory_buffers.buffers[buffer - 1].data);
+        ftgl_memory_buffers.buffers[buffer - 1].data = NULL;
+        while (ftgl_memory_buffers.size > 0
+               && !ftgl_memory_buffers.buffers[ftgl_memory_buffers.size - 1].data) {
+                ftgl_memory_buffers.size--;
+        }
+
+        if (ftgl_memory_buffers.size == 0) {
+                FTGL_FREE(ftgl_memory_buffers.buffers);
+                memset(&ftgl_memory_buffers, 0, sizeof(ftgl_memory_buffers));
+        }
+}
+
+const struct ftgl_stream_backend_t ftgl_stream_backend_memory = {
+        ftgl_stream_memory_create,
+        ftgl_stream_memory_upload,
+        ftgl_stream_memory_draw,
+        ftgl_stream_memory_fence,
+        ftgl_stream_memory_wait,
+        ftgl_stream_memory_destroy,
+        NULL,
+};
+
+FTGLDEF const unsigned char *ftgl_memory_buffer_data(GLuint buffer)
+{
+        if (buffer == 0 || buffer > ftgl_memory_buffers.size
+            || !ftgl_memory_buffers.buffers[buffer - 1].data) {
+                FTGL_LOG_MESSAGE("Not a buffer of the memory backend!");
+                return NULL;
+        }
+        return ftgl_memory_buffers.buffers[buffer - 1].data;
+}
+
+/* Counts what happened to @buffer since it was created */
+FTGLDEF const struct ftgl_stream_stats_t *ftgl_memory_buffer_stats(GLuint buffer)
+{
+        if (buffer == 0 || buffer > ftgl_memory_buffers.size
+            || !ftgl_memory_buffers.buffers[buffer - 1].data) {
+                FTGL_LOG_MESSAGE("Not a buffer of the memory backend!");
+                return NULL;
+        }
+        return &ftgl_memory_buffers.buffers[buffer - 1].stats;
+}
+
+static ftgl_return_t ftgl_atlas_add_page(ftgl_atlas_t atlas)
+{
+        ftgl_return_t ret;
+        size_t new_capacity;
+        struct ftgl_atlas_page_t *new_pages, *page;
+
+        if (atlas->size == atlas->capacity) {
+                new_capacity = atlas->capacity << 1;
+                new_pages = FTGL_REALLOC(atlas->pages, sizeof(*new_pages)
+                                         * new_capacity);
+                if (!new_pages) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        return FTGL_MEMORY_ERROR;
+                }
+
+                atlas->pages = new_pages;
+                atlas->capacity = new_capacity;
+        }
+
+        page = &atlas->pages[atlas->size];
+        page->texture = 0;
+        page->ndirty = 0;
+        page->packer = ftgl_packer_create(atlas->packmode, atlas->width,
+                                          atlas->height);
+        if (!page->packer) {
+                return FTGL_MEMORY_ERROR;
+        }
+
+        page->pixels = FTGL_CALLOC((size_t) atlas->width * atlas->height * atlas->depth,
+                                   sizeof(*page->pixels));
+        if (!page->pixels) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                ftgl_packer_free(&page->packer);
+                return FTGL_MEMORY_ERROR;
+        }
+
+        ret = atlas->backend->create(atlas->backend->userdata, atlas->width,
+                                     atlas->height, atlas->depth, &page->texture);
+        if (ret != FTGL_NO_ERROR) {
+                FTGL_FREE(page->pixels);
+                ftgl_packer_free(&page->packer);
+                return ret;
+        }
+
+        atlas->size++;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_atlas_t ftgl_atlas_create(int width, int height, int depth,
+                                       ftgl_packmode_t packmode, int flags,
+                                       ftgl_backend_t backend)
+{
+        ftgl_atlas_t atlas;
+        if (width <= 0 || height <= 0) {
+                FTGL_LOG_MESSAGE("Invalid dimensions for atlas!");
+                return NULL;
+        }
+
+        if (depth != 1 && depth != 3) {
+                FTGL_LOG_MESSAGE("Atlas depth must be 1 or 3!");
+                return NULL;
+        }
+
+        atlas = FTGL_MALLOC(sizeof(*atlas));
+        if (!atlas) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        atlas->width = width;
+        atlas->height = height;
+        atlas->depth = depth;
+        atlas->packmode = packmode;
+        atlas->flags = flags;
+        atlas->backend = backend ? backend : &ftgl_backend_opengl;
+        atlas->size = 0;
+        atlas->max_pages = 0;
+        atlas->refcount = 1;
+        atlas->capacity = FTGL_ATLAS_CAPACITY;
+        atlas->pages = FTGL_MALLOC(sizeof(*atlas->pages) * atlas->capacity);
+        if (!atlas->pages) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                FTGL_FREE(atlas);
+                return NULL;
+        }
+
+        if (ftgl_atlas_add_page(atlas) != FTGL_NO_ERROR) {
+                FTGL_FREE(atlas->pages);
+                FTGL_FREE(atlas);
+                return NULL;
+        }
+        return atlas;
+}
+
+/**
+ * Takes another reference to @atlas, released with ftgl_atlas_free.
+ */
+FTGLDEF ftgl_atlas_t ftgl_atlas_retain(ftgl_atlas_t atlas)
+{
+        atlas->refcount++;
+        return atlas;
+}
+
+/**
+ * Limits @atlas to @max_pages pages, or lifts the limit with 0. The
+ * budget belongs to the atlas, so it applies to every font sharing it.
+ */
+FTGLDEF ftgl_return_t ftgl_atlas_set_max_pages(ftgl_atlas_t atlas, size_t max_pages)
+{
+        if (max_pages > 0 && max_pages < atlas->size) {
+                FTGL_LOG_MESSAGE("The atlas already has more pages than the budget!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        atlas->max_pages = max_pages;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Holds back uploads of @atlas until ftgl_atlas_flush, or uploads
+ * what is pending and goes back to uploading on every write.
+ */
+FTGLDEF void ftgl_atlas_set_deferred(ftgl_atlas_t atlas, int deferred)
+{
+        if (deferred) {
+                atlas->flags |= FTGL_ATLAS_DEFERRED;
+        } else {
+                atlas->flags &= ~FTGL_ATLAS_DEFERRED;
+                ftgl_atlas_flush(atlas);
+        }
+}
+
+FTGLDEF ftgl_return_t ftgl_atlas_insert(ftgl_atlas_t atlas, int width, int height,
+                                        ivec4_t *rect, GLuint *page)
+{
+        size_t i;
+        ftgl_return_t ret;
+
+        if (width > atlas->width || height > atlas->height) {
+                FTGL_LOG_MESSAGE("Glyph is larger than an atlas page!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        for (i = 0; i < atlas->size; i++) {
+                ret = ftgl_packer_insert(atlas->pages[i].packer, width, height, rect);
+                if (ret == FTGL_NO_ERROR) {
+                        *page = i;
+                        return FTGL_NO_ERROR;
+                }
+
+                if (ret != FTGL_ATLAS_FULL_ERROR) {
+                        return ret;
+                }
+        }
+
+        if (atlas->max_pages > 0 && atlas->size >= atlas->max_pages) {
+                return FTGL_ATLAS_FULL_ERROR;
+        }
+
+        if ((ret = ftgl_atlas_add_page(atlas)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        *page = atlas->size - 1;
+        return ftgl_packer_insert(atlas->pages[*page].packer, width, height, rect);
+}
+
+FTGLDEF ftgl_return_t ftgl_atlas_release(ftgl_atlas_t atlas, GLuint page, ivec4_t rect)
+{
+        if (page >= atlas->size) {
+                FTGL_LOG_MESSAGE("Atlas page out of range!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+        return ftgl_packer_release(atlas->pages[page].packer, rect);
+}
+
+FTGLDEF ftgl_return_t ftgl_atlas_rebuild(ftgl_atlas_t atlas, GLuint page,
+                                         const ivec4_t *occupied, size_t count)
+{
+        if (page >= atlas->size) {
+                FTGL_LOG_MESSAGE("Atlas page out of range!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+        return ftgl_packer_rebuild(atlas->pages[page].packer, occupied, count);
+}
+
+static ivec4_t ftgl_rect_union(ivec4_t a, ivec4_t b)
+{
+        int x0, y0, x1, y1;
+        x0 = a.x < b.x ? a.x : b.x;
+        y0 = a.y < b.y ? a.y : b.y;
+        x1 = a.x + a.z > b.x + b.z ? a.x + a.z : b.x + b.z;
+        y1 = a.y + a.w > b.y + b.w ? a.y + a.w : b.y + b.w;
+        return ll_ivec4_create4i(x0, y0, x1 - x0, y1 - y0);
+}
+
+static size_t ftgl_rect_area(ivec4_t a)
+{
+        return (size_t) a.z * a.w;
+}
+
+/**
+ * Adds @rect to the dirty regions of @page. It is merged into an
+ * existing region whenever the merged upload wastes at most
+ * FTGL_ATLAS_DIRTY_SLACK texels, or into the cheapest region when the
+ * list is already full.
+ */
+static void ftgl_atlas_page_mark_dirty(struct ftgl_atlas_page_t *page, ivec4_t rect)
+{
+        size_t i, best_idx, cost, best_cost;
+        ivec4_t merged;
+
+        best_idx = page->ndirty;
+        best_cost = SIZE_MAX;
+        for (i = 0; i < page->ndirty; i++) {
+                merged = ftgl_rect_union(page->dirty[i], rect);
+                cost = ftgl_rect_area(merged) - ftgl_rect_area(page->dirty[i]);
+                if (cost < best_cost) {
+                        best_idx = i;
+                        best_cost = cost;
+                }
+        }
+
+        if (best_idx < page->ndirty
+            && (best_cost <= ftgl_rect_area(rect) + FTGL_ATLAS_DIRTY_SLACK
+                || page->ndirty == FTGL_ATLAS_DIRTY_CAPACITY)) {
+                rect = ftgl_rect_union(page->dirty[best_idx], rect);
+                page->dirty[best_idx] = page->dirty[--page->ndirty];
+                // The grown region may now swallow others as well
+                ftgl_atlas_page_mark_dirty(page, rect);
+                return;
+        }
+
+        page->dirty[page->ndirty++] = rect;
+}
+
+FTGLDEF void ftgl_atlas_write(ftgl_atlas_t atlas, GLuint page, ivec4_t rect,
+                              const unsigned char *buffer)
+{
+        int y;
+        size_t row;
+        unsigned char *dst;
+        struct ftgl_atlas_page_t *atlas_page;
+
+        atlas_page = &atlas->pages[page];
+        row = (size_t) rect.z * atlas->depth;
+        dst = atlas_page->pixels + ((size_t) rect.y * atlas->width + rect.x) * atlas->depth;
+        for (y = 0; y < rect.w; y++) {
+                memcpy(dst, buffer, row);
+                dst += (size_t) atlas->width * atlas->depth;
+                buffer += row;
+        }
+
+        ftgl_atlas_page_mark_dirty(atlas_page, rect);
+        if (!(atlas->flags & FTGL_ATLAS_DEFERRED)) {
+                ftgl_atlas_flush(atlas);
+        }
+}
+
+FTGLDEF void ftgl_atlas_flush(ftgl_atlas_t atlas)
+{
+        size_t i;
+        struct ftgl_atlas_page_t *page;
+
+        for (i = 0; i < atlas->size; i++) {
+                page = &atlas->pages[i];
+                if (page->ndirty == 0) continue;
+                atlas->backend->upload(atlas->backend->userdata, page->texture,
+                                       page->dirty, page->ndirty, page->pixels,
+                                       atlas->width, atlas->depth);
+                page->ndirty = 0;
+        }
+}
+
+FTGLDEF float ftgl_atlas_occupancy(ftgl_atlas_t atlas)
+{
+        size_t i, used;
+        used = 0;
+        for (i = 0; i < atlas->size; i++) {
+                used += atlas->pages[i].packer->used;
+        }
+        return used / ((float) atlas->width * atlas->height * atlas->size);
+}
+
+FTGLDEF void ftgl_atlas_free(ftgl_atlas_t *atlas)
+{
+        size_t i;
+        if (--(*atlas)->refcount > 0) {
+                *atlas = NULL;
+                return;
+        }
+
+        for (i = 0; i < (*atlas)->size; i++) {
+                (*atlas)->backend->destroy((*atlas)->backend->userdata,
+                                           (*atlas)->pages[i].texture);
+                ftgl_packer_free(&(*atlas)->pages[i].packer);
+                FTGL_FREE((*atlas)->pages[i].pixels);
+        }
+
+        FTGL_FREE((*atlas)->pages);
+        (*atlas)->pages = NULL;
+        (*atlas)->size = 0;
+        (*atlas)->capacity = 0;
+        FTGL_FREE(*atlas);
+}
+
+// meiyan hash function
+// Source: http://www.sanmayce.com/Fastest_Hash/
+static inline uint32_t ftgl_string_hash(const char *s, size_t len)
+{
+        uint32_t hash = 0x811c9dc5;
+        while (len >= 8) {
+                hash = (hash ^ ((((*(uint32_t *) s) << 5) | ((*(uint32_t *) s) >> 27))
+                                ^ *(uint32_t *)(s + 4))) * 0xad3e7;
+                len -= 8;
+                s += 8;
+        }
+
+        if (len & 4) {
+                hash = (hash ^ *(uint16_t *) s) * 0xad3e7;
+                s += 2;
+                hash = (hash ^ *(uint16_t *) s) * 0xad3e7;
+                s += 2;
+        }
+
+        if (len & 2) {
+                hash = (hash ^ *(uint16_t *) s) * 0xad3e7;
+                s += 2;
+        }
+
+        if (len & 1) {
+                hash = (hash ^ *s) * 0xad3e7;
+        }
+
+        return hash ^ (hash >> 16);
+}
+
+static ftgl_return_t ftgl_font_manager_init(void)
+{
+        ftgl_font_manager.size = 0;
+        ftgl_font_manager.capacity = FTGL_FONT_MANAGER_CAPACITY;
+        ftgl_font_manager.nodes = FTGL_CALLOC(ftgl_font_manager.capacity,
+                                              sizeof(*ftgl_font_manager.nodes));
+        if (!ftgl_font_manager.nodes) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_library_init(void)
+{
+        FT_Error ft_error;
+        ftgl_return_t ret;
+        if ((ft_error = FT_Init_FreeType(&ftgl_font_library)) != FT_Err_Ok) {
+                FTGL_LOG_MESSAGE("Failed to initialise FreeType!");
+                return FTGL_FREETYPE_ERROR;
+        }
+
+        if ((ret = ftgl_font_manager_init()) != FTGL_NO_ERROR) {
+                return ret;
+        }
+        return FTGL_NO_ERROR;
+}
+
+static ftgl_font_node_t ftgl_font_node_create(const char *name, const char *path,
+                                              size_t ptsize)
+{
+        ftgl_return_t ret;
+        ftgl_font_node_t font_node;
+        font_node = FTGL_MALLOC(sizeof(*font_node));
+        if (!font_node) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        font_node->name = FTGL_STRDUP(name);
+        if (!font_node->name) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                FTGL_FREE(font_node);
+                return NULL;
+        }
+
+        font_node->font = ftgl_font_create();
+        if (!font_node->font) {
+                FTGL_FREE(font_node->name);
+                FTGL_FREE(font_node);
+                return NULL;
+        }
+
+        ret = ftgl_font_bind(font_node->font, path);
+        if (ret != FTGL_NO_ERROR) {
+                FTGL_FREE(font_node->name);
+                ftgl_font_free(&font_node->font);
+                FTGL_FREE(font_node);
+                return NULL;
+        }
+
+        ret = ftgl_font_set_size(font_node->font, ptsize);
+        if (ret != FTGL_NO_ERROR) {
+                FTGL_FREE(font_node->name);
+                ftgl_font_free(&font_node->font);
+                FTGL_FREE(font_node);
+                return NULL;
+        }
+
+        return font_node;
+}
+
+static ftgl_return_t ftgl_font_manager_resize(void)
+{
+        size_t new_capacity, i, j;
+        ftgl_font_node_t *new_nodes;
+        uint32_t idx0, idx1, real_idx;
+        new_capacity = ftgl_font_manager.capacity << 1;
+        new_nodes = FTGL_CALLOC(new_capacity, sizeof(*new_nodes));
+        if (!new_nodes) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        for (i = 0; i < ftgl_font_manager.capacity; i++) {
+                ftgl_font_node_t font_node = ftgl_font_manager.nodes[i];
+                if (!font_node) continue;
+                idx0 = ftgl_string_hash(font_node->name, strlen(font_node->name))
+                        & (new_capacity - 1);
+                idx1 = idx0 | 1;
+
+                for (j = 0; j <= new_capacity; j++) {
+                        real_idx = (idx0 + idx1 * j) & (new_capacity - 1);
+                        if (new_nodes[real_idx]) continue;
+                        new_nodes[real_idx] = font_node;
+                        break;
+                }
+        }
+
+        FTGL_FREE(ftgl_font_manager.nodes);
+        ftgl_font_manager.nodes = new_nodes;
+        ftgl_font_manager.capacity = new_capacity;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_manager_insert(const char *name, const char *path,
+                         size_t ptsize)
+{
+        ftgl_return_t ret;
+        size_t idx0, idx1, real_idx, i;
+        ftgl_font_node_t font_node, new_node;
+        if (!name || strlen(name) <= 0 || !path) {
+                FTGL_LOG_MESSAGE("Invalid arguments for font manager insertion!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        if (FTGL_FONT_MANAGER_RESIZEP()) {
+                if ((ret = ftgl_font_manager_resize()) != FTGL_NO_ERROR) {
+                        return ret;
+                }
+        }
+
+        new_node = ftgl_font_node_create(name, path, ptsize);
+        if (!new_node) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        idx0 = ftgl_string_hash(name, strlen(name)) & (ftgl_font_manager.capacity - 1);
+        idx1 = idx0 | 1;
+        for (i = 0; i <= ftgl_font_manager.capacity; i++) {
+                real_idx = (idx0 + idx1 * i) & (ftgl_font_manager.capacity - 1);
+                font_node = ftgl_font_manager.nodes[real_idx];
+                if (font_node) {
+                        if (strcmp(font_node->name, name) == 0)
+                                return FTGL_NO_ERROR;
+                        continue;
+                }
+
+                ftgl_font_manager.nodes[real_idx] = new_node;
+                break;
+        }
+
+        ftgl_font_manager.size++;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_font_t ftgl_font_manager_find(const char *name)
+{
+        ftgl_font_node_t font_node;
+        size_t idx0, idx1, real_idx, i;
+
+        idx0 = ftgl_string_hash(name, strlen(name));
+        idx0 = idx0 & (ftgl_font_manager.capacity - 1);
+        idx1 = idx0 | 1;
+        for (i = 0; i < ftgl_font_manager.capacity; i++) {
+                real_idx = (idx0 + idx1 * i) & (ftgl_font_manager.capacity - 1);
+                font_node = ftgl_font_manager.nodes[real_idx];
+                if (!font_node) return NULL;
+                if (font_node && strcmp(name, font_node->name) == 0) {
+                        return font_node->font;
+                }
+        }
+        return NULL;
+}
+
+FTGLDEF ftgl_font_t ftgl_font_create_with_backend(ftgl_backend_t backend)
+{
+        ftgl_font_t font;
+
+        font = FTGL_MALLOC(sizeof(*font));
+        if (!font) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        font->rendermode = FTGL_RENDERMODE_NORMAL;
+
+        font->atlas = ftgl_atlas_create(FTGL_FONT_ATLAS_WIDTH,
+                                        FTGL_FONT_ATLAS_HEIGHT, 1,
+                                        FTGL_PACKMODE_SKYLINE,
+                                        0, backend);
+        if (!font->atlas) {
+                FTGL_FREE(font);
+                return NULL;
+        }
+
+        font->glyphmap = ftgl_glyphmap_create();
+        if (!font->glyphmap) {
+                ftgl_atlas_free(&font->atlas);
+                FTGL_FREE(font);
+                return NULL;
+        }
+
+        font->sdf = ftgl_sdf_create();
+        if (!font->sdf) {
+                ftgl_glyphmap_free(&font->glyphmap);
+                ftgl_atlas_free(&font->atlas);
+                FTGL_FREE(font);
+                return NULL;
+        }
+
+        font->generation = 0;
+        font->eviction = 0;
+        font->evictions = 0;
+        font->evict_callback = NULL;
+        font->evict_userdata = NULL;
+        font->source = NULL;
+        font->size = 0.0;
+        font->pool = NULL;
+        font->sdf_spread = FTGL_FONT_SDF_SPREAD;
+        font->sdf_supersample = FTGL_FONT_SDF_SUPERSAMPLE;
+        font->sdf_filter = FTGL_FILTER_BOX;
+        font->scale = 1.0;
+        font->face = NULL;
+        font->face_size = NULL;
+        memset(font->runs, 0, sizeof(font->runs));
+        font->runs_newest = NULL;
+        font->runs_oldest = NULL;
+        font->nruns = 0;
+#ifdef FTGL_USE_HARFBUZZ
+        font->hb_font = NULL;
+#endif /* FTGL_USE_HARFBUZZ */
+        return font;
+}
+
+FTGLDEF ftgl_font_t ftgl_font_create(void)
+{
+        return ftgl_font_create_with_backend(&ftgl_backend_opengl);
+}
+
+FTGLDEF ftgl_font_t ftgl_font_create_headless(void)
+{
+        return ftgl_font_create_with_backend(&ftgl_backend_memory);
+}
+
+struct ftgl_raster_t {
+        /**
+         * The codepoint that was rasterized.
+         */
+        uint32_t codepoint;
+
+        /**
+         * The dimensions of @buffer, padding included.
+         */
+        int width;
+        int height;
+
+        /**
+         * The glyph metrics, see struct ftgl_glyph_t.
+         */
+        GLint offset_x;
+        GLint offset_y;
+        GLfloat advance_x;
+        GLfloat advance_y;
+
+        /**
+         * The padded glyph image, ready to be written into the atlas.
+         */
+        unsigned char *buffer;
+};
+
+/**
+ * Applies @size and the horizontal hinting transform to @face.
+ */
+static ftgl_return_t ftgl_face_set_size(FT_Face face, float size)
+{
+        FT_Error ft_error;
+        FT_Matrix matrix = {
+                (int)((1.0/FTGL_FONT_HRES)  * 0x10000L),
+                (int)((0.0)                 * 0x10000L),
+                (int)((0.0)                 * 0x10000L),
+                (int)((1.0)                 * 0x10000L)
+        };
+
+        ft_error = FT_Set_Char_Size(face, ftgl_float_to_F26Dot6(size),
+                                    0, FTGL_FONT_DPI * FTGL_FONT_HRES,
+                                    FTGL_FONT_DPI);
+        if (ft_error != FT_Err_Ok) {
+                FTGL_LOG_MESSAGE("Failed to set font size!");
+                return FTGL_FREETYPE_ERROR;
+        }
+
+        FT_Activate_Size(face->size);
+        FT_Set_Transform(face, &matrix, NULL);
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Returns the font's face with the font's size active on it. Fonts
+ * bound to the same source share the face, so they may only be used
+ * from one thread at a time.
+ */
+static inline FT_Face ftgl_font_face(ftgl_font_t font)
+{
+        if (font->face_size) {
+                FT_Activate_Size(font->face_size);
+        }
+        return font->face;
+}
+
+#ifndef FTGL_NO_THREADS
+struct ftgl_worker_t {
+        /**
+         * FreeType objects are not thread safe, so every worker
+         * owns a library and a face of its own.
+         */
+        FT_Library library;
+        FT_Face face;
+        ftgl_sdf_t sdf;
+
+        pthread_t thread;
+        struct ftgl_pool_t *pool;
+};
+
+struct ftgl_pool_t {
+        pthread_mutex_t lock;
+
+        /**
+         * Signalled when a batch is posted and when the last worker
+         * is done with it, respectively.
+         */
+        pthread_cond_t work;
+        pthread_cond_t done;
+
+        size_t size;
+        struct ftgl_worker_t *workers;
+
+        /**
+         * Incremented for every posted batch. Workers remember the
+         * last batch they took part in.
+         */
+        size_t batch;
+        size_t finished;
+        char quit;
+
+        /**
+         * The batch being rasterized. Slots are handed out in order
+         * through @next.
+         */
+        ftgl_font_t font;
+        const uint32_t *codepoints;
+        struct ftgl_raster_t *rasters;
+        size_t count;
+        size_t next;
+
+        /**
+         * Codepoints queued by ftgl_font_request_glyph. Workers take
+         * them from @head whenever no batch is posted.
+         */
+        size_t head;
+        size_t nrequests;
+        size_t requests_capacity;
+        uint32_t *requests;
+
+        /**
+         * Finished requests waiting for ftgl_font_poll, and the
+         * number of requests currently being rasterized.
+         */
+        size_t nresults;
+        size_t results_capacity;
+        struct ftgl_raster_t *results;
+        size_t active;
+
+        /**
+         * Signalled when the last queued request is finished.
+         */
+        pthread_cond_t idle;
+};
+
+static ftgl_return_t ftgl_font_rasterize(ftgl_font_t font, FT_Face face, ftgl_sdf_t sdf,
+                                         uint32_t codepoint, struct ftgl_raster_t *raster);
+
+/**
+ * Rasterizes slots of the current batch until none are left. Called
+ * with the pool lock held.
+ */
+static void ftgl_pool_drain(struct ftgl_pool_t *pool, FT_Face face, ftgl_sdf_t sdf)
+{
+        size_t i;
+        while (pool->next < pool->count) {
+                i = pool->next++;
+                pthread_mutex_unlock(&pool->lock);
+                ftgl_font_rasterize(pool->font, face, sdf, pool->codepoints[i],
+                                    &pool->rasters[i]);
+                pthread_mutex_lock(&pool->lock);
+        }
+}
+
+/**
+ * Rasterizes the oldest queued request and files the result for
+ * ftgl_font_poll. Called with the pool lock held.
+ */
+static void ftgl_pool_serve(struct ftgl_pool_t *pool, FT_Face face, ftgl_sdf_t sdf)
+{
+        uint32_t codepoint;
+        struct ftgl_raster_t raster, *results;
+
+        codepoint = pool->requests[pool->head++];
+        if (pool->head == pool->nrequests) {
+                pool->head = 0;
+                pool->nrequests = 0;
+        }
+
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+        ftgl_font_rasterize(pool->font, face, sdf, codepoint, &raster);
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+
+        if (pool->nresults == pool->results_capacity) {
+                results = FTGL_REALLOC(pool->results, sizeof(*results) * pool->results_capacity * 2);
+                if (!results) {
+                        // The glyph stays a placeholder
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        FTGL_FREE(raster.buffer);
+                        raster.buffer = NULL;
+                } else {
+                        pool->results = results;
+                        pool->results_capacity *= 2;
+                }
+        }
+
+        if (pool->nresults < pool->results_capacity) {
+                pool->results[pool->nresults++] = raster;
+        }
+
+        if (pool->active == 0 && pool->head == pool->nrequests) {
+                pthread_cond_broadcast(&pool->idle);
+        }
+}
+
+/**
+ * Waits until every queued request is rasterized, helping out on the
+ * calling thread with @face.
+ */
+static void ftgl_pool_wait(struct ftgl_pool_t *pool, FT_Face face, ftgl_sdf_t sdf)
+{
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head < pool->nrequests) {
+                ftgl_pool_serve(pool, face, sdf);
+        }
+        while (pool->active > 0) {
+                pthread_cond_wait(&pool->idle, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+}
+
+static void *ftgl_pool_work(void *arg)
+{
+        struct ftgl_worker_t *worker;
+        struct ftgl_pool_t *pool;
+        size_t batch;
+
+        worker = arg;
+        pool = worker->pool;
+
+        // Workers are created before any batch is posted
+        batch = 0;
+        pthread_mutex_lock(&pool->lock);
+        for (;;) {
+                while (!pool->quit && pool->batch == batch
+                       && pool->head == pool->nrequests) {
+                        pthread_cond_wait(&pool->work, &pool->lock);
+                }
+                if (pool->quit) break;
+
+                // Bulk loads block their caller, so they go first
+                if (pool->batch == batch) {
+                        ftgl_pool_serve(pool, worker->face, worker->sdf);
+                        continue;
+                }
+
+                batch = pool->batch;
+                ftgl_pool_drain(pool, worker->face, worker->sdf);
+                if (++pool->finished == pool->size) {
+                        pthread_cond_signal(&pool->done);
+                }
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+}
+
+/**
+ * (Re)opens the worker's face on the font's source and size. Only
+ * called while the workers are idle.
+ */
+static ftgl_return_t ftgl_worker_load(struct ftgl_worker_t *worker, ftgl_font_t font)
+{
+        if (worker->face) {
+                FT_Done_Face(worker->face);
+                worker->face = NULL;
+        }
+
+        if (FT_New_Memory_Face(worker->library, font->source->data, font->source->size,
+                               0, &worker->face) != FT_Err_Ok) {
+                FTGL_LOG_MESSAGE("Failed to create font!");
+                return FTGL_FREETYPE_ERROR;
+        }
+
+        if (font->size > 0.0) {
+                return ftgl_face_set_size(worker->face, font->size);
+        }
+        return FTGL_NO_ERROR;
+}
+
+static void ftgl_pool_free(struct ftgl_pool_t **pool)
+{
+        size_t i;
+        struct ftgl_worker_t *worker;
+
+        pthread_mutex_lock(&(*pool)->lock);
+        (*pool)->quit = 1;
+        pthread_cond_broadcast(&(*pool)->work);
+        pthread_mutex_unlock(&(*pool)->lock);
+
+        for (i = 0; i < (*pool)->size; i++) {
+                worker = &(*pool)->workers[i];
+                pthread_join(worker->thread, NULL);
+                if (worker->face) FT_Done_Face(worker->face);
+                FT_Done_FreeType(worker->library);
+                ftgl_sdf_free(&worker->sdf);
+        }
+
+        for (i = 0; i < (*pool)->nresults; i++) {
+                FTGL_FREE((*pool)->results[i].buffer);
+        }
+
+        pthread_cond_destroy(&(*pool)->idle);
+        pthread_cond_destroy(&(*pool)->done);
+        pthread_cond_destroy(&(*pool)->work);
+        pthread_mutex_destroy(&(*pool)->lock);
+        FTGL_FREE((*pool)->results);
+        FTGL_FREE((*pool)->requests);
+        FTGL_FREE((*pool)->workers);
+        FTGL_FREE(*pool);
+        *pool = NULL;
+}
+
+static ftgl_return_t ftgl_pool_create(struct ftgl_pool_t **pool, ftgl_font_t font, size_t size)
+{
+        struct ftgl_pool_t *p;
+        struct ftgl_worker_t *worker;
+        ftgl_return_t ret;
+
+        p = FTGL_CALLOC(1, sizeof(*p));
+        if (!p) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        p->workers = FTGL_CALLOC(size ? size : 1, sizeof(*p->workers));
+        p->requests = FTGL_MALLOC(sizeof(*p->requests) * FTGL_POOL_CAPACITY);
+        p->results = FTGL_MALLOC(sizeof(*p->results) * FTGL_POOL_CAPACITY);
+        if (!p->workers || !p->requests || !p->results) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                FTGL_FREE(p->results);
+                FTGL_FREE(p->requests);
+                FTGL_FREE(p->workers);
+                FTGL_FREE(p);
+                return FTGL_MEMORY_ERROR;
+        }
+
+        p->font = font;
+        p->requests_capacity = FTGL_POOL_CAPACITY;
+        p->results_capacity = FTGL_POOL_CAPACITY;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->work, NULL);
+        pthread_cond_init(&p->done, NULL);
+        pthread_cond_init(&p->idle, NULL);
+
+        // Bump size as workers come up so a failure only unwinds those
+        ret = FTGL_NO_ERROR;
+        for (p->size = 0; p->size < size; p->size++) {
+                worker = &p->workers[p->size];
+                worker->pool = p;
+                if (!(worker->sdf = ftgl_sdf_create())) {
+                        ret = FTGL_MEMORY_ERROR;
+                        break;
+                }
+
+                if (FT_Init_FreeType(&worker->library) != FT_Err_Ok) {
+                        FTGL_LOG_MESSAGE("Failed to initialize FreeType!");
+                        ftgl_sdf_free(&worker->sdf);
+                        ret = FTGL_FREETYPE_ERROR;
+                        break;
+                }
+
+                if ((ret = ftgl_worker_load(worker, font)) != FTGL_NO_ERROR) {
+                        FT_Done_FreeType(worker->library);
+                        ftgl_sdf_free(&worker->sdf);
+                        break;
+                }
+
+                if (pthread_create(&worker->thread, NULL, ftgl_pool_work, worker) != 0) {
+                        FTGL_LOG_MESSAGE("Failed to create a worker thread!");
+                        FT_Done_Face(worker->face);
+                        FT_Done_FreeType(worker->library);
+                        ftgl_sdf_free(&worker->sdf);
+                        ret = FTGL_MEMORY_ERROR;
+                        break;
+                }
+        }
+
+        if (ret != FTGL_NO_ERROR) {
+                ftgl_pool_free(&p);
+                return ret;
+        }
+
+        *pool = p;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Points every worker at the font's current path and size.
+ */
+static ftgl_return_t ftgl_pool_reload(struct ftgl_pool_t *pool, ftgl_font_t font)
+{
+        size_t i;
+        ftgl_return_t ret;
+
+        ftgl_pool_wait(pool, ftgl_font_face(font), font->sdf);
+        for (i = 0; i < pool->size; i++) {
+                if ((ret = ftgl_worker_load(&pool->workers[i], font)) != FTGL_NO_ERROR) {
+                        return ret;
+                }
+        }
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Rasterizes @count codepoints across the workers and the calling
+ * thread, returning once all of them are done.
+ */
+static void ftgl_pool_rasterize(struct ftgl_pool_t *pool, ftgl_font_t font,
+                                const uint32_t *codepoints, struct ftgl_raster_t *rasters,
+                                size_t count)
+{
+        pthread_mutex_lock(&pool->lock);
+        pool->codepoints = codepoints;
+        pool->rasters = rasters;
+        pool->count = count;
+        pool->next = 0;
+        pool->finished = 0;
+        pool->batch++;
+        pthread_cond_broadcast(&pool->work);
+
+        ftgl_pool_drain(pool, ftgl_font_face(font), font->sdf);
+        while (pool->finished < pool->size) {
+                pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+}
+#endif /* FTGL_NO_THREADS */
+
+static struct {
+        ftgl_source_t head;
+#ifndef FTGL_NO_THREADS
+        pthread_mutex_t lock;
+#endif /* FTGL_NO_THREADS */
+} ftgl_source_registry = {
+        NULL,
+#ifndef FTGL_NO_THREADS
+        PTHREAD_MUTEX_INITIALIZER,
+#endif /* FTGL_NO_THREADS */
+};
+
+static void ftgl_source_lock(void)
+{
+#ifndef FTGL_NO_THREADS
+        pthread_mutex_lock(&ftgl_source_registry.lock);
+#endif /* FTGL_NO_THREADS */
+}
+
+static void ftgl_source_unlock(void)
+{
+#ifndef FTGL_NO_THREADS
+        pthread_mutex_unlock(&ftgl_source_registry.lock);
+#endif /* FTGL_NO_THREADS */
+}
+
+/* Maps, or without mmap reads, the whole of @path into @source */
+static ftgl_return_t ftgl_source_load(ftgl_source_t source, const char *path)
+{
+#ifdef FTGL_HAS_MMAP
+        int fd;
+        struct stat st;
+        void *data;
+
+        if ((fd = open(path, O_RDONLY)) < 0) {
+                FTGL_LOG_MESSAGE("Failed to open '%s'!", path);
+                return FTGL_IO_ERROR;
+        }
+
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+                FTGL_LOG_MESSAGE("Failed to read '%s'!", path);
+                close(fd);
+                return FTGL_IO_ERROR;
+        }
+
+        // The mapping outlives the descriptor
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+                FTGL_LOG_MESSAGE("Failed to map '%s'!", path);
+                return FTGL_IO_ERROR;
+        }
+
+        source->data = data;
+        source->size = st.st_size;
+        source->kind = FTGL_SOURCE_MAPPED;
+        return FTGL_NO_ERROR;
+#else /* !defined(FTGL_HAS_MMAP) */
+        FILE *file;
+        unsigned char *data;
+        long size;
+
+        if (!(file = fopen(path, "rb"))) {
+                FTGL_LOG_MESSAGE("Failed to open '%s'!", path);
+                return FTGL_IO_ERROR;
+        }
+
+        if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0
+            || fseek(file, 0, SEEK_SET) != 0) {
+                FTGL_LOG_MESSAGE("Failed to read '%s'!", path);
+                fclose(file);
+                return FTGL_IO_ERROR;
+        }
+
+        data = FTGL_MALLOC(size);
+        if (!data) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                fclose(file);
+                return FTGL_MEMORY_ERROR;
+        }
+
+        if (fread(data, 1, size, file) != (size_t) size) {
+                FTGL_LOG_MESSAGE("Failed to read '%s'!", path);
+                FTGL_FREE(data);
+                fclose(file);
+                return FTGL_IO_ERROR;
+        }
+        fclose(file);
+
+        source->data = data;
+        source->size = size;
+        source->kind = FTGL_SOURCE_COPIED;
+        return FTGL_NO_ERROR;
+#endif /* FTGL_HAS_MMAP */
+}
+
+/**
+ * Returns a reference to the source for @path, mapping the file only
+ * if no other reference to it is held.
+ */
+FTGLDEF ftgl_source_t ftgl_source_open(const char *path)
+{
+        ftgl_source_t source;
+
+        ftgl_source_lock();
+        for (source = ftgl_source_registry.head; source; source = source->next) {
+                if (strcmp(source->path, path) == 0) {
+                        source->refcount++;
+                        ftgl_source_unlock();
+                        return source;
+                }
+        }
+
+        source = FTGL_CALLOC(1, sizeof(*source));
+        if (!source || !(source->path = FTGL_STRDUP(path))) {
+                ftgl_source_unlock();
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                FTGL_FREE(source);
+                return NULL;
+        }
+
+        if (ftgl_source_load(source, path) != FTGL_NO_ERROR) {
+                ftgl_source_unlock();
+                FTGL_FREE(source->path);
+                FTGL_FREE(source);
+                return NULL;
+        }
+
+        source->refcount = 1;
+        source->next = ftgl_source_registry.head;
+        ftgl_source_registry.head = source;
+        ftgl_source_unlock();
+        return source;
+}
+
+/**
+ * Wraps @size bytes of font file at @data, such as a font embedded in
+ * the executable. The bytes are not copied, they must outlive every
+ * font bound to the source.
+ */
+FTGLDEF ftgl_source_t ftgl_source_create_memory(const unsigned char *data, size_t size)
+{
+        ftgl_source_t source;
+
+        if (!data || size == 0) {
+                FTGL_LOG_MESSAGE("Invalid font data!");
+                return NULL;
+        }
+
+        source = FTGL_CALLOC(1, sizeof(*source));
+        if (!source) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        source->data = data;
+        source->size = size;
+        source->kind = FTGL_SOURCE_BORROWED;
+        source->refcount = 1;
+        return source;
+}
+
+/**
+ * Drops a reference to @source, releasing it with the last one.
+ */
+FTGLDEF void ftgl_source_release(ftgl_source_t *source)
+{
+        ftgl_source_t *link;
+
+        if (!*source) {
+                return;
+        }
+
+        ftgl_source_lock();
+        if (--(*source)->refcount > 0) {
+                ftgl_source_unlock();
+                *source = NULL;
+                return;
+        }
+
+        for (link = &ftgl_source_registry.head; *link; link = &(*link)->next) {
+                if (*link == *source) {
+                        *link = (*source)->next;
+                        break;
+                }
+        }
+        ftgl_source_unlock();
+
+        switch ((*source)->kind) {
+        case FTGL_SOURCE_MAPPED:
+#ifdef FTGL_HAS_MMAP
+                munmap((void *) (*source)->data, (*source)->size);
+#endif /* FTGL_HAS_MMAP */
+                break;
+        case FTGL_SOURCE_COPIED:
+                FTGL_FREE((void *) (*source)->data);
+                break;
+        case FTGL_SOURCE_BORROWED:
+                break;
+        }
+
+        FTGL_FREE((*source)->path);
+        FTGL_FREE(*source);
+        *source = NULL;
+}
+
+/**
+ * Returns the face shared by the fonts bound to @source, opening it
+ * for the first of them.
+ */
+static ftgl_return_t ftgl_source_acquire_face(ftgl_source_t source, FT_Face *face)
+{
+        ftgl_source_lock();
+        if (!source->face && FT_New_Memory_Face(ftgl_font_library, source->data,
+                                                source->size, 0, &source->face)
+            != FT_Err_Ok) {
+                source->face = NULL;
+                ftgl_source_unlock();
+                FTGL_LOG_MESSAGE("Failed to create font!");
+                return FTGL_FREETYPE_ERROR;
+        }
+
+        source->faces++;
+        *face = source->face;
+        ftgl_source_unlock();
+        return FTGL_NO_ERROR;
+}
+
+static void ftgl_source_release_face(ftgl_source_t source)
+{
+        ftgl_source_lock();
+        if (--source->faces == 0) {
+                FT_Done_Face(source->face);
+                source->face = NULL;
+        }
+        ftgl_source_unlock();
+}
+
+/* Empties the run cache, leaving queued runs to their renderers */
+static void ftgl_font_clear_runs(ftgl_font_t font)
+{
+        ftgl_run_t run, older;
+
+        for (run = font->runs_newest; run; run = older) {
+                older = run->older;
+                run->cached = 0;
+                if (run->pins == 0) {
+                        FTGL_FREE(run);
+                }
+        }
+        memset(font->runs, 0, sizeof(font->runs));
+        font->runs_newest = NULL;
+        font->runs_oldest = NULL;
+        font->nruns = 0;
+}
+
+/* Gives up the font's size and its share of the face */
+static void ftgl_font_unbind(ftgl_font_t font)
+{
+        // Runs were shaped with the face about to go
+        ftgl_font_clear_runs(font);
+#ifdef FTGL_USE_HARFBUZZ
+        if (font->hb_font) {
+                hb_font_destroy(font->hb_font);
+                font->hb_font = NULL;
+        }
+#endif /* FTGL_USE_HARFBUZZ */
+        if (font->face) {
+                FT_Done_Size(font->face_size);
+                ftgl_source_release_face(font->source);
+                font->face_size = NULL;
+                font->face = NULL;
+        }
+        ftgl_source_release(&font->source);
+}
+
+/**
+ * Binds the font to @source, taking a reference to it. The font gets
+ * a size of its own on the face every font bound to @source shares.
+ */
+FTGLDEF ftgl_return_t ftgl_font_bind_source(ftgl_font_t font, ftgl_source_t source)
+{
+        ftgl_return_t ret;
+
+        if (!source) {
+                FTGL_LOG_MESSAGE("Invalid font source!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        ftgl_source_lock();
+        source->refcount++;
+        ftgl_source_unlock();
+        ftgl_font_unbind(font);
+        font->source = source;
+        font->size = 0.0;
+
+        if ((ret = ftgl_source_acquire_face(source, &font->face)) != FTGL_NO_ERROR) {
+                font->face = NULL;
+                ftgl_source_release(&font->source);
+                return ret;
+        }
+
+        if (FT_New_Size(font->face, &font->face_size) != FT_Err_Ok) {
+                FTGL_LOG_MESSAGE("Failed to create font size!");
+                font->face_size = NULL;
+                ftgl_source_release_face(source);
+                font->face = NULL;
+                ftgl_source_release(&font->source);
+                return FTGL_FREETYPE_ERROR;
+        }
+
+#ifndef FTGL_NO_THREADS
+        if (font->pool) {
+                return ftgl_pool_reload(font->pool, font);
+        }
+#endif /* FTGL_NO_THREADS */
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_bind_memory(ftgl_font_t font, const unsigned char *data,
+                                            size_t size)
+{
+        ftgl_source_t source;
+        ftgl_return_t ret;
+
+        if (!(source = ftgl_source_create_memory(data, size))) {
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        ret = ftgl_font_bind_source(font, source);
+        ftgl_source_release(&source);
+        return ret;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_bind(ftgl_font_t font, const char *path)
+{
+        ftgl_source_t source;
+        ftgl_return_t ret;
+
+        if (!(source = ftgl_source_open(path))) {
+                return FTGL_IO_ERROR;
+        }
+
+        ret = ftgl_font_bind_source(font, source);
+        ftgl_source_release(&source);
+        return ret;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_size(ftgl_font_t font, float size)
+{
+        ftgl_return_t ret;
+
+        if (FT_HAS_FIXED_SIZES(font->face)) {
+                FTGL_LOG_MESSAGE("Can't set size for fixed sized fonts!");
+                return FTGL_FREETYPE_ERROR;
+        }
+
+        if ((ret = ftgl_face_set_size(ftgl_font_face(font), size)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        FT_Size_Metrics metrics = font->face->size->metrics;
+        font->ascender = metrics.ascender >> 6;
+        font->descender = metrics.descender >> 6;
+        font->height = metrics.height >> 6;
+        font->linegap = font->height - font->ascender + font->descender;
+        font->size = size;
+
+#ifndef FTGL_NO_THREADS
+        if (font->pool) {
+                return ftgl_pool_reload(font->pool, font);
+        }
+#endif /* FTGL_NO_THREADS */
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Finishes and commits every glyph the font's workers have been asked
+ * for, so that settings they read while rasterizing can be changed.
+ */
+static void ftgl_font_quiesce(ftgl_font_t font)
+{
+#ifndef FTGL_NO_THREADS
+        if (font->pool) {
+                // Don't strand requested glyphs as placeholders
+                ftgl_pool_wait(font->pool, ftgl_font_face(font), font->sdf);
+                ftgl_font_poll(font, 0);
+        }
+#else /* defined(FTGL_NO_THREADS) */
+        (void)font;
+#endif /* FTGL_NO_THREADS */
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_threads(ftgl_font_t font, size_t threads)
+{
+#ifndef FTGL_NO_THREADS
+        if (font->pool) {
+                ftgl_font_quiesce(font);
+                ftgl_pool_free(&font->pool);
+        }
+
+        // The calling thread always rasterizes its share too
+        if (threads <= 1) {
+                return FTGL_NO_ERROR;
+        }
+
+        if (!font->source) {
+                FTGL_LOG_MESSAGE("Bind a font before adding threads!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        return ftgl_pool_create(&font->pool, font, threads - 1);
+#else /* defined(FTGL_NO_THREADS) */
+        if (threads > 1) {
+                FTGL_LOG_MESSAGE("Threads are disabled!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+        return FTGL_NO_ERROR;
+#endif /* FTGL_NO_THREADS */
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_packmode(ftgl_font_t font, ftgl_packmode_t mode)
+{
+        ftgl_atlas_t atlas;
+        if (font->glyphmap->size > 0) {
+                FTGL_LOG_MESSAGE("Can't change the packing mode once glyphs are loaded!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        atlas = ftgl_atlas_create(font->atlas->width, font->atlas->height,
+                                  font->atlas->depth, mode, font->atlas->flags,
+                                  font->atlas->backend);
+        if (!atlas) {
+                return FTGL_MEMORY_ERROR;
+        }
+
+        ftgl_atlas_free(&font->atlas);
+        font->atlas = atlas;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Makes the font put its glyphs into @atlas, which any number of fonts
+ * and sizes may share so that all their text is drawn from the same
+ * textures. Every font still keeps a glyphmap of its own. The atlas
+ * has to have one channel, or three for FTGL_RENDERMODE_MSDF.
+ */
+FTGLDEF ftgl_return_t ftgl_font_set_atlas(ftgl_font_t font, ftgl_atlas_t atlas)
+{
+        if (font->glyphmap->size > 0) {
+                FTGL_LOG_MESSAGE("Can't change the atlas once glyphs are loaded!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        if (atlas->depth != (font->rendermode == FTGL_RENDERMODE_MSDF ? 3 : 1)) {
+                FTGL_LOG_MESSAGE("The atlas depth doesn't suit the render mode!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        ftgl_atlas_retain(atlas);
+        ftgl_atlas_free(&font->atlas);
+        font->atlas = atlas;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_sdf_spread(ftgl_font_t font, int spread)
+{
+        ftgl_font_quiesce(font);
+        if (spread < FTGL_FONT_SDF_SPREAD_MIN || spread > FTGL_FONT_SDF_SPREAD_MAX) {
+                FTGL_LOG_MESSAGE("The SDF spread must be between %d and %d!",
+                                 FTGL_FONT_SDF_SPREAD_MIN, FTGL_FONT_SDF_SPREAD_MAX);
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        font->sdf_spread = spread;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_sdf_supersample(ftgl_font_t font, int factor,
+                                                    ftgl_filter_t filter)
+{
+        ftgl_font_quiesce(font);
+        if (factor < 1 || factor > FTGL_FONT_SDF_SUPERSAMPLE_MAX) {
+                FTGL_LOG_MESSAGE("The supersampling factor must be between 1 and %d!",
+                                 FTGL_FONT_SDF_SUPERSAMPLE_MAX);
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        if (filter != FTGL_FILTER_BOX && filter != FTGL_FILTER_LANCZOS) {
+                FTGL_LOG_MESSAGE("Unknown reduction filter!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        font->sdf_supersample = factor;
+        font->sdf_filter = filter;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_rendermode(ftgl_font_t font, ftgl_rendermode_t mode)
+{
+        int depth;
+        ftgl_atlas_t atlas;
+
+        // Workers read the mode while they rasterize
+        ftgl_font_quiesce(font);
+
+        // Only FTGL_RENDERMODE_MSDF needs more than one channel
+        depth = mode == FTGL_RENDERMODE_MSDF ? 3 : 1;
+        if (depth != font->atlas->depth) {
+                if (font->glyphmap->size > 0) {
+                        FTGL_LOG_MESSAGE("Can't change the atlas depth once glyphs are loaded!");
+                        return FTGL_ARGUMENT_ERROR;
+                }
+
+                atlas = ftgl_atlas_create(font->atlas->width, font->atlas->height, depth,
+                                          font->atlas->packmode, font->atlas->flags,
+                                          font->atlas->backend);
+                if (!atlas) {
+                        return FTGL_MEMORY_ERROR;
+                }
+
+                atlas->max_pages = font->atlas->max_pages;
+                ftgl_atlas_free(&font->atlas);
+                font->atlas = atlas;
+        }
+
+        font->rendermode = mode;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF float ftgl_font_atlas_occupancy(ftgl_font_t font)
+{
+        return ftgl_atlas_occupancy(font->atlas);
+}
+
+FTGLDEF size_t ftgl_font_page_count(ftgl_font_t font)
+{
+        return font->atlas->size;
+}
+
+FTGLDEF GLuint ftgl_font_texture(ftgl_font_t font, GLuint page)
+{
+        if (page >= font->atlas->size) {
+                FTGL_LOG_MESSAGE("Atlas page out of range!");
+                return 0;
+        }
+        return font->atlas->pages[page].texture;
+}
+
+FTGLDEF const unsigned char *ftgl_font_pixels(ftgl_font_t font, GLuint page)
+{
+        if (page >= font->atlas->size) {
+                FTGL_LOG_MESSAGE("Atlas page out of range!");
+                return NULL;
+        }
+        return font->atlas->pages[page].pixels;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_deferred(ftgl_font_t font, int deferred)
+{
+        // Other fonts flush a shared atlas on their own schedule
+        if (font->atlas->refcount > 1) {
+                FTGL_LOG_MESSAGE("The atlas is shared, use ftgl_atlas_set_deferred!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        ftgl_atlas_set_deferred(font->atlas, deferred);
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF void ftgl_font_flush(ftgl_font_t font)
+{
+        ftgl_atlas_flush(font->atlas);
+}
+
+FTGLDEF ftgl_return_t ftgl_font_set_eviction(ftgl_font_t font, size_t max_pages)
+{
+        ftgl_return_t ret;
+
+        // A font on a shared atlas can only opt into the atlas's budget
+        if (font->atlas->refcount > 1 && max_pages != font->atlas->max_pages) {
+                FTGL_LOG_MESSAGE("The atlas is shared, set its budget with ftgl_atlas_set_max_pages!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        if ((ret = ftgl_atlas_set_max_pages(font->atlas, max_pages)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        font->eviction = max_pages > 0;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF void ftgl_font_set_evict_callback(ftgl_font_t font,
+                                          void (*callback)(ftgl_font_t, const struct ftgl_glyph_t *, void *),
+                                          void *userdata)
+{
+        font->evict_callback = callback;
+        font->evict_userdata = userdata;
+}
+
+FTGLDEF void ftgl_font_next_frame(ftgl_font_t font)
+{
+        font->generation++;
+}
+
+static ftgl_return_t ftgl_font_evict_glyph(ftgl_font_t font, ftgl_glyph_t glyph)
+{
+        ftgl_return_t ret;
+        ivec4_t rect;
+
+        if (font->evict_callback) {
+                font->evict_callback(font, glyph, font->evict_userdata);
+        }
+
+        // Glyphs that failed to rasterize never took any space
+        rect = ll_ivec4_create4i(glyph->x, glyph->y, glyph->w + FTGL_GLYPH_OFFSET,
+                                 glyph->h + FTGL_GLYPH_OFFSET);
+        if (glyph->w > 0
+            && (ret = ftgl_atlas_release(font->atlas, glyph->page, rect)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        if ((ret = ftgl_glyphmap_remove(font->glyphmap, glyph->codepoint)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        font->evictions++;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Recomputes the free space of every page from the glyphs still
+ * resident, undoing the fragmentation left behind by single releases.
+ */
+static ftgl_return_t ftgl_font_rebuild_atlas(ftgl_font_t font)
+{
+        size_t i, page, count;
+        ivec4_t *occupied;
+        ftgl_glyph_t glyph;
+        ftgl_return_t ret;
+        ftgl_glyphmap_t glyphmap;
+
+        glyphmap = font->glyphmap;
+        occupied = FTGL_MALLOC(sizeof(*occupied) * (glyphmap->size + 1));
+        if (!occupied) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        ret = FTGL_NO_ERROR;
+        for (page = 0; page < font->atlas->size && ret == FTGL_NO_ERROR; page++) {
+                count = 0;
+                for (i = 0; i < glyphmap->top; i++) {
+                        glyph = ftgl_glyphmap_glyph(glyphmap, i);
+                        if (glyph->codepoint == FTGL_FONT_GLYPHMAP_EMPTY) continue;
+                        if (glyph->page != page || glyph->w == 0) continue;
+                        occupied[count++] = ll_ivec4_create4i(glyph->x, glyph->y,
+                                                              glyph->w + FTGL_GLYPH_OFFSET,
+                                                              glyph->h + FTGL_GLYPH_OFFSET);
+                }
+                ret = ftgl_atlas_rebuild(font->atlas, page, occupied, count);
+        }
+
+        FTGL_FREE(occupied);
+        return ret;
+}
+
+/**
+ * Evicts every glyph whose last use is the oldest among the resident
+ * glyphs. Glyphs used during the current frame are never evicted, so
+ * FTGL_ATLAS_FULL_ERROR is returned when nothing older remains.
+ * Placeholders are left alone until their bitmap arrives.
+ */
+static ftgl_return_t ftgl_font_evict_oldest(ftgl_font_t font)
+{
+        size_t i;
+        uint32_t age, oldest;
+        ftgl_glyph_t glyph;
+        ftgl_return_t ret;
+        ftgl_glyphmap_t glyphmap;
+
+        glyphmap = font->glyphmap;
+        oldest = 0;
+        for (i = 0; i < glyphmap->top; i++) {
+                glyph = ftgl_glyphmap_glyph(glyphmap, i);
+                if (glyph->codepoint == FTGL_FONT_GLYPHMAP_EMPTY) continue;
+                if (glyph->flags & FTGL_GLYPH_PENDING) continue;
+                age = font->generation - glyph->generation;
+                if (age > oldest) {
+                        oldest = age;
+                }
+        }
+
+        if (oldest == 0) {
+                return FTGL_ATLAS_FULL_ERROR;
+        }
+
+        for (i = 0; i < glyphmap->top; i++) {
+                glyph = ftgl_glyphmap_glyph(glyphmap, i);
+                if (glyph->codepoint == FTGL_FONT_GLYPHMAP_EMPTY) continue;
+                if (glyph->flags & FTGL_GLYPH_PENDING) continue;
+                if (font->generation - glyph->generation != oldest) continue;
+                if ((ret = ftgl_font_evict_glyph(font, glyph)) != FTGL_NO_ERROR) {
+                        return ret;
+                }
+        }
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF void ftgl_computegradient(double *img, int w, int h, double *gx, double *gy)
+{
+        int i, j, k;
+        double glength;
+#define SQRT2 1.4142136
+        // Avoid edges where the kernels would spill over
+        for (i = 1; i < h - 1; i++) {
+                for (j = 1; j < w - 1; j++) {
+                        k = i*w + j;
+                        // Compute gradient for edge pixels only
+                        if ((img[k] > 0.0) && (img[k] < 1.0)) {
+                                gx[k] = -img[k-w-1] - SQRT2*img[k-1] - img[k+w-1] + img[k-w+1]
+                                        + SQRT2*img[k+1] + img[k+w+1];
+                                gy[k] = -img[k-w-1] - SQRT2*img[k-w] - img[k-w+1] + img[k+w-1]
+                                        + SQRT2*img[k+w] + img[k+w+1];
+                                glength = gx[k]*gx[k] + gy[k]*gy[k];
+                                // Avoid division by zero
+                                if (glength > 0.0) {
+                                        glength = sqrt(glength);
+                                        gx[k] = gx[k] / glength;
+                                        gy[k] = gy[k] / glength;
+                                }
+                        }
+                }
+        }
+#undef SQRT2
+}
+
+FTGLDEF double ftgl_edgedf(double gx, double gy, double a)
+{
+        double df, glength, temp, a1;
+
+        // Either
+        // A) gu or gv are zero, or
+        // B) both
+        if ((gx == 0) || (gy == 0)) {
+                df = 0.5-a;
+        } else {
+                glength = sqrt(gx*gx + gy*gy);
+                if (glength > 0) {
+                        gx = gx/glength;
+                        gy = gy/glength;
+                }
+
+                /* Everything is symmetric wrt sign and transposition
+                 * so move to first octant (gx >= 0, gy >= 0, gx >= gy) to
+                 * avoid handling all possible edge cases
+                 */
+                gx = fabs(gx);
+                gy = fabs(gy);
+                if (gx < gy) {
+                        temp = gx;
+                        gx = gy;
+                        gy = temp;
+                }
+
+                a1 = 0.5*gy/gx;
+                // 0 <= a < a1
+                if (a < a1) {
+                        df = 0.5*(gx + gy) - sqrt(2.0 * gx * gy * a);
+                } else if (a < (1.0-a1)) {
+                        // a1 <= a <= 1 - a1
+                        df = (0.5-a) * gx;
+                } else {
+                        // 1-a1 < a <= 1
+                        df = -0.5 * (gx + gy) + sqrt(2.0 * gx * gy * (1.0-a));
+                }
+        }
+
+        return df;
+}
+
+FTGLDEF double ftgl_distaa3(double *img, double *gximg, double *gyimg, int w,
+             int c, int xc, int yc, int xi, int yi)
+{
+        double di, df, dx, dy, gx, gy, a;
+        int closest;
+
+        // Index to the edge pixel pointed to from c
+        closest = c-xc-yc*w;
+
+        // Grayscale value at the edge pixel
+        a = img[closest];
+
+        // X gradient component at the edge pixel
+        gx = gximg[closest];
+
+        // Y gradient component at the edge pixel
+        gy = gyimg[closest];
+
+        if (a > 1.0) a = 1.0;
+
+        // Clip grayscale values outside the range [0, 1]
+        if (a < 0.0) a = 0.0;
+
+        // Not an object pixel, return "very far" ("don't know yet")
+        if (a == 0.0) return 1000000.0;
+
+        dx = (double) xi;
+        dy = (double) yi;
+
+        // Length of integer vector, like a traditional EDT
+        di = sqrt(dx*dx + dy*dy);
+        if (di == 0) {
+                //Use local gradient only at edges
+                // Estimate based on local gradient only
+                df = ftgl_edgedf(gx, gy, a);
+        } else {
+                // Estimate gradient based on direction to edge (accurate for large di)
+                df = ftgl_edgedf(dx, dy, a);
+        }
+
+        // Same metric as ftgl_edtaa3, except at edges (where di = 0)
+        return di + df;
+}
+
+// Shorthand macro: add ubiquitous parameters dist, gx, gy, img and w and call distaa3()
+#define DISTAA(c,xc,yc,xi,yi) (ftgl_distaa3(img, gx, gy, w, c, xc, yc, xi, yi))
+
+FTGLDEF void ftgl_edtaa3(double *img, double *gx, double *gy, int w, int h,
+            short *distx, short *disty, double *dist)
+{
+        int x, y, i, c;
+        int offset_u, offset_ur, offset_r, offset_rd,
+                offset_d, offset_dl, offset_l, offset_lu;
+        double olddist, newdist;
+        int cdistx, cdisty, newdistx, newdisty;
+        int changed;
+        double epsilon = 1e-3;
+
+        /* Initialize index offsets for the current image width */
+        offset_u = -w;
+        offset_ur = -w+1;
+        offset_r = 1;
+        offset_rd = w+1;
+        offset_d = w;
+        offset_dl = w-1;
+        offset_l = -1;
+        offset_lu = -w-1;
+
+        /* Initialize the distance images */
+        for(i=0; i<w*h; i++) {
+                // At first, all pixels point to
+                // themselves as the closest known.
+                distx[i] = 0;
+                disty[i] = 0;
+                if(img[i] <= 0.0) {
+                        // Big value, means "not set yet"
+                        dist[i]= 1000000.0;
+                } else if (img[i]<1.0) {
+                        // Gradient-assisted estimate
+                        dist[i] = ftgl_edgedf(gx[i], gy[i], img[i]);
+                } else {
+                        dist[i]= 0.0; // Inside the object
+                }
+        }
+
+        /* Perform the transformation */
+        do {
+                changed = 0;
+
+                /* Scan rows, except first row */
+                for(y=1; y<h; y++) {
+
+                        /* move index to leftmost pixel of current row */
+                        i = y*w;
+
+                        /* scan right, propagate distances from above & left */
+
+                        /* Leftmost pixel is special, has no left neighbors */
+                        olddist = dist[i];
+
+                        // If non-zero distance or not set yet
+                        if(olddist > 0)  {
+                                c = i + offset_u; // Index of candidate for testing
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty+1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_ur;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                        i++;
+
+                        /* Middle pixels have all neighbors */
+                        for(x=1; x<w-1; x++, i++) {
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // No need to update further
+
+                                c = i+offset_l;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_lu;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_u;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty+1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_ur;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+
+                        /* Rightmost pixel of row is special, has no right neighbors */
+                        olddist = dist[i];
+
+                        // If not already zero distance
+                        if(olddist > 0) {
+                                c = i+offset_l;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_lu;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_u;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty+1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+
+                        /* Move index to second rightmost pixel of current row. */
+                        /* Rightmost pixel is skipped, it has no right neighbor. */
+                        i = y*w + w-2;
+
+                        /* scan left, propagate distance from right */
+                        for(x=w-2; x>=0; x--, i--) {
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // Already zero distance
+
+                                c = i+offset_r;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                }
+
+                /* Scan rows in reverse order, except last row */
+                for(y=h-2; y>=0; y--) {
+                        /* move index to rightmost pixel of current row */
+                        i = y*w + w-1;
+
+                        /* Scan left, propagate distances from below & right */
+
+                        /* Rightmost pixel is special, has no right neighbors */
+                        olddist = dist[i];
+
+                        // If not already zero distance
+                        if(olddist > 0) {
+                                c = i+offset_d;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty-1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_dl;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                        i--;
+
+                        /* Middle pixels have all neighbors */
+                        for(x=w-2; x>0; x--, i--) {
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // Already zero distance
+
+                                c = i+offset_r;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_rd;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_d;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty-1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_dl;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                        /* Leftmost pixel is special, has no left neighbors */
+                        olddist = dist[i];
+
+                        // If not already zero distance
+                        if(olddist > 0) {
+                                c = i+offset_r;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_rd;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_d;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty-1;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+
+                        /* Move index to second leftmost pixel of current row. */
+                        /* Leftmost pixel is skipped, it has no left neighbor. */
+                        i = y*w + 1;
+                        for(x=1; x<w; x++, i++) {
+                                /* scan right, propagate distance from left */
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // Already zero distance
+
+                                c = i+offset_l;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty;
+                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                }
+        }
+        while(changed); // Sweep until no more updates are made
+
+        /* The transformation is completed. */
+}
+
+FTGLDEF double * ftgl_distance_mapd(double *data, unsigned int width,
+                   unsigned int height)
+{
+        short *xdist = FTGL_MALLOC(width * height * sizeof(*xdist));
+        short *ydist = FTGL_MALLOC(width * height * sizeof(*ydist));
+        double *gx = FTGL_MALLOC(width * height * sizeof(*gx));
+        double *gy = FTGL_MALLOC(width * height * sizeof(*gy));
+        double *outside = FTGL_MALLOC(width * height * sizeof(*outside));
+        double *inside = FTGL_MALLOC(width * height * sizeof(*inside));
+        double vmin = DBL_MAX;
+        unsigned int i;
+
+        // Compute outside = edtaa3(bitmap); % Transform background (0's)
+        ftgl_computegradient(data, width, height, gx, gy);
+        ftgl_edtaa3(data, gx, gy, width, height, xdist, ydist, outside);
+        for (i = 0; i < width * height; i++) {
+                if (outside[i] < 0.0) outside[i] = 0.0;
+        }
+
+        // Compute inside = ftgl_edtaa3(1 - bitmap); % Transform background (1's)
+        memset(gx, 0, sizeof(*gx)*width*height);
+        memset(gy, 0, sizeof(*gy)*width*height);
+        for (i = 0; i < width * height; i++) {
+                data[i] = 1 - data[i];
+        }
+
+        ftgl_computegradient(data, width, height, gx, gy);
+        ftgl_edtaa3(data, gx, gy, width, height, xdist, ydist, inside);
+        for (i = 0; i < width * height; i++) {
+                if (inside[i] < 0.0) {
+                        inside[i] =  0.0;
+                }
+        }
+
+        // distmap = outside - inside % Bipolar distance field
+        for (i = 0; i < width * height; i++) {
+                outside[i] -= inside[i];
+                if (outside[i] < vmin) {
+                        vmin = outside[i];
+                }
+        }
+
+        vmin = fabs(vmin);
+
+        for (i = 0; i < width * height; i++) {
+                double v = outside[i];
+                if (v < -vmin) outside[i] = -vmin;
+                else if (v > +vmin) outside[i] = +vmin;
+                data[i] = (outside[i] + vmin) / (2 * vmin);
+        }
+
+        FTGL_FREE(xdist);
+        FTGL_FREE(ydist);
+        FTGL_FREE(gx);
+        FTGL_FREE(gy);
+        FTGL_FREE(outside);
+        FTGL_FREE(inside);
+        return data;
+}
+
+FTGLDEF unsigned char *ftgl_distance_mapb(unsigned char *img, unsigned int width,
+                   unsigned int height)
+{
+        double *data = FTGL_CALLOC(width * height, sizeof(*data));
+        unsigned char *out = FTGL_MALLOC(width * height * sizeof(*out));
+        unsigned int i;
+
+        // find minimum and maximum values
+        double img_min = DBL_MAX;
+        double img_max = DBL_MIN;
+
+        for (i = 0; i < width * height; i++) {
+                double v = img[i];
+                data[i] = v;
+                if (v > img_max) img_max = v;
+                if (v < img_min) img_min = v;
+        }
+
+        // Map values from 0 - 255 to 0.0 - 1.0
+        for (i = 0; i < width * height; i++)
+                data[i] = (img[i]-img_min)/img_max;
+
+        data = ftgl_distance_mapd(data, width, height);
+
+        for (i = 0; i < width * height; i++)
+                out[i] = (unsigned char)(255 * (1  - data[i]));
+
+        FTGL_FREE(data);
+        return out;
+}
+
+FTGLDEF void ftgl_computegradientf(float *img, int w, int h, float *gx, float *gy)
+{
+        int i, j, k;
+        float glength;
+#define SQRT2 1.4142136f
+        // Avoid edges where the kernels would spill over
+        for (i = 1; i < h - 1; i++) {
+                for (j = 1; j < w - 1; j++) {
+                        k = i*w + j;
+                        // Compute gradient for edge pixels only
+                        if ((img[k] > 0.0f) && (img[k] < 1.0f)) {
+                                gx[k] = -img[k-w-1] - SQRT2*img[k-1] - img[k+w-1] + img[k-w+1]
+                                        + SQRT2*img[k+1] + img[k+w+1];
+                                gy[k] = -img[k-w-1] - SQRT2*img[k-w] - img[k-w+1] + img[k+w-1]
+                                        + SQRT2*img[k+w] + img[k+w+1];
+                                glength = gx[k]*gx[k] + gy[k]*gy[k];
+                                // Avoid division by zero
+                                if (glength > 0.0f) {
+                                        glength = sqrtf(glength);
+                                        gx[k] = gx[k] / glength;
+                                        gy[k] = gy[k] / glength;
+                                }
+                        }
+                }
+        }
+#undef SQRT2
+}
+
+/**
+ * ftgl_edgedff for a gradient that is already of unit length, which
+ * saves the square root when the caller knows the length anyway.
+ */
+static inline float ftgl_edgedf_unitf(float gx, float gy, float a)
+{
+        float df, temp, a1;
+
+        // Either
+        // A) gu or gv are zero, or
+        // B) both
+        if ((gx == 0) || (gy == 0)) {
+                df = 0.5f-a;
+        } else {
+                /* Everything is symmetric wrt sign and transposition
+                 * so move to first octant (gx >= 0, gy >= 0, gx >= gy) to
+                 * avoid handling all possible edge cases
+                 */
+                gx = fabsf(gx);
+                gy = fabsf(gy);
+                if (gx < gy) {
+                        temp = gx;
+                        gx = gy;
+                        gy = temp;
+                }
+
+                a1 = 0.5f*gy/gx;
+                // 0 <= a < a1
+                if (a < a1) {
+                        df = 0.5f*(gx + gy) - sqrtf(2.0f * gx * gy * a);
+                } else if (a < (1.0f-a1)) {
+                        // a1 <= a <= 1 - a1
+                        df = (0.5f-a) * gx;
+                } else {
+                        // 1-a1 < a <= 1
+                        df = -0.5f * (gx + gy) + sqrtf(2.0f * gx * gy * (1.0f-a));
+                }
+        }
+
+        return df;
+}
+
+FTGLDEF float ftgl_edgedff(float gx, float gy, float a)
+{
+        float glength;
+
+        if ((gx == 0) || (gy == 0)) {
+                return 0.5f-a;
+        }
+
+        glength = sqrtf(gx*gx + gy*gy);
+        return ftgl_edgedf_unitf(gx/glength, gy/glength, a);
+}
+
+FTGLDEF float ftgl_distaa3f(float *img, float *gximg, float *gyimg, int w,
+             int c, int xc, int yc, int xi, int yi)
+{
+        float di, df, dx, dy, gx, gy, a;
+        int closest;
+
+        // Index to the edge pixel pointed to from c
+        closest = c-xc-yc*w;
+
+        // Grayscale value at the edge pixel
+        a = img[closest];
+
+        // X gradient component at the edge pixel
+        gx = gximg[closest];
+
+        // Y gradient component at the edge pixel
+        gy = gyimg[closest];
+
+        if (a > 1.0f) a = 1.0f;
+
+        // Clip grayscale values outside the range [0, 1]
+        if (a < 0.0f) a = 0.0f;
+
+        // Not an object pixel, return "very far" ("don't know yet")
+        if (a == 0.0f) return 1000000.0f;
+
+        dx = (float) xi;
+        dy = (float) yi;
+
+        // Length of integer vector, like a traditional EDT
+        di = sqrtf(dx*dx + dy*dy);
+        if (di == 0) {
+                //Use local gradient only at edges
+                // Estimate based on local gradient only
+                df = ftgl_edgedff(gx, gy, a);
+        } else {
+                // Estimate gradient based on direction to edge (accurate for large di)
+                df = ftgl_edgedf_unitf(dx/di, dy/di, a);
+        }
+
+        // Same metric as ftgl_edtaa3, except at edges (where di = 0)
+        return di + df;
+}
+
+// Shorthand macro: add ubiquitous parameters dist, gx, gy, img and w and call distaa3()
+#define DISTAAF(c,xc,yc,xi,yi) (ftgl_distaa3f(img, gx, gy, w, c, xc, yc, xi, yi))
+
+FTGLDEF void ftgl_edtaa3f(float *img, float *gx, float *gy, int w, int h,
+            short *distx, short *disty, float *dist)
+{
+        int x, y, i, c;
+        int offset_u, offset_ur, offset_r, offset_rd,
+                offset_d, offset_dl, offset_l, offset_lu;
+        float olddist, newdist;
+        int cdistx, cdisty, newdistx, newdisty;
+        int changed;
+        float epsilon = 1e-3f;
+
+        /* Initialize index offsets for the current image width */
+        offset_u = -w;
+        offset_ur = -w+1;
+        offset_r = 1;
+        offset_rd = w+1;
+        offset_d = w;
+        offset_dl = w-1;
+        offset_l = -1;
+        offset_lu = -w-1;
+
+        /* Initialize the distance images */
+        for(i=0; i<w*h; i++) {
+                // At first, all pixels point to
+                // themselves as the closest known.
+                distx[i] = 0;
+                disty[i] = 0;
+                if(img[i] <= 0.0f) {
+                        // Big value, means "not set yet"
+                        dist[i]= 1000000.0f;
+                } else if (img[i]<1.0f) {
+                        // Gradient-assisted estimate
+                        dist[i] = ftgl_edgedff(gx[i], gy[i], img[i]);
+                } else {
+                        dist[i]= 0.0f; // Inside the object
+                }
+        }
+
+        /* Perform the transformation */
+        do {
+                changed = 0;
+
+                /* Scan rows, except first row */
+                for(y=1; y<h; y++) {
+
+                        /* move index to leftmost pixel of current row */
+                        i = y*w;
+
+                        /* scan right, propagate distances from above & left */
+
+                        /* Leftmost pixel is special, has no left neighbors */
+                        olddist = dist[i];
 
                         // If non-zero distance or not set yet
                         if(olddist > 0)  {
@@ -975,8 +5084,289 @@ FTGLDEF void ftgl_edtaa3(double *img, double *gx, double *gy, int w, int h,
                                 cdistx = distx[c];
                                 cdisty = disty[c];
                                 newdistx = cdistx;
-                                newdisty = cdisty+1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
+                                newdisty = cdisty+1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_ur;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                        i++;
+
+                        /* Middle pixels have all neighbors */
+                        for(x=1; x<w-1; x++, i++) {
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // No need to update further
+
+                                c = i+offset_l;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_lu;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_u;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty+1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_ur;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+
+                        /* Rightmost pixel of row is special, has no right neighbors */
+                        olddist = dist[i];
+
+                        // If not already zero distance
+                        if(olddist > 0) {
+                                c = i+offset_l;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_lu;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty+1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_u;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty+1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+
+                        /* Move index to second rightmost pixel of current row. */
+                        /* Rightmost pixel is skipped, it has no right neighbor. */
+                        i = y*w + w-2;
+
+                        /* scan left, propagate distance from right */
+                        for(x=w-2; x>=0; x--, i--) {
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // Already zero distance
+
+                                c = i+offset_r;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                }
+
+                /* Scan rows in reverse order, except last row */
+                for(y=h-2; y>=0; y--) {
+                        /* move index to rightmost pixel of current row */
+                        i = y*w + w-1;
+
+                        /* Scan left, propagate distances from below & right */
+
+                        /* Rightmost pixel is special, has no right neighbors */
+                        olddist = dist[i];
+
+                        // If not already zero distance
+                        if(olddist > 0) {
+                                c = i+offset_d;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty-1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_dl;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                        i--;
+
+                        /* Middle pixels have all neighbors */
+                        for(x=w-2; x>0; x--, i--) {
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // Already zero distance
+
+                                c = i+offset_r;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_rd;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_d;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty-1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_dl;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                        /* Leftmost pixel is special, has no left neighbors */
+                        olddist = dist[i];
+
+                        // If not already zero distance
+                        if(olddist > 0) {
+                                c = i+offset_r;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        olddist=newdist;
+                                        changed = 1;
+                                }
+
+                                c = i+offset_rd;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx-1;
+                                newdisty = cdisty-1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
                                 if(newdist < olddist-epsilon) {
                                         distx[i]=newdistx;
                                         disty[i]=newdisty;
@@ -985,528 +5375,3149 @@ FTGLDEF void ftgl_edtaa3(double *img, double *gx, double *gy, int w, int h,
                                         changed = 1;
                                 }
 
-                                c = i+offset_ur;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx-1;
-                                newdisty = cdisty+1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
-                        }
-                        i++;
+                                c = i+offset_d;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx;
+                                newdisty = cdisty-1;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+
+                        /* Move index to second leftmost pixel of current row. */
+                        /* Leftmost pixel is skipped, it has no left neighbor. */
+                        i = y*w + 1;
+                        for(x=1; x<w; x++, i++) {
+                                /* scan right, propagate distance from left */
+                                olddist = dist[i];
+                                if(olddist <= 0) continue; // Already zero distance
+
+                                c = i+offset_l;
+                                cdistx = distx[c];
+                                cdisty = disty[c];
+                                newdistx = cdistx+1;
+                                newdisty = cdisty;
+                                newdist = DISTAAF(c, cdistx, cdisty, newdistx, newdisty);
+                                if(newdist < olddist-epsilon) {
+                                        distx[i]=newdistx;
+                                        disty[i]=newdisty;
+                                        dist[i]=newdist;
+                                        changed = 1;
+                                }
+                        }
+                }
+        }
+        while(changed); // Sweep until no more updates are made
+
+        /* The transformation is completed. */
+}
+
+struct ftgl_sdf_kernels_t {
+        /**
+         * Maps 8-bit coverage to [0, 1] as (value - min) / max.
+         */
+        void (*load)(const unsigned char *img, float *data, size_t n, float min, float max);
+
+        /**
+         * ftgl_computegradientf. Expects @gx and @gy to be zeroed.
+         */
+        void (*gradient)(const float *img, int w, int h, float *gx, float *gy);
+
+        /**
+         * Replaces every value with 1 - value.
+         */
+        void (*invert)(float *data, size_t n);
+
+        /**
+         * Clamps both distances at zero, stores outside - inside in
+         * @outside and returns the smallest result.
+         */
+        float (*combine)(float *outside, const float *inside, size_t n);
+
+        /**
+         * Clamps the distances to [-vmin, vmin] and maps them to bytes.
+         */
+        void (*quantize)(const float *dist, unsigned char *out, size_t n, float vmin);
+};
+
+/**
+ * Applies the gradient kernel of ftgl_computegradientf to pixel @k.
+ * Used for the columns left over by the vector kernels.
+ */
+static inline void ftgl_sdf_gradient_at(const float *img, int w, int k, float *gx, float *gy)
+{
+        float glength;
+#define SQRT2 1.4142136f
+        if ((img[k] > 0.0f) && (img[k] < 1.0f)) {
+                gx[k] = -img[k-w-1] - SQRT2*img[k-1] - img[k+w-1] + img[k-w+1]
+                        + SQRT2*img[k+1] + img[k+w+1];
+                gy[k] = -img[k-w-1] - SQRT2*img[k-w] - img[k-w+1] + img[k+w-1]
+                        + SQRT2*img[k+w] + img[k+w+1];
+                glength = gx[k]*gx[k] + gy[k]*gy[k];
+                if (glength > 0.0f) {
+                        glength = sqrtf(glength);
+                        gx[k] = gx[k] / glength;
+                        gy[k] = gy[k] / glength;
+                }
+        }
+#undef SQRT2
+}
+
+static void ftgl_sdf_load_scalar(const unsigned char *img, float *data, size_t n,
+                                 float min, float max)
+{
+        size_t i;
+        for (i = 0; i < n; i++) {
+                data[i] = (img[i] - min) / max;
+        }
+}
+
+static void ftgl_sdf_gradient_scalar(const float *img, int w, int h, float *gx, float *gy)
+{
+        ftgl_computegradientf((float *) img, w, h, gx, gy);
+}
+
+static void ftgl_sdf_invert_scalar(float *data, size_t n)
+{
+        size_t i;
+        for (i = 0; i < n; i++) {
+                data[i] = 1.0f - data[i];
+        }
+}
+
+static float ftgl_sdf_combine_scalar(float *outside, const float *inside, size_t n)
+{
+        size_t i;
+        float vmin, in;
+
+        vmin = FLT_MAX;
+        for (i = 0; i < n; i++) {
+                if (outside[i] < 0.0f) outside[i] = 0.0f;
+                in = inside[i] < 0.0f ? 0.0f : inside[i];
+                outside[i] -= in;
+                if (outside[i] < vmin) {
+                        vmin = outside[i];
+                }
+        }
+        return vmin;
+}
+
+static void ftgl_sdf_quantize_scalar(const float *dist, unsigned char *out, size_t n, float vmin)
+{
+        size_t i;
+        float v;
+        for (i = 0; i < n; i++) {
+                v = dist[i];
+                if (v < -vmin) v = -vmin;
+                else if (v > +vmin) v = +vmin;
+                out[i] = (unsigned char)(255.0f * (1.0f - (v + vmin) / (2.0f * vmin)));
+        }
+}
+
+static const struct ftgl_sdf_kernels_t ftgl_sdf_kernels_scalar = {
+        ftgl_sdf_load_scalar,
+        ftgl_sdf_gradient_scalar,
+        ftgl_sdf_invert_scalar,
+        ftgl_sdf_combine_scalar,
+        ftgl_sdf_quantize_scalar,
+};
+
+#ifdef FTGL_SIMD_X86
+__attribute__((target("sse2")))
+static void ftgl_sdf_load_sse2(const unsigned char *img, float *data, size_t n,
+                               float min, float max)
+{
+        size_t i;
+        __m128i zero, bytes, words;
+        __m128 vmin, vmax;
+
+        zero = _mm_setzero_si128();
+        vmin = _mm_set1_ps(min);
+        vmax = _mm_set1_ps(max);
+        for (i = 0; i + 8 <= n; i += 8) {
+                bytes = _mm_loadl_epi64((const __m128i *) (img + i));
+                words = _mm_unpacklo_epi8(bytes, zero);
+                _mm_storeu_ps(data + i, _mm_div_ps(_mm_sub_ps(_mm_cvtepi32_ps(
+                        _mm_unpacklo_epi16(words, zero)), vmin), vmax));
+                _mm_storeu_ps(data + i + 4, _mm_div_ps(_mm_sub_ps(_mm_cvtepi32_ps(
+                        _mm_unpackhi_epi16(words, zero)), vmin), vmax));
+        }
+        ftgl_sdf_load_scalar(img + i, data + i, n - i, min, max);
+}
+
+__attribute__((target("sse2")))
+static void ftgl_sdf_gradient_sse2(const float *img, int w, int h, float *gx, float *gy)
+{
+        int i, j, k;
+        __m128 sqrt2, zero, one, c, ul, u, ur, l, r, dl, d, dr, x, y, len, mask;
+
+        sqrt2 = _mm_set1_ps(1.4142136f);
+        zero = _mm_setzero_ps();
+        one = _mm_set1_ps(1.0f);
+        for (i = 1; i < h - 1; i++) {
+                for (j = 1; j + 4 <= w - 1; j += 4) {
+                        k = i*w + j;
+                        c = _mm_loadu_ps(img + k);
+                        mask = _mm_and_ps(_mm_cmpgt_ps(c, zero), _mm_cmplt_ps(c, one));
+                        if (!_mm_movemask_ps(mask)) continue;
+
+                        ul = _mm_loadu_ps(img + k-w-1);
+                        u = _mm_loadu_ps(img + k-w);
+                        ur = _mm_loadu_ps(img + k-w+1);
+                        l = _mm_loadu_ps(img + k-1);
+                        r = _mm_loadu_ps(img + k+1);
+                        dl = _mm_loadu_ps(img + k+w-1);
+                        d = _mm_loadu_ps(img + k+w);
+                        dr = _mm_loadu_ps(img + k+w+1);
+
+                        // Same order of operations as the scalar kernel
+                        x = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(zero, ul), _mm_mul_ps(sqrt2, l)), dl);
+                        x = _mm_add_ps(_mm_add_ps(_mm_add_ps(x, ur), _mm_mul_ps(sqrt2, r)), dr);
+                        y = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(zero, ul), _mm_mul_ps(sqrt2, u)), ur);
+                        y = _mm_add_ps(_mm_add_ps(_mm_add_ps(y, dl), _mm_mul_ps(sqrt2, d)), dr);
+
+                        // Zero length gradients are left as they are
+                        len = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+                        len = _mm_sqrt_ps(len);
+                        len = _mm_or_ps(_mm_and_ps(_mm_cmpgt_ps(len, zero), len),
+                                        _mm_andnot_ps(_mm_cmpgt_ps(len, zero), one));
+
+                        _mm_storeu_ps(gx + k, _mm_and_ps(mask, _mm_div_ps(x, len)));
+                        _mm_storeu_ps(gy + k, _mm_and_ps(mask, _mm_div_ps(y, len)));
+                }
+                for (; j < w - 1; j++) {
+                        ftgl_sdf_gradient_at(img, w, i*w + j, gx, gy);
+                }
+        }
+}
+
+__attribute__((target("sse2")))
+static void ftgl_sdf_invert_sse2(float *data, size_t n)
+{
+        size_t i;
+        __m128 one;
+
+        one = _mm_set1_ps(1.0f);
+        for (i = 0; i + 4 <= n; i += 4) {
+                _mm_storeu_ps(data + i, _mm_sub_ps(one, _mm_loadu_ps(data + i)));
+        }
+        ftgl_sdf_invert_scalar(data + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static float ftgl_sdf_combine_sse2(float *outside, const float *inside, size_t n)
+{
+        size_t i;
+        float lanes[4], vmin;
+        __m128 zero, v, m;
+
+        zero = _mm_setzero_ps();
+        m = _mm_set1_ps(FLT_MAX);
+        for (i = 0; i + 4 <= n; i += 4) {
+                v = _mm_sub_ps(_mm_max_ps(_mm_loadu_ps(outside + i), zero),
+                               _mm_max_ps(_mm_loadu_ps(inside + i), zero));
+                _mm_storeu_ps(outside + i, v);
+                m = _mm_min_ps(m, v);
+        }
+
+        _mm_storeu_ps(lanes, m);
+        vmin = ftgl_sdf_combine_scalar(outside + i, inside + i, n - i);
+        for (i = 0; i < 4; i++) {
+                if (lanes[i] < vmin) vmin = lanes[i];
+        }
+        return vmin;
+}
+
+__attribute__((target("sse2")))
+static void ftgl_sdf_quantize_sse2(const float *dist, unsigned char *out, size_t n, float vmin)
+{
+        size_t i;
+        __m128 lo, hi, span, one, scale;
+        __m128i a, b, words;
+
+        lo = _mm_set1_ps(-vmin);
+        hi = _mm_set1_ps(vmin);
+        span = _mm_set1_ps(2.0f * vmin);
+        one = _mm_set1_ps(1.0f);
+        scale = _mm_set1_ps(255.0f);
+#define FTGL_QUANTIZE(p)                                                        \
+        _mm_cvttps_epi32(_mm_mul_ps(scale, _mm_sub_ps(one, _mm_div_ps(          \
+                _mm_add_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), lo), hi), hi), span))))
+        for (i = 0; i + 8 <= n; i += 8) {
+                a = FTGL_QUANTIZE(dist + i);
+                b = FTGL_QUANTIZE(dist + i + 4);
+                words = _mm_packs_epi32(a, b);
+                _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(words, words));
+        }
+#undef FTGL_QUANTIZE
+        ftgl_sdf_quantize_scalar(dist + i, out + i, n - i, vmin);
+}
+
+static const struct ftgl_sdf_kernels_t ftgl_sdf_kernels_sse2 = {
+        ftgl_sdf_load_sse2,
+        ftgl_sdf_gradient_sse2,
+        ftgl_sdf_invert_sse2,
+        ftgl_sdf_combine_sse2,
+        ftgl_sdf_quantize_sse2,
+};
+
+__attribute__((target("avx2")))
+static void ftgl_sdf_load_avx2(const unsigned char *img, float *data, size_t n,
+                               float min, float max)
+{
+        size_t i;
+        __m256 vmin, vmax;
+
+        vmin = _mm256_set1_ps(min);
+        vmax = _mm256_set1_ps(max);
+        for (i = 0; i + 8 <= n; i += 8) {
+                _mm256_storeu_ps(data + i, _mm256_div_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(
+                        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (img + i)))),
+                        vmin), vmax));
+        }
+        ftgl_sdf_load_scalar(img + i, data + i, n - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static void ftgl_sdf_gradient_avx2(const float *img, int w, int h, float *gx, float *gy)
+{
+        int i, j, k;
+        __m256 sqrt2, zero, one, c, ul, u, ur, l, r, dl, d, dr, x, y, len, mask, nonzero;
+
+        sqrt2 = _mm256_set1_ps(1.4142136f);
+        zero = _mm256_setzero_ps();
+        one = _mm256_set1_ps(1.0f);
+        for (i = 1; i < h - 1; i++) {
+                for (j = 1; j + 8 <= w - 1; j += 8) {
+                        k = i*w + j;
+                        c = _mm256_loadu_ps(img + k);
+                        mask = _mm256_and_ps(_mm256_cmp_ps(c, zero, _CMP_GT_OQ),
+                                             _mm256_cmp_ps(c, one, _CMP_LT_OQ));
+                        if (!_mm256_movemask_ps(mask)) continue;
+
+                        ul = _mm256_loadu_ps(img + k-w-1);
+                        u = _mm256_loadu_ps(img + k-w);
+                        ur = _mm256_loadu_ps(img + k-w+1);
+                        l = _mm256_loadu_ps(img + k-1);
+                        r = _mm256_loadu_ps(img + k+1);
+                        dl = _mm256_loadu_ps(img + k+w-1);
+                        d = _mm256_loadu_ps(img + k+w);
+                        dr = _mm256_loadu_ps(img + k+w+1);
+
+                        x = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(zero, ul),
+                                                        _mm256_mul_ps(sqrt2, l)), dl);
+                        x = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(x, ur),
+                                                        _mm256_mul_ps(sqrt2, r)), dr);
+                        y = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(zero, ul),
+                                                        _mm256_mul_ps(sqrt2, u)), ur);
+                        y = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(y, dl),
+                                                        _mm256_mul_ps(sqrt2, d)), dr);
+
+                        len = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+                        len = _mm256_sqrt_ps(len);
+                        nonzero = _mm256_cmp_ps(len, zero, _CMP_GT_OQ);
+                        len = _mm256_blendv_ps(one, len, nonzero);
+
+                        _mm256_storeu_ps(gx + k, _mm256_and_ps(mask, _mm256_div_ps(x, len)));
+                        _mm256_storeu_ps(gy + k, _mm256_and_ps(mask, _mm256_div_ps(y, len)));
+                }
+                for (; j < w - 1; j++) {
+                        ftgl_sdf_gradient_at(img, w, i*w + j, gx, gy);
+                }
+        }
+}
+
+__attribute__((target("avx2")))
+static void ftgl_sdf_invert_avx2(float *data, size_t n)
+{
+        size_t i;
+        __m256 one;
+
+        one = _mm256_set1_ps(1.0f);
+        for (i = 0; i + 8 <= n; i += 8) {
+                _mm256_storeu_ps(data + i, _mm256_sub_ps(one, _mm256_loadu_ps(data + i)));
+        }
+        ftgl_sdf_invert_scalar(data + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static float ftgl_sdf_combine_avx2(float *outside, const float *inside, size_t n)
+{
+        size_t i;
+        float lanes[8], vmin;
+        __m256 zero, v, m;
+
+        zero = _mm256_setzero_ps();
+        m = _mm256_set1_ps(FLT_MAX);
+        for (i = 0; i + 8 <= n; i += 8) {
+                v = _mm256_sub_ps(_mm256_max_ps(_mm256_loadu_ps(outside + i), zero),
+                                  _mm256_max_ps(_mm256_loadu_ps(inside + i), zero));
+                _mm256_storeu_ps(outside + i, v);
+                m = _mm256_min_ps(m, v);
+        }
+
+        _mm256_storeu_ps(lanes, m);
+        vmin = ftgl_sdf_combine_scalar(outside + i, inside + i, n - i);
+        for (i = 0; i < 8; i++) {
+                if (lanes[i] < vmin) vmin = lanes[i];
+        }
+        return vmin;
+}
+
+__attribute__((target("avx2")))
+static void ftgl_sdf_quantize_avx2(const float *dist, unsigned char *out, size_t n, float vmin)
+{
+        size_t i;
+        __m256 lo, hi, span, one, scale;
+        __m256i a, b, words, bytes;
+
+        lo = _mm256_set1_ps(-vmin);
+        hi = _mm256_set1_ps(vmin);
+        span = _mm256_set1_ps(2.0f * vmin);
+        one = _mm256_set1_ps(1.0f);
+        scale = _mm256_set1_ps(255.0f);
+#define FTGL_QUANTIZE(p)                                                        \
+        _mm256_cvttps_epi32(_mm256_mul_ps(scale, _mm256_sub_ps(one, _mm256_div_ps( \
+                _mm256_add_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(p), lo), hi), hi), \
+                span))))
+        for (i = 0; i + 16 <= n; i += 16) {
+                a = FTGL_QUANTIZE(dist + i);
+                b = FTGL_QUANTIZE(dist + i + 8);
+                // Packing works per 128-bit lane, so restore the order after
+                words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+                bytes = _mm256_packus_epi16(words, words);
+                bytes = _mm256_permute4x64_epi64(bytes, 0xd8);
+                _mm_storeu_si128((__m128i *) (out + i), _mm256_castsi256_si128(bytes));
+        }
+#undef FTGL_QUANTIZE
+        ftgl_sdf_quantize_scalar(dist + i, out + i, n - i, vmin);
+}
+
+static const struct ftgl_sdf_kernels_t ftgl_sdf_kernels_avx2 = {
+        ftgl_sdf_load_avx2,
+        ftgl_sdf_gradient_avx2,
+        ftgl_sdf_invert_avx2,
+        ftgl_sdf_combine_avx2,
+        ftgl_sdf_quantize_avx2,
+};
+#endif /* FTGL_SIMD_X86 */
+
+/**
+ * Picks the widest kernels the CPU supports. Other architectures
+ * (e.g. a NEON table on ARM) plug in here.
+ */
+static const struct ftgl_sdf_kernels_t *ftgl_sdf_select_kernels(void)
+{
+#ifdef FTGL_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                return &ftgl_sdf_kernels_avx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+                return &ftgl_sdf_kernels_sse2;
+        }
+#endif /* FTGL_SIMD_X86 */
+        return &ftgl_sdf_kernels_scalar;
+}
+
+FTGLDEF ftgl_sdf_t ftgl_sdf_create(void)
+{
+        ftgl_sdf_t sdf;
+
+        sdf = FTGL_CALLOC(1, sizeof(*sdf));
+        if (!sdf) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        sdf->kernels = ftgl_sdf_select_kernels();
+        return sdf;
+}
+
+FTGLDEF void ftgl_sdf_set_simd(ftgl_sdf_t sdf, int enabled)
+{
+        sdf->kernels = enabled ? ftgl_sdf_select_kernels() : &ftgl_sdf_kernels_scalar;
+}
+
+/**
+ * Makes room for @pixels in every image buffer and @span + 1 in every
+ * scanline buffer. All of them share a single allocation, whose
+ * contents are not preserved.
+ */
+static ftgl_return_t ftgl_sdf_reserve(ftgl_sdf_t sdf, size_t pixels, size_t span)
+{
+        unsigned char *memory;
+
+        if (pixels <= sdf->capacity && span <= sdf->span) {
+                return FTGL_NO_ERROR;
+        }
+
+        if (pixels < sdf->capacity) pixels = sdf->capacity;
+        if (span < sdf->span) span = sdf->span;
+
+        // Four byte types first, so the shorts and bytes at the end stay aligned
+        memory = FTGL_MALLOC(pixels * (5 * sizeof(float) + 2 * sizeof(short) + 1)
+                             + (span + 1) * (3 * sizeof(float) + 2 * sizeof(int)));
+        if (!memory) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        FTGL_FREE(sdf->data);
+        sdf->data = (float *) memory;
+        sdf->gx = sdf->data + pixels;
+        sdf->gy = sdf->gx + pixels;
+        sdf->outside = sdf->gy + pixels;
+        sdf->inside = sdf->outside + pixels;
+        sdf->line = sdf->inside + pixels;
+        sdf->parabola = sdf->line + span + 1;
+        sdf->bounds = sdf->parabola + span + 1;
+        sdf->vertices = (int *) (sdf->bounds + span + 1);
+        sdf->nearest = sdf->vertices + span + 1;
+        sdf->distx = (short *) (sdf->nearest + span + 1);
+        sdf->disty = sdf->distx + pixels;
+        sdf->coverage = (unsigned char *) (sdf->disty + pixels);
+        sdf->capacity = pixels;
+        sdf->span = span;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * ftgl_distance_mapb in single precision, writing the field to @out,
+ * which may be @img. Every working buffer comes from @sdf, so once it
+ * has grown to the glyph size nothing is allocated. This is the whole
+ * gain: the time goes into the ftgl_edtaa3f sweeps, which take as long
+ * in floats as in doubles, so expect the speed of ftgl_distance_mapb.
+ */
+FTGLDEF ftgl_return_t ftgl_distance_mapf(ftgl_sdf_t sdf, const unsigned char *img,
+                                         unsigned char *out, unsigned int width,
+                                         unsigned int height)
+{
+        unsigned int i, n;
+        float img_min, img_max, vmin, v;
+        ftgl_return_t ret;
+
+        n = width * height;
+        if ((ret = ftgl_sdf_reserve(sdf, n, 0)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        // Map values from 0 - 255 to 0.0 - 1.0, like ftgl_distance_mapb
+        img_min = FLT_MAX;
+        img_max = FLT_MIN;
+        for (i = 0; i < n; i++) {
+                v = img[i];
+                if (v > img_max) img_max = v;
+                if (v < img_min) img_min = v;
+        }
+
+        sdf->kernels->load(img, sdf->data, n, img_min, img_max);
+
+        // Transform background (0's)
+        memset(sdf->gx, 0, sizeof(*sdf->gx) * n);
+        memset(sdf->gy, 0, sizeof(*sdf->gy) * n);
+        sdf->kernels->gradient(sdf->data, width, height, sdf->gx, sdf->gy);
+        ftgl_edtaa3f(sdf->data, sdf->gx, sdf->gy, width, height,
+                     sdf->distx, sdf->disty, sdf->outside);
+
+        // Transform foreground (1's)
+        memset(sdf->gx, 0, sizeof(*sdf->gx) * n);
+        memset(sdf->gy, 0, sizeof(*sdf->gy) * n);
+        sdf->kernels->invert(sdf->data, n);
+        sdf->kernels->gradient(sdf->data, width, height, sdf->gx, sdf->gy);
+        ftgl_edtaa3f(sdf->data, sdf->gx, sdf->gy, width, height,
+                     sdf->distx, sdf->disty, sdf->inside);
+
+        // Bipolar distance field, clamped symmetrically
+        vmin = fabsf(sdf->kernels->combine(sdf->outside, sdf->inside, n));
+        sdf->kernels->quantize(sdf->outside, out, n, vmin);
+        return FTGL_NO_ERROR;
+}
+
+/* Stands in for "no seed" in the squared distance grids */
+#define FTGL_EDT_INF (1e20f)
+
+/* How far below 0.5 - a ftgl_edgedf_unitf can go, (sqrt(2) - 1) / 2 */
+#define FTGL_EDT_SLACK (0.2072f)
+
+/**
+ * One dimensional squared distance transform of Felzenszwalb and
+ * Huttenlocher, run in place over @length samples of @grid spaced
+ * @stride apart. Finds the lower envelope of the parabolas rooted at
+ * every sample, then reads the envelope back, in O(@length). The
+ * sample each result came from is left in sdf->nearest.
+ */
+static void ftgl_edt_line(ftgl_sdf_t sdf, float *grid, size_t stride, int length)
+{
+        int q, k, r;
+        float s;
+        float *f, *z;
+        int *v;
+
+        f = sdf->parabola;
+        z = sdf->bounds;
+        v = sdf->vertices;
+        for (q = 0; q < length; q++) {
+                f[q] = grid[q * stride];
+        }
+
+        k = 0;
+        v[0] = 0;
+        z[0] = -FTGL_EDT_INF;
+        z[1] = +FTGL_EDT_INF;
+        for (q = 1; q < length; q++) {
+                // Pop parabolas that the new one hides entirely. The
+                // first bound is -inf, so at least one always remains.
+                r = v[k];
+                s = ((f[q] + q*q) - (f[r] + r*r)) / (2*q - 2*r);
+                while (s <= z[k]) {
+                        k--;
+                        r = v[k];
+                        s = ((f[q] + q*q) - (f[r] + r*r)) / (2*q - 2*r);
+                }
+                k++;
+                v[k] = q;
+                z[k] = s;
+                z[k+1] = +FTGL_EDT_INF;
+        }
+
+        k = 0;
+        for (q = 0; q < length; q++) {
+                while (z[k+1] < q) k++;
+                r = v[k];
+                grid[q * stride] = (q - r) * (q - r) + f[r];
+                sdf->nearest[q] = r;
+        }
+}
+
+/**
+ * Squared two dimensional transform, columns first and rows second.
+ * The closest seed of every pixel ends up in sdf->distx/disty.
+ */
+static void ftgl_edt_grid(ftgl_sdf_t sdf, float *grid, int width, int height)
+{
+        int x, y;
+        short *row;
+
+        for (x = 0; x < width; x++) {
+                ftgl_edt_line(sdf, grid + x, width, height);
+                for (y = 0; y < height; y++) {
+                        sdf->disty[y * width + x] = sdf->nearest[y];
+                }
+        }
+
+        for (y = 0; y < height; y++) {
+                ftgl_edt_line(sdf, grid + y * width, 1, width);
+
+                // The seed row comes from the column the seed was found in
+                row = sdf->disty + y * width;
+                for (x = 0; x < width; x++) {
+                        sdf->line[x] = row[x];
+                }
+                for (x = 0; x < width; x++) {
+                        sdf->distx[y * width + x] = sdf->nearest[x];
+                        row[x] = sdf->line[sdf->nearest[x]];
+                }
+        }
+}
+
+/**
+ * Squared two dimensional transform without seed tracking. The column
+ * pass transposes FTGL_EDT_BLOCK columns at a time into sdf->gx, so
+ * that every column is transformed contiguously instead of touching a
+ * new cache line per sample.
+ */
+static void ftgl_edt_grid_blocked(ftgl_sdf_t sdf, float *grid, int width, int height)
+{
+        int x, y, x0, block;
+        float *row;
+
+        for (x0 = 0; x0 < width; x0 += FTGL_EDT_BLOCK) {
+                block = width - x0 < FTGL_EDT_BLOCK ? width - x0 : FTGL_EDT_BLOCK;
+                for (y = 0; y < height; y++) {
+                        row = grid + y * width + x0;
+                        for (x = 0; x < block; x++) {
+                                sdf->gx[x * height + y] = row[x];
+                        }
+                }
+
+                for (x = 0; x < block; x++) {
+                        ftgl_edt_line(sdf, sdf->gx + x * height, 1, height);
+                }
+
+                for (y = 0; y < height; y++) {
+                        row = grid + y * width + x0;
+                        for (x = 0; x < block; x++) {
+                                row[x] = sdf->gx[x * height + y];
+                        }
+                }
+        }
+
+        for (y = 0; y < height; y++) {
+                ftgl_edt_line(sdf, grid + y * width, 1, width);
+        }
+}
+
+/**
+ * The ftgl_edtaa3f metric from pixel (@x, @y) to the edge through the
+ * covered pixel (@sx, @sy).
+ */
+static inline float ftgl_edt_seed_distance(ftgl_sdf_t sdf, int width, int x, int y,
+                                           int sx, int sy)
+{
+        int c;
+        float a, dx, dy, di;
+
+        c = sy * width + sx;
+        a = sdf->data[c] < 1.0f ? sdf->data[c] : 1.0f;
+        if (sx == x && sy == y) {
+                return a >= 1.0f ? 0.0f : ftgl_edgedff(sdf->gx[c], sdf->gy[c], a);
+        }
+
+        dx = (float) (x - sx);
+        dy = (float) (y - sy);
+        di = sqrtf(dx*dx + dy*dy);
+        return di + ftgl_edgedf_unitf(dx/di, dy/di, a);
+}
+
+/**
+ * Lets pixel @i at (@x, @y) take the seed of its neighbour @n when
+ * that seed is closer in the full metric.
+ */
+static inline void ftgl_edt_refine(ftgl_sdf_t sdf, float *dist, int width,
+                                   int x, int y, int i, int n)
+{
+        int dx, dy;
+        float a, d;
+
+        if (sdf->distx[n] == sdf->distx[i] && sdf->disty[n] == sdf->disty[i]) {
+                return;
+        }
+
+        // A seed of coverage a adds at least 0.5 - a - FTGL_EDT_SLACK,
+        // so skip seeds whose centre alone is already too far away
+        dx = x - sdf->distx[n];
+        dy = y - sdf->disty[n];
+        a = sdf->data[sdf->disty[n] * width + sdf->distx[n]];
+        d = dist[i] - 0.5f + (a < 1.0f ? a : 1.0f) + FTGL_EDT_SLACK;
+        if (d <= 0.0f || (float) (dx*dx + dy*dy) >= d*d) {
+                return;
+        }
+
+        d = ftgl_edt_seed_distance(sdf, width, x, y, sdf->distx[n], sdf->disty[n]);
+        if (d < dist[i]) {
+                dist[i] = d;
+                sdf->distx[i] = sdf->distx[n];
+                sdf->disty[i] = sdf->disty[n];
+        }
+}
+
+/**
+ * Distance from every pixel to the edge of the coverage in sdf->data,
+ * with the same metric as ftgl_edtaa3f: the distance to the closest
+ * pixel with any coverage, plus that pixel's subpixel offset to the
+ * edge. The closest pixel is found exactly in a single pass instead of
+ * by sweeping until nothing changes.
+ *
+ * The grid transform only knows pixel centres, so among seeds at
+ * (nearly) the same grid distance it may keep one whose subpixel
+ * offset puts the edge up to a pixel further away. One forward and one
+ * backward sweep over the 8-neighbourhood, as in a single ftgl_edtaa3f
+ * iteration, hands every pixel the best seed of its neighbours.
+ */
+static void ftgl_edt_field(ftgl_sdf_t sdf, int width, int height, float *dist)
+{
+        int x, y, i;
+
+        for (i = 0; i < width * height; i++) {
+                dist[i] = sdf->data[i] > 0.0f ? 0.0f : FTGL_EDT_INF;
+        }
+        ftgl_edt_grid(sdf, dist, width, height);
+
+        // Nothing to measure against, "very far" like ftgl_edtaa3f
+        if (dist[0] >= FTGL_EDT_INF) {
+                for (i = 0; i < width * height; i++) {
+                        dist[i] = 1000000.0f;
+                }
+                return;
+        }
+
+        for (y = 0, i = 0; y < height; y++) {
+                for (x = 0; x < width; x++, i++) {
+                        dist[i] = ftgl_edt_seed_distance(sdf, width, x, y,
+                                                         sdf->distx[i], sdf->disty[i]);
+                }
+        }
+
+        for (y = 0, i = 0; y < height; y++) {
+                for (x = 0; x < width; x++, i++) {
+                        if (y > 0) {
+                                if (x > 0) ftgl_edt_refine(sdf, dist, width, x, y, i, i - width - 1);
+                                ftgl_edt_refine(sdf, dist, width, x, y, i, i - width);
+                                if (x + 1 < width) ftgl_edt_refine(sdf, dist, width, x, y, i, i - width + 1);
+                        }
+                        if (x > 0) ftgl_edt_refine(sdf, dist, width, x, y, i, i - 1);
+                }
+        }
+
+        for (y = height - 1, i = width * height - 1; y >= 0; y--) {
+                for (x = width - 1; x >= 0; x--, i--) {
+                        if (y + 1 < height) {
+                                if (x + 1 < width) ftgl_edt_refine(sdf, dist, width, x, y, i, i + width + 1);
+                                ftgl_edt_refine(sdf, dist, width, x, y, i, i + width);
+                                if (x > 0) ftgl_edt_refine(sdf, dist, width, x, y, i, i + width - 1);
+                        }
+                        if (x + 1 < width) ftgl_edt_refine(sdf, dist, width, x, y, i, i + 1);
+                }
+        }
+}
+
+FTGLDEF ftgl_return_t ftgl_distance_map_edt(ftgl_sdf_t sdf, const unsigned char *img,
+                                            unsigned char *out, unsigned int width,
+                                            unsigned int height)
+{
+        unsigned int i, n;
+        float img_min, img_max, v;
+        ftgl_return_t ret;
+
+        n = width * height;
+        ret = ftgl_sdf_reserve(sdf, n, width > height ? width : height);
+        if (ret != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        // Same coverage mapping as ftgl_distance_mapf
+        img_min = FLT_MAX;
+        img_max = FLT_MIN;
+        for (i = 0; i < n; i++) {
+                v = img[i];
+                if (v > img_max) img_max = v;
+                if (v < img_min) img_min = v;
+        }
+        sdf->kernels->load(img, sdf->data, n, img_min, img_max);
+
+        // Transform background (0's)
+        memset(sdf->gx, 0, sizeof(*sdf->gx) * n);
+        memset(sdf->gy, 0, sizeof(*sdf->gy) * n);
+        sdf->kernels->gradient(sdf->data, width, height, sdf->gx, sdf->gy);
+        ftgl_edt_field(sdf, width, height, sdf->outside);
+
+        // Transform foreground (1's)
+        memset(sdf->gx, 0, sizeof(*sdf->gx) * n);
+        memset(sdf->gy, 0, sizeof(*sdf->gy) * n);
+        sdf->kernels->invert(sdf->data, n);
+        sdf->kernels->gradient(sdf->data, width, height, sdf->gx, sdf->gy);
+        ftgl_edt_field(sdf, width, height, sdf->inside);
+
+        // Bipolar distance field, mapped to bytes like ftgl_distance_mapf
+        v = fabsf(sdf->kernels->combine(sdf->outside, sdf->inside, n));
+        sdf->kernels->quantize(sdf->outside, out, n, v);
+        return FTGL_NO_ERROR;
+}
+
+/* The channels an edge contributes to, see ftgl_msdf_color_contour */
+#define FTGL_MSDF_RED     (1 << 0)
+#define FTGL_MSDF_GREEN   (1 << 1)
+#define FTGL_MSDF_BLUE    (1 << 2)
+#define FTGL_MSDF_YELLOW  (FTGL_MSDF_RED | FTGL_MSDF_GREEN)
+#define FTGL_MSDF_MAGENTA (FTGL_MSDF_RED | FTGL_MSDF_BLUE)
+#define FTGL_MSDF_CYAN    (FTGL_MSDF_GREEN | FTGL_MSDF_BLUE)
+#define FTGL_MSDF_WHITE   (FTGL_MSDF_RED | FTGL_MSDF_GREEN | FTGL_MSDF_BLUE)
+
+/* sin(3 rad), edges meeting at a sharper angle than this form a corner */
+#define FTGL_MSDF_CORNER (0.14112f)
+
+/* Newton iterations used to find the closest point on a cubic */
+#define FTGL_MSDF_CUBIC_STARTS (4)
+#define FTGL_MSDF_CUBIC_STEPS  (4)
+
+#define FTGL_MSDF_EDGES_CAPACITY (64)
+
+struct ftgl_msdf_edge_t {
+        /**
+         * The number of control points past the first, 1 for lines,
+         * 2 for conic and 3 for cubic Bézier curves.
+         */
+        int degree;
+
+        /**
+         * A combination of the FTGL_MSDF_* channels.
+         */
+        int color;
+
+        /**
+         * Non-zero when the edge starts at a corner of its contour.
+         */
+        int corner;
+
+        /**
+         * The control points, in pixels.
+         */
+        vec2_t p[4];
+};
+
+/**
+ * The distance to an edge, ordered by magnitude first and by how
+ * head-on the edge is approached second, see ftgl_msdf_closer.
+ */
+struct ftgl_msdf_distance_t {
+        float distance;
+        float dot;
+};
+
+struct ftgl_msdf_decompose_t {
+        ftgl_sdf_t sdf;
+
+        /**
+         * The first edge of the contour being decomposed and the
+         * point the pen is at.
+         */
+        size_t contour;
+        vec2_t pen;
+        ftgl_return_t ret;
+};
+
+static inline vec2_t ftgl_msdf_normalise(vec2_t v)
+{
+        float length;
+        length = ll_vec2_length2fv(v);
+        return length > 0.0f ? ll_vec2_div1f(v, length) : ll_vec2_create2f(0.0f, 1.0f);
+}
+
+static inline float ftgl_msdf_sign(float v)
+{
+        return v > 0.0f ? 1.0f : -1.0f;
+}
+
+static inline vec2_t ftgl_msdf_mix(vec2_t a, vec2_t b, float t)
+{
+        return ll_vec2_create2f(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t);
+}
+
+static inline int ftgl_msdf_closer(struct ftgl_msdf_distance_t a,
+                                   struct ftgl_msdf_distance_t b)
+{
+        return fabsf(a.distance) < fabsf(b.distance)
+                || (fabsf(a.distance) == fabsf(b.distance) && a.dot < b.dot);
+}
+
+static vec2_t ftgl_msdf_point(const struct ftgl_msdf_edge_t *edge, float t)
+{
+        vec2_t a, b, c;
+        switch (edge->degree) {
+        case 1:
+                return ftgl_msdf_mix(edge->p[0], edge->p[1], t);
+        case 2:
+                return ftgl_msdf_mix(ftgl_msdf_mix(edge->p[0], edge->p[1], t),
+                                     ftgl_msdf_mix(edge->p[1], edge->p[2], t), t);
+        default:
+                a = ftgl_msdf_mix(edge->p[0], edge->p[1], t);
+                b = ftgl_msdf_mix(edge->p[1], edge->p[2], t);
+                c = ftgl_msdf_mix(edge->p[2], edge->p[3], t);
+                return ftgl_msdf_mix(ftgl_msdf_mix(a, b, t), ftgl_msdf_mix(b, c, t), t);
+        }
+}
+
+/**
+ * The (unnormalised) tangent of @edge at @t, falling back to a chord
+ * where control points coincide with an end point.
+ */
+static vec2_t ftgl_msdf_direction(const struct ftgl_msdf_edge_t *edge, float t)
+{
+        vec2_t d, d0, d1, d2;
+        const vec2_t *p;
+
+        p = edge->p;
+        switch (edge->degree) {
+        case 1:
+                return ll_vec2_sub2fv(p[1], p[0]);
+        case 2:
+                d = ftgl_msdf_mix(ll_vec2_sub2fv(p[1], p[0]), ll_vec2_sub2fv(p[2], p[1]), t);
+                if (d.x == 0.0f && d.y == 0.0f) {
+                        return ll_vec2_sub2fv(p[2], p[0]);
+                }
+                return d;
+        default:
+                d0 = ll_vec2_sub2fv(p[1], p[0]);
+                d1 = ll_vec2_sub2fv(p[2], p[1]);
+                d2 = ll_vec2_sub2fv(p[3], p[2]);
+                d = ftgl_msdf_mix(ftgl_msdf_mix(d0, d1, t), ftgl_msdf_mix(d1, d2, t), t);
+                if (d.x == 0.0f && d.y == 0.0f) {
+                        if (t == 0.0f) return ll_vec2_sub2fv(p[2], p[0]);
+                        if (t == 1.0f) return ll_vec2_sub2fv(p[3], p[1]);
+                }
+                return d;
+        }
+}
+
+/**
+ * Real roots of a*x^2 + b*x + c, returns how many were stored in @x.
+ */
+static int ftgl_msdf_solve_quadratic(double x[2], double a, double b, double c)
+{
+        double discriminant;
+
+        if (a == 0.0 || fabs(b) > 1e12 * fabs(a)) {
+                if (b == 0.0) return 0;
+                x[0] = -c / b;
+                return 1;
+        }
+
+        discriminant = b*b - 4.0*a*c;
+        if (discriminant > 0.0) {
+                discriminant = sqrt(discriminant);
+                x[0] = (-b + discriminant) / (2.0*a);
+                x[1] = (-b - discriminant) / (2.0*a);
+                return 2;
+        } else if (discriminant == 0.0) {
+                x[0] = -b / (2.0*a);
+                return 1;
+        }
+        return 0;
+}
+
+/**
+ * Real roots of a*x^3 + b*x^2 + c*x + d, returns how many were stored
+ * in @x. Falls back to the quadratic when a is negligible.
+ */
+static int ftgl_msdf_solve_cubic(double x[3], double a, double b, double c, double d)
+{
+        double q, r, r2, q3, t, u, v;
+
+        if (a == 0.0 || fabs(b / a) >= 1e6) {
+                return ftgl_msdf_solve_quadratic(x, b, c, d);
+        }
+
+        // Normalise, then Cardano or the trigonometric form
+        b /= a;
+        c /= a;
+        d /= a;
+        q = (b*b - 3.0*c) / 9.0;
+        r = (b*(2.0*b*b - 9.0*c) + 27.0*d) / 54.0;
+        r2 = r*r;
+        q3 = q*q*q;
+        b /= 3.0;
+        if (r2 < q3) {
+                t = r / sqrt(q3);
+                if (t < -1.0) t = -1.0;
+                if (t > 1.0) t = 1.0;
+                t = acos(t);
+                q = -2.0 * sqrt(q);
+                x[0] = q * cos(t / 3.0) - b;
+                x[1] = q * cos((t + 2.0*M_PI) / 3.0) - b;
+                x[2] = q * cos((t - 2.0*M_PI) / 3.0) - b;
+                return 3;
+        }
+
+        u = (r < 0.0 ? 1.0 : -1.0) * pow(fabs(r) + sqrt(r2 - q3), 1.0 / 3.0);
+        v = u == 0.0 ? 0.0 : q / u;
+        x[0] = (u + v) - b;
+        if (u == v || fabs(u - v) < 1e-12 * fabs(u + v)) {
+                x[1] = -0.5 * (u + v) - b;
+                return 2;
+        }
+        return 1;
+}
+
+/**
+ * Signed distance from @origin to the closest point of @edge, whose
+ * parameter goes to @param. Parameters outside [0, 1] mean an end
+ * point was closest. Positive on the right of the edge's direction.
+ */
+static struct ftgl_msdf_distance_t ftgl_msdf_edge_distance(const struct ftgl_msdf_edge_t *edge,
+                                                           vec2_t origin, float *param)
+{
+        int i, j, n;
+        float t, distance, best, endpoint;
+        double roots[3];
+        vec2_t qa, ab, br, as, qe, d1, d2, dir, end;
+        struct ftgl_msdf_distance_t result;
+        const vec2_t *p;
+
+        p = edge->p;
+        if (edge->degree == 1) {
+                qa = ll_vec2_sub2fv(origin, p[0]);
+                ab = ll_vec2_sub2fv(p[1], p[0]);
+                *param = ll_vec2_dot2fv(qa, ab) / ll_vec2_dot2fv(ab, ab);
+                end = ll_vec2_sub2fv(*param > 0.5f ? p[1] : p[0], origin);
+                endpoint = ll_vec2_length2fv(end);
+                if (*param > 0.0f && *param < 1.0f) {
+                        distance = ll_vec2_cross2fv(ftgl_msdf_normalise(ab), qa);
+                        if (fabsf(distance) < endpoint) {
+                                result.distance = -distance;
+                                result.dot = 0.0f;
+                                return result;
+                        }
+                }
+                result.distance = ftgl_msdf_sign(ll_vec2_cross2fv(qa, ab)) * endpoint;
+                result.dot = fabsf(ll_vec2_dot2fv(ftgl_msdf_normalise(ab),
+                                                  ftgl_msdf_normalise(end)));
+                return result;
+        }
+
+        // Closest end point first, then every interior extremum
+        qa = ll_vec2_sub2fv(p[0], origin);
+        dir = ftgl_msdf_direction(edge, 0.0f);
+        best = ftgl_msdf_sign(ll_vec2_cross2fv(dir, qa)) * ll_vec2_length2fv(qa);
+        *param = -ll_vec2_dot2fv(qa, dir) / ll_vec2_dot2fv(dir, dir);
+
+        end = ll_vec2_sub2fv(p[edge->degree], origin);
+        distance = ll_vec2_length2fv(end);
+        if (distance < fabsf(best)) {
+                dir = ftgl_msdf_direction(edge, 1.0f);
+                best = ftgl_msdf_sign(ll_vec2_cross2fv(dir, end)) * distance;
+                *param = 1.0f - ll_vec2_dot2fv(end, dir) / ll_vec2_dot2fv(dir, dir);
+        }
+
+        ab = ll_vec2_sub2fv(p[1], p[0]);
+        br = ll_vec2_sub2fv(ll_vec2_sub2fv(p[2], p[1]), ab);
+        if (edge->degree == 2) {
+                n = ftgl_msdf_solve_cubic(roots, ll_vec2_dot2fv(br, br),
+                                          3.0f * ll_vec2_dot2fv(ab, br),
+                                          2.0f * ll_vec2_dot2fv(ab, ab) + ll_vec2_dot2fv(qa, br),
+                                          ll_vec2_dot2fv(qa, ab));
+                for (i = 0; i < n; i++) {
+                        t = (float) roots[i];
+                        if (t <= 0.0f || t >= 1.0f) continue;
+                        qe = ll_vec2_add2fv(qa, ll_vec2_add2fv(ll_vec2_mul1f(ab, 2.0f * t),
+                                                               ll_vec2_mul1f(br, t * t)));
+                        distance = ll_vec2_length2fv(qe);
+                        if (distance <= fabsf(best)) {
+                                dir = ll_vec2_add2fv(ab, ll_vec2_mul1f(br, t));
+                                best = ftgl_msdf_sign(ll_vec2_cross2fv(dir, qe)) * distance;
+                                *param = t;
+                        }
+                }
+        } else {
+                as = ll_vec2_sub2fv(ll_vec2_sub2fv(ll_vec2_sub2fv(p[3], p[2]),
+                                                   ll_vec2_sub2fv(p[2], p[1])), br);
+                for (i = 0; i <= FTGL_MSDF_CUBIC_STARTS; i++) {
+                        t = (float) i / FTGL_MSDF_CUBIC_STARTS;
+                        for (j = 0; j < FTGL_MSDF_CUBIC_STEPS; j++) {
+                                qe = ll_vec2_sub2fv(ftgl_msdf_point(edge, t), origin);
+                                d1 = ll_vec2_add2fv(ll_vec2_mul1f(ab, 3.0f),
+                                                    ll_vec2_add2fv(ll_vec2_mul1f(br, 6.0f * t),
+                                                                   ll_vec2_mul1f(as, 3.0f * t * t)));
+                                d2 = ll_vec2_add2fv(ll_vec2_mul1f(br, 6.0f),
+                                                    ll_vec2_mul1f(as, 6.0f * t));
+                                distance = ll_vec2_dot2fv(d1, d1) + ll_vec2_dot2fv(qe, d2);
+                                if (distance == 0.0f) break;
+                                t -= ll_vec2_dot2fv(qe, d1) / distance;
+                                if (t <= 0.0f || t >= 1.0f) break;
+
+                                qe = ll_vec2_sub2fv(ftgl_msdf_point(edge, t), origin);
+                                distance = ll_vec2_length2fv(qe);
+                                if (distance < fabsf(best)) {
+                                        dir = ftgl_msdf_direction(edge, t);
+                                        best = ftgl_msdf_sign(ll_vec2_cross2fv(dir, qe)) * distance;
+                                        *param = t;
+                                }
+                        }
+                }
+        }
+
+        result.distance = best;
+        result.dot = 0.0f;
+        if (*param < 0.0f) {
+                result.dot = fabsf(ll_vec2_dot2fv(ftgl_msdf_normalise(ftgl_msdf_direction(edge, 0.0f)),
+                                                  ftgl_msdf_normalise(qa)));
+        } else if (*param > 1.0f) {
+                result.dot = fabsf(ll_vec2_dot2fv(ftgl_msdf_normalise(ftgl_msdf_direction(edge, 1.0f)),
+                                                  ftgl_msdf_normalise(end)));
+        }
+        return result;
+}
+
+/**
+ * Past either end of @edge, replaces the distance to the end point
+ * with the distance to the tangent line there. This is what keeps
+ * corners sharp once two channels disagree about them.
+ */
+static float ftgl_msdf_pseudo_distance(const struct ftgl_msdf_edge_t *edge, vec2_t origin,
+                                       struct ftgl_msdf_distance_t distance, float param)
+{
+        float pseudo;
+        vec2_t dir, q;
+
+        if (param < 0.0f) {
+                dir = ftgl_msdf_normalise(ftgl_msdf_direction(edge, 0.0f));
+                q = ll_vec2_sub2fv(origin, edge->p[0]);
+                if (ll_vec2_dot2fv(q, dir) < 0.0f) {
+                        pseudo = ll_vec2_cross2fv(q, dir);
+                        if (fabsf(pseudo) <= fabsf(distance.distance)) {
+                                return pseudo;
+                        }
+                }
+        } else if (param > 1.0f) {
+                dir = ftgl_msdf_normalise(ftgl_msdf_direction(edge, 1.0f));
+                q = ll_vec2_sub2fv(origin, edge->p[edge->degree]);
+                if (ll_vec2_dot2fv(q, dir) > 0.0f) {
+                        pseudo = ll_vec2_cross2fv(q, dir);
+                        if (fabsf(pseudo) <= fabsf(distance.distance)) {
+                                return pseudo;
+                        }
+                }
+        }
+        return distance.distance;
+}
+
+/**
+ * Splits @edge in half with de Casteljau's algorithm.
+ */
+static void ftgl_msdf_split(const struct ftgl_msdf_edge_t *edge,
+                            struct ftgl_msdf_edge_t *first,
+                            struct ftgl_msdf_edge_t *second)
+{
+        int i, j;
+        vec2_t p[4][4];
+
+        for (i = 0; i <= edge->degree; i++) {
+                p[0][i] = edge->p[i];
+        }
+        for (i = 1; i <= edge->degree; i++) {
+                for (j = 0; j <= edge->degree - i; j++) {
+                        p[i][j] = ftgl_msdf_mix(p[i-1][j], p[i-1][j+1], 0.5f);
+                }
+        }
+
+        *first = *edge;
+        *second = *edge;
+        for (i = 0; i <= edge->degree; i++) {
+                first->p[i] = p[i][0];
+                second->p[i] = p[edge->degree - i][i];
+        }
+        second->corner = 0;
+}
+
+static ftgl_return_t ftgl_msdf_reserve(ftgl_sdf_t sdf, size_t count)
+{
+        size_t new_capacity;
+        struct ftgl_msdf_edge_t *new_edges;
+
+        if (count <= sdf->edges_capacity) {
+                return FTGL_NO_ERROR;
+        }
+
+        new_capacity = sdf->edges_capacity ? sdf->edges_capacity : FTGL_MSDF_EDGES_CAPACITY;
+        while (new_capacity < count) {
+                new_capacity <<= 1;
+        }
+
+        new_edges = FTGL_REALLOC(sdf->edges, sizeof(*new_edges) * new_capacity);
+        if (!new_edges) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        sdf->edges = new_edges;
+        sdf->edges_capacity = new_capacity;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Picks the next color of a contour, the one-channel overlap with
+ * @banned is never chosen so the first and last spline of a contour
+ * still differ in two channels.
+ */
+static int ftgl_msdf_switch_color(int color, int banned)
+{
+        int combined, shifted;
+
+        combined = color & banned;
+        if (combined == FTGL_MSDF_RED || combined == FTGL_MSDF_GREEN
+            || combined == FTGL_MSDF_BLUE) {
+                return combined ^ FTGL_MSDF_WHITE;
+        }
+
+        if (color == 0 || color == FTGL_MSDF_WHITE) {
+                return FTGL_MSDF_CYAN;
+        }
+
+        shifted = color << 1;
+        return (shifted | shifted >> 3) & FTGL_MSDF_WHITE;
+}
+
+/**
+ * Colors the edges of the contour that starts at edge @first, the
+ * simple scheme of Chlumský's msdfgen: smooth contours stay white,
+ * a contour with a single corner is split in three, and otherwise the
+ * color switches at every corner so that the two edges meeting at a
+ * corner only share one channel.
+ */
+static ftgl_return_t ftgl_msdf_color_contour(ftgl_sdf_t sdf, size_t first)
+{
+        size_t i, n, corners, start, spline;
+        int color, initial, part;
+        vec2_t a, b;
+        struct ftgl_msdf_edge_t *edges, split[4];
+        ftgl_return_t ret;
+
+        edges = sdf->edges + first;
+        n = sdf->nedges - first;
+        if (n == 0) {
+                return FTGL_NO_ERROR;
+        }
+
+        corners = 0;
+        start = 0;
+        for (i = 0; i < n; i++) {
+                a = ftgl_msdf_normalise(ftgl_msdf_direction(&edges[(i + n - 1) % n], 1.0f));
+                b = ftgl_msdf_normalise(ftgl_msdf_direction(&edges[i], 0.0f));
+                edges[i].corner = ll_vec2_dot2fv(a, b) <= 0.0f
+                        || fabsf(ll_vec2_cross2fv(a, b)) > FTGL_MSDF_CORNER;
+                if (edges[i].corner && corners++ == 0) {
+                        start = i;
+                }
+        }
+
+        if (corners == 0) {
+                for (i = 0; i < n; i++) {
+                        edges[i].color = FTGL_MSDF_WHITE;
+                }
+                return FTGL_NO_ERROR;
+        }
+
+        if (corners == 1) {
+                // A teardrop needs three edges to spread the colors over
+                while (n < 3) {
+                        for (i = 0; i < n; i++) {
+                                ftgl_msdf_split(&edges[(start + i) % n],
+                                                &split[2*i], &split[2*i + 1]);
+                        }
+                        if ((ret = ftgl_msdf_reserve(sdf, first + 2*n)) != FTGL_NO_ERROR) {
+                                return ret;
+                        }
+                        edges = sdf->edges + first;
+                        memcpy(edges, split, sizeof(*edges) * 2*n);
+                        n *= 2;
+                        sdf->nedges = first + n;
+                        start = 0;
+                }
+
+                for (i = 0; i < n; i++) {
+                        // Magenta, white then yellow, roughly a third each
+                        part = (int) (3.0f + 2.875f * i / (n - 1) - 1.4375f + 0.5f) - 3;
+                        edges[(start + i) % n].color = part < 0 ? FTGL_MSDF_MAGENTA
+                                : part == 0 ? FTGL_MSDF_WHITE : FTGL_MSDF_YELLOW;
+                }
+                return FTGL_NO_ERROR;
+        }
+
+        initial = color = ftgl_msdf_switch_color(0, 0);
+        spline = 0;
+        for (i = 0; i < n; i++) {
+                if (i > 0 && edges[(start + i) % n].corner) {
+                        spline++;
+                        color = ftgl_msdf_switch_color(color, spline == corners - 1
+                                                       ? initial : 0);
+                }
+                edges[(start + i) % n].color = color;
+        }
+        return FTGL_NO_ERROR;
+}
+
+static ftgl_return_t ftgl_msdf_add_edge(struct ftgl_msdf_decompose_t *ctx, int degree,
+                                        const FT_Vector **points)
+{
+        int i;
+        struct ftgl_msdf_edge_t *edge;
+
+        if ((ctx->ret = ftgl_msdf_reserve(ctx->sdf, ctx->sdf->nedges + 1)) != FTGL_NO_ERROR) {
+                return ctx->ret;
+        }
+
+        edge = &ctx->sdf->edges[ctx->sdf->nedges];
+        edge->degree = degree;
+        edge->color = FTGL_MSDF_WHITE;
+        edge->corner = 0;
+        edge->p[0] = ctx->pen;
+        for (i = 0; i < degree; i++) {
+                edge->p[i + 1] = ll_vec2_create2f(points[i]->x / FTGL_FONT_HRESf,
+                                                  points[i]->y / FTGL_FONT_HRESf);
+        }
+
+        ctx->pen = edge->p[degree];
+        // Zero length edges have no direction to color by
+        for (i = 1; i <= degree; i++) {
+                if (edge->p[i].x != edge->p[0].x || edge->p[i].y != edge->p[0].y) {
+                        ctx->sdf->nedges++;
+                        break;
+                }
+        }
+        return FTGL_NO_ERROR;
+}
+
+static int ftgl_msdf_move_to(const FT_Vector *to, void *user)
+{
+        struct ftgl_msdf_decompose_t *ctx;
+
+        ctx = user;
+        if ((ctx->ret = ftgl_msdf_color_contour(ctx->sdf, ctx->contour)) != FTGL_NO_ERROR) {
+                return 1;
+        }
+
+        ctx->contour = ctx->sdf->nedges;
+        ctx->pen = ll_vec2_create2f(to->x / FTGL_FONT_HRESf, to->y / FTGL_FONT_HRESf);
+        return 0;
+}
+
+static int ftgl_msdf_line_to(const FT_Vector *to, void *user)
+{
+        const FT_Vector *points[1] = { to };
+        return ftgl_msdf_add_edge(user, 1, points) != FTGL_NO_ERROR;
+}
+
+static int ftgl_msdf_conic_to(const FT_Vector *control, const FT_Vector *to, void *user)
+{
+        const FT_Vector *points[2] = { control, to };
+        return ftgl_msdf_add_edge(user, 2, points) != FTGL_NO_ERROR;
+}
+
+static int ftgl_msdf_cubic_to(const FT_Vector *control1, const FT_Vector *control2,
+                              const FT_Vector *to, void *user)
+{
+        const FT_Vector *points[3] = { control1, control2, to };
+        return ftgl_msdf_add_edge(user, 3, points) != FTGL_NO_ERROR;
+}
+
+static inline float ftgl_msdf_median(float r, float g, float b)
+{
+        return fmaxf(fminf(r, g), fminf(fmaxf(r, g), b));
+}
+
+/**
+ * Whether bilinear filtering between texels @a and @b, whose channels
+ * are @stride apart, would produce a false edge because two channels swap sides,
+ * flagging only the texel of the pair that is further from the edge.
+ */
+static int ftgl_msdf_clash(const float *a, const float *b, size_t stride, float threshold)
+{
+        float a0, a1, a2, b0, b1, b2, t;
+
+        a0 = a[0]; a1 = a[stride]; a2 = a[2*stride];
+        b0 = b[0]; b1 = b[stride]; b2 = b[2*stride];
+        // Sort the channels by how much they differ, largest first
+        if (fabsf(b0 - a0) < fabsf(b1 - a1)) {
+                t = a0; a0 = a1; a1 = t;
+                t = b0; b0 = b1; b1 = t;
+        }
+        if (fabsf(b1 - a1) < fabsf(b2 - a2)) {
+                t = a1; a1 = a2; a2 = t;
+                t = b1; b1 = b2; b2 = t;
+                if (fabsf(b0 - a0) < fabsf(b1 - a1)) {
+                        t = a0; a0 = a1; a1 = t;
+                        t = b0; b0 = b1; b1 = t;
+                }
+        }
+
+        return fabsf(b1 - a1) >= threshold
+                && !(b0 == b1 && b0 == b2)
+                && fabsf(a2 - 0.5f) >= fabsf(b2 - 0.5f);
+}
+
+FTGLDEF ftgl_return_t ftgl_distance_map_msdf(ftgl_sdf_t sdf, FT_Library library,
+                                             FT_Outline *outline, unsigned char *out,
+                                             unsigned int width, unsigned int height,
+                                             int left, int top, float spread)
+{
+        unsigned int x, y;
+        size_t i, e, n, stride;
+        float param, median, threshold, polarity, v, *field[3], *texel;
+        vec2_t origin;
+        FT_Bitmap bitmap;
+        FT_Outline_Funcs funcs;
+        struct ftgl_msdf_decompose_t ctx;
+        struct ftgl_msdf_distance_t distance, best[3];
+        size_t closest[3];
+        float closest_param[3];
+        const struct ftgl_msdf_edge_t *edge;
+        ftgl_return_t ret;
+        int c, inside;
+
+        n = (size_t) width * height;
+        if (n == 0) {
+                return FTGL_NO_ERROR;
+        }
+
+        if ((ret = ftgl_sdf_reserve(sdf, n, 0)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        funcs.move_to = ftgl_msdf_move_to;
+        funcs.line_to = ftgl_msdf_line_to;
+        funcs.conic_to = ftgl_msdf_conic_to;
+        funcs.cubic_to = ftgl_msdf_cubic_to;
+        funcs.shift = 0;
+        funcs.delta = 0;
+
+        sdf->nedges = 0;
+        ctx.sdf = sdf;
+        ctx.contour = 0;
+        ctx.pen = ll_vec2_origin();
+        ctx.ret = FTGL_NO_ERROR;
+        if (FT_Outline_Decompose(outline, &funcs, &ctx) != FT_Err_Ok) {
+                if (ctx.ret == FTGL_NO_ERROR) {
+                        FTGL_LOG_MESSAGE("Failed to decompose the outline!");
+                        return FTGL_FREETYPE_ERROR;
+                }
+                return ctx.ret;
+        }
+
+        if ((ret = ftgl_msdf_color_contour(sdf, ctx.contour)) != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        // FreeType's rasterizer settles which texels are inside, with
+        // the outline's own fill rule. The coverage is parked in @out.
+        memset(out, 0, n);
+        memset(&bitmap, 0, sizeof(bitmap));
+        bitmap.rows = height;
+        bitmap.width = width;
+        bitmap.pitch = width;
+        bitmap.buffer = out;
+        bitmap.num_grays = 256;
+        bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+        FT_Outline_Translate(outline, -left * FTGL_FONT_HRES,
+                             -(top - (int) height) * FTGL_FONT_HRES);
+        if (FT_Outline_Get_Bitmap(library, outline, &bitmap) != FT_Err_Ok) {
+                FT_Outline_Translate(outline, left * FTGL_FONT_HRES,
+                                     (top - (int) height) * FTGL_FONT_HRES);
+                FTGL_LOG_MESSAGE("Failed to rasterize the outline!");
+                return FTGL_FREETYPE_ERROR;
+        }
+        FT_Outline_Translate(outline, left * FTGL_FONT_HRES,
+                             (top - (int) height) * FTGL_FONT_HRES);
+
+        // The edge distances are positive to the right of each edge,
+        // which is inside for clockwise (TrueType) outlines
+        polarity = FT_Outline_Get_Orientation(outline) == FT_ORIENTATION_POSTSCRIPT
+                ? -1.0f : 1.0f;
+
+        // Planar channels in the three consecutive buffers data, gx
+        // and gy, mapped so that 0.5 is the edge
+        stride = sdf->capacity;
+        field[0] = sdf->data;
+        field[1] = sdf->gx;
+        field[2] = sdf->gy;
+        for (y = 0, i = 0; y < height; y++) {
+                for (x = 0; x < width; x++, i++) {
+                        origin = ll_vec2_create2f(left + (int) x + 0.5f, top - (int) y - 0.5f);
+                        for (c = 0; c < 3; c++) {
+                                best[c].distance = -FLT_MAX;
+                                best[c].dot = 1.0f;
+                                closest[c] = sdf->nedges;
+                        }
+
+                        for (e = 0; e < sdf->nedges; e++) {
+                                edge = &sdf->edges[e];
+                                distance = ftgl_msdf_edge_distance(edge, origin, &param);
+                                for (c = 0; c < 3; c++) {
+                                        if ((edge->color & (1 << c))
+                                            && ftgl_msdf_closer(distance, best[c])) {
+                                                best[c] = distance;
+                                                closest[c] = e;
+                                                closest_param[c] = param;
+                                        }
+                                }
+                        }
+
+                        for (c = 0; c < 3; c++) {
+                                v = best[c].distance;
+                                if (closest[c] < sdf->nedges) {
+                                        v = ftgl_msdf_pseudo_distance(&sdf->edges[closest[c]],
+                                                                      origin, best[c],
+                                                                      closest_param[c]);
+                                }
+                                field[c][i] = 0.5f + polarity * v / (2.0f * spread);
+                        }
+
+                        // Flip texels whose median disagrees with the fill
+                        inside = out[i] >= 128;
+                        median = ftgl_msdf_median(field[0][i], field[1][i], field[2][i]);
+                        if ((median > 0.5f) != inside) {
+                                for (c = 0; c < 3; c++) {
+                                        field[c][i] = 1.0f - field[c][i];
+                                }
+                        }
+                }
+        }
+
+        // Texels that would interpolate into a false edge fall back to
+        // a single channel field. They are marked in outside first so
+        // that every test sees the original values.
+        threshold = 1.001f / (2.0f * spread);
+        for (y = 0, i = 0; y < height; y++) {
+                for (x = 0; x < width; x++, i++) {
+                        texel = field[0] + i;
+                        sdf->outside[i] =
+                                (x > 0 && ftgl_msdf_clash(texel, texel - 1, stride, threshold))
+                                || (x + 1 < width && ftgl_msdf_clash(texel, texel + 1, stride, threshold))
+                                || (y > 0 && ftgl_msdf_clash(texel, texel - width, stride, threshold))
+                                || (y + 1 < height && ftgl_msdf_clash(texel, texel + width, stride, threshold));
+                }
+        }
+
+        for (i = 0; i < n; i++) {
+                if (sdf->outside[i] != 0.0f) {
+                        median = ftgl_msdf_median(field[0][i], field[1][i], field[2][i]);
+                        field[0][i] = field[1][i] = field[2][i] = median;
+                }
+        }
+
+        for (i = 0; i < n; i++) {
+                for (c = 0; c < 3; c++) {
+                        v = field[c][i];
+                        if (v < 0.0f) v = 0.0f;
+                        else if (v > 1.0f) v = 1.0f;
+                        out[3*i + c] = (unsigned char) (255.0f * v + 0.5f);
+                }
+        }
+        return FTGL_NO_ERROR;
+}
+
+static inline float ftgl_lanczos(float t)
+{
+        const float a = FTGL_LANCZOS_SUPPORT;
+
+        if (t == 0.0f) {
+                return 1.0f;
+        }
+        if (t <= -a || t >= a) {
+                return 0.0f;
+        }
+        t *= (float) M_PI;
+        return a * sinf(t) * sinf(t / a) / (t * t);
+}
+
+/* Scales @outline's points in place, exactly, by an integer @factor */
+static void ftgl_outline_scale(FT_Outline *outline, int factor, int down)
+{
+        short i;
+
+        for (i = 0; i < outline->n_points; i++) {
+                if (down) {
+                        outline->points[i].x /= factor;
+                        outline->points[i].y /= factor;
+                } else {
+                        outline->points[i].x *= factor;
+                        outline->points[i].y *= factor;
+                }
+        }
+}
+
+FTGLDEF ftgl_return_t ftgl_distance_map_supersampled(ftgl_sdf_t sdf, FT_Library library,
+                                                     FT_Outline *outline, unsigned char *out,
+                                                     unsigned int width, unsigned int height,
+                                                     int left, int top, float spread,
+                                                     int factor, ftgl_filter_t filter)
+{
+        int support, margin, taps, tile, tile_x, tile_y, tile_w, tile_h;
+        int x0, y0, x1, y1, region_w, region_h, x, y, o, j;
+        size_t i, n;
+        float d, sum, *kernel, *rows, *acc;
+        const float *src;
+        FT_Bitmap bitmap;
+        FT_Pos dx, dy;
+        FT_Error error;
+        ftgl_return_t ret;
+
+        if (width == 0 || height == 0) {
+                return FTGL_NO_ERROR;
+        }
+
+        if (factor < 1 || spread <= 0.0f) {
+                FTGL_LOG_MESSAGE("Invalid supersampling factor or spread!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        // Every texel of a tile needs the seeds within @spread of it,
+        // and of every sample the filter reads around it
+        support = filter == FTGL_FILTER_LANCZOS ? FTGL_LANCZOS_SUPPORT : 0;
+        margin = (int) ceilf(spread) + support;
+        taps = (2 * support + 1) * factor;
+
+        // The arena only ever holds one tile's region, whatever the
+        // size of the glyph
+        tile = FTGL_SDF_TILE;
+        region_w = (tile + 2 * margin < (int) width ? tile + 2 * margin : (int) width) * factor;
+        region_h = (tile + 2 * margin < (int) height ? tile + 2 * margin : (int) height) * factor;
+        n = (size_t) region_w * region_h;
+        j = region_w > region_h ? region_w : region_h;
+        ret = ftgl_sdf_reserve(sdf, n, j > taps ? j : taps);
+        if (ret != FTGL_NO_ERROR) {
+                return ret;
+        }
+
+        // A normalised kernel over the samples of a texel and its
+        // neighbours within @support, at their offset from its centre
+        kernel = sdf->line;
+        sum = 0.0f;
+        for (o = 0; o < taps; o++) {
+                kernel[o] = support == 0 ? 1.0f
+                        : ftgl_lanczos((o + 0.5f) / factor - support - 0.5f);
+                sum += kernel[o];
+        }
+        for (o = 0; o < taps; o++) {
+                kernel[o] /= sum;
+        }
+
+        memset(&bitmap, 0, sizeof(bitmap));
+        bitmap.buffer = sdf->coverage;
+        bitmap.num_grays = 256;
+        bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+
+        ftgl_outline_scale(outline, factor, 0);
+        for (tile_y = 0; tile_y < (int) height; tile_y += tile) {
+                tile_h = (int) height - tile_y < tile ? (int) height - tile_y : tile;
+                y0 = tile_y - margin > 0 ? tile_y - margin : 0;
+                y1 = tile_y + tile_h + margin < (int) height ? tile_y + tile_h + margin : (int) height;
+                for (tile_x = 0; tile_x < (int) width; tile_x += tile) {
+                        tile_w = (int) width - tile_x < tile ? (int) width - tile_x : tile;
+                        x0 = tile_x - margin > 0 ? tile_x - margin : 0;
+                        x1 = tile_x + tile_w + margin < (int) width ? tile_x + tile_w + margin : (int) width;
+                        region_w = (x1 - x0) * factor;
+                        region_h = (y1 - y0) * factor;
+                        n = (size_t) region_w * region_h;
+
+                        memset(sdf->coverage, 0, n);
+                        bitmap.rows = region_h;
+                        bitmap.width = region_w;
+                        bitmap.pitch = region_w;
+                        dx = (FT_Pos) (left + x0) * factor * FTGL_FONT_HRES;
+                        dy = ((FT_Pos) (top - y0) * factor - region_h) * FTGL_FONT_HRES;
+                        FT_Outline_Translate(outline, -dx, -dy);
+                        error = FT_Outline_Get_Bitmap(library, outline, &bitmap);
+                        FT_Outline_Translate(outline, dx, dy);
+                        if (error != FT_Err_Ok) {
+                                ftgl_outline_scale(outline, factor, 1);
+                                FTGL_LOG_MESSAGE("Failed to rasterize the outline!");
+                                return FTGL_FREETYPE_ERROR;
+                        }
+
+                        // Samples are binary at this resolution, so the
+                        // exact transforms to either side are enough
+                        for (i = 0; i < n; i++) {
+                                if (sdf->coverage[i] >= 128) {
+                                        sdf->outside[i] = 0.0f;
+                                        sdf->inside[i] = FTGL_EDT_INF;
+                                } else {
+                                        sdf->outside[i] = FTGL_EDT_INF;
+                                        sdf->inside[i] = 0.0f;
+                                }
+                        }
+                        ftgl_edt_grid_blocked(sdf, sdf->outside, region_w, region_h);
+                        ftgl_edt_grid_blocked(sdf, sdf->inside, region_w, region_h);
+
+                        // Signed distances in output pixels, positive
+                        // inside, measured to the boundary between samples
+                        for (i = 0; i < n; i++) {
+                                if (sdf->coverage[i] >= 128) {
+                                        d = sqrtf(sdf->inside[i]) - 0.5f;
+                                } else {
+                                        d = 0.5f - sqrtf(sdf->outside[i]);
+                                }
+                                d /= factor;
+                                if (d > spread) d = spread;
+                                else if (d < -spread) d = -spread;
+                                sdf->data[i] = d;
+                        }
+
+                        // Separable reduction, rows into outside and
+                        // then columns into inside, one output row at a
+                        // time. Samples past the field repeat its edge,
+                        // which is saturated anyway.
+                        rows = sdf->outside;
+                        for (y = 0; y < region_h; y++) {
+                                src = sdf->data + (size_t) y * region_w;
+                                for (x = 0; x < tile_w; x++) {
+                                        j = (tile_x - x0 + x - support) * factor;
+                                        sum = 0.0f;
+                                        for (o = 0; o < taps; o++) {
+                                                i = j + o < 0 ? 0
+                                                        : j + o >= region_w ? region_w - 1 : j + o;
+                                                sum += kernel[o] * src[i];
+                                        }
+                                        rows[y * tile_w + x] = sum;
+                                }
+                        }
+
+                        acc = sdf->inside;
+                        for (y = 0; y < tile_h; y++) {
+                                memset(acc, 0, tile_w * sizeof(*acc));
+                                j = (tile_y - y0 + y - support) * factor;
+                                for (o = 0; o < taps; o++) {
+                                        i = j + o < 0 ? 0
+                                                : j + o >= region_h ? region_h - 1 : j + o;
+                                        src = rows + i * tile_w;
+                                        for (x = 0; x < tile_w; x++) {
+                                                acc[x] += kernel[o] * src[x];
+                                        }
+                                }
+
+                                for (x = 0; x < tile_w; x++) {
+                                        d = 128.0f + 128.0f * acc[x] / spread;
+                                        if (d < 0.0f) d = 0.0f;
+                                        else if (d > 255.0f) d = 255.0f;
+                                        out[(size_t) (tile_y + y) * width + tile_x + x] =
+                                                (unsigned char) (d + 0.5f);
+                                }
+                        }
+                }
+        }
+        ftgl_outline_scale(outline, factor, 1);
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF void ftgl_sdf_free(ftgl_sdf_t *sdf)
+{
+        FTGL_FREE((*sdf)->data);
+        FTGL_FREE((*sdf)->edges);
+        FTGL_FREE(*sdf);
+        *sdf = NULL;
+}
+
+static inline ftgl_glyph_t ftgl_font_lookup(ftgl_font_t font, uint32_t codepoint)
+{
+        ftgl_glyph_t glyph;
+        glyph = ftgl_glyphmap_find_glyph(font->glyphmap, codepoint);
+        if (glyph) {
+                glyph->generation = font->generation;
+        }
+        return glyph;
+}
+
+/* Loads the glyph @key names, a codepoint or an FTGL_GLYPH_INDEX */
+static FT_Error ftgl_font_load_key(FT_Face face, uint32_t key, FT_Int32 flags)
+{
+        if (key & FTGL_GLYPH_INDEX) {
+                return FT_Load_Glyph(face, key & ~FTGL_GLYPH_INDEX, flags);
+        }
+        return FT_Load_Char(face, key, flags);
+}
+
+/**
+ * Loads @codepoint into @face's glyph slot and renders it, as a
+ * coverage bitmap or, for FTGL_RENDERMODE_SDF_OUTLINE, as a distance
+ * field computed from the outline by FreeType. FTGL_RENDERMODE_MSDF
+ * and FTGL_RENDERMODE_SDF_SUPERSAMPLED only load the unhinted outline,
+ * so the field scales cleanly.
+ */
+static ftgl_return_t ftgl_font_render(ftgl_font_t font, FT_Face face, uint32_t codepoint)
+{
+#ifdef FTGL_HAS_SDF_RENDERER
+        FT_Int spread;
+#endif /* FTGL_HAS_SDF_RENDERER */
+
+        if (font->rendermode == FTGL_RENDERMODE_MSDF
+            || font->rendermode == FTGL_RENDERMODE_SDF_SUPERSAMPLED) {
+                if (ftgl_font_load_key(face, codepoint, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING)
+                    != FT_Err_Ok) {
+                        FTGL_LOG_MESSAGE("Failed to load codepoint!");
+                        return FTGL_FREETYPE_ERROR;
+                }
+
+                if (face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
+                        FTGL_LOG_MESSAGE("This render mode needs an outline font!");
+                        return FTGL_FREETYPE_ERROR;
+                }
+                return FTGL_NO_ERROR;
+        }
+
+        if (font->rendermode != FTGL_RENDERMODE_SDF_OUTLINE) {
+                if (ftgl_font_load_key(face, codepoint, FT_LOAD_RENDER) != FT_Err_Ok) {
+                        FTGL_LOG_MESSAGE("Failed to load codepoint!");
+                        return FTGL_FREETYPE_ERROR;
+                }
+                return FTGL_NO_ERROR;
+        }
+
+#ifdef FTGL_HAS_SDF_RENDERER
+        if (ftgl_font_load_key(face, codepoint, FT_LOAD_DEFAULT) != FT_Err_Ok) {
+                FTGL_LOG_MESSAGE("Failed to load codepoint!");
+                return FTGL_FREETYPE_ERROR;
+        }
+
+        // The spread belongs to the library, which other fonts share
+        spread = font->sdf_spread;
+        FT_Property_Set(face->glyph->library, "sdf", "spread", &spread);
+        FT_Property_Set(face->glyph->library, "bsdf", "spread", &spread);
+        if (FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF) != FT_Err_Ok) {
+                FTGL_LOG_MESSAGE("Failed to render the distance field!");
+                return FTGL_FREETYPE_ERROR;
+        }
+        return FTGL_NO_ERROR;
+#else /* !defined(FTGL_HAS_SDF_RENDERER) */
+        FTGL_LOG_MESSAGE("FreeType is too old to render distance fields!");
+        return FTGL_FREETYPE_ERROR;
+#endif /* FTGL_HAS_SDF_RENDERER */
+}
+
+/**
+ * Turns the outline in @slot into a multi-channel or supersampled
+ * field reaching font->sdf_spread pixels past the outline, padded like
+ * any other glyph.
+ */
+static ftgl_return_t ftgl_font_rasterize_outline(ftgl_font_t font, FT_GlyphSlot slot,
+                                                 ftgl_sdf_t sdf, struct ftgl_raster_t *raster)
+{
+        FT_BBox cbox;
+        int left, top, width, height, depth;
+        size_t tgt_w, tgt_h;
+        unsigned char *buffer;
+        ftgl_return_t ret;
+
+        // Blank glyphs get a blank padded cell, like empty bitmaps
+        left = top = width = height = 0;
+        if (slot->outline.n_points > 0) {
+                FT_Outline_Get_CBox(&slot->outline, &cbox);
+                left = (int) (cbox.xMin >> 6) - font->sdf_spread;
+                top = (int) ((cbox.yMax + 63) >> 6) + font->sdf_spread;
+                width = (int) ((cbox.xMax + 63) >> 6) + font->sdf_spread - left;
+                height = top - (int) (cbox.yMin >> 6) + font->sdf_spread;
+        }
+
+        // The padding is part of the field, so it fades out smoothly
+        tgt_w = width + 2 * FTGL_GLYPH_OFFSET;
+        tgt_h = height + 2 * FTGL_GLYPH_OFFSET;
+        depth = font->atlas->depth;
+        buffer = FTGL_CALLOC(tgt_w * tgt_h * depth, sizeof(*buffer));
+        if (!buffer) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        if (width > 0) {
+                if (font->rendermode == FTGL_RENDERMODE_MSDF) {
+                        ret = ftgl_distance_map_msdf(sdf, slot->library, &slot->outline,
+                                                     buffer, tgt_w, tgt_h,
+                                                     left - FTGL_GLYPH_OFFSET,
+                                                     top + FTGL_GLYPH_OFFSET,
+                                                     font->sdf_spread);
+                } else {
+                        ret = ftgl_distance_map_supersampled(sdf, slot->library,
+                                                             &slot->outline, buffer,
+                                                             tgt_w, tgt_h,
+                                                             left - FTGL_GLYPH_OFFSET,
+                                                             top + FTGL_GLYPH_OFFSET,
+                                                             font->sdf_spread,
+                                                             font->sdf_supersample,
+                                                             font->sdf_filter);
+                }
+                if (ret != FTGL_NO_ERROR) {
+                        FTGL_FREE(buffer);
+                        return ret;
+                }
+        }
 
-                        /* Middle pixels have all neighbors */
-                        for(x=1; x<w-1; x++, i++) {
-                                olddist = dist[i];
-                                if(olddist <= 0) continue; // No need to update further
+        raster->width = tgt_w;
+        raster->height = tgt_h;
+        raster->offset_x = left;
+        raster->offset_y = top;
+        raster->advance_x = ftgl_F26Dot6_to_float(slot->advance.x);
+        raster->advance_y = ftgl_F26Dot6_to_float(slot->advance.y);
+        raster->buffer = buffer;
+        return FTGL_NO_ERROR;
+}
 
-                                c = i+offset_l;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx+1;
-                                newdisty = cdisty;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+/**
+ * Renders @codepoint with @face into @raster, applying the font's
+ * render mode. Only touches @face and @sdf, so it may run on any
+ * thread that owns both. @raster's buffer is left NULL on failure.
+ */
+static ftgl_return_t ftgl_font_rasterize(ftgl_font_t font, FT_Face face, ftgl_sdf_t sdf,
+                                         uint32_t codepoint, struct ftgl_raster_t *raster)
+{
+        FT_GlyphSlot slot;
+        size_t i, src_w, src_h, tgt_w, tgt_h;
+        unsigned char *buffer, *dst_ptr, *src_ptr;
+        ftgl_return_t ret;
 
-                                c = i+offset_lu;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx+1;
-                                newdisty = cdisty+1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        ivec4_t padding = ll_ivec4_create4i( FTGL_GLYPH_OFFSET,
+                                             FTGL_GLYPH_OFFSET,
+                                             FTGL_GLYPH_OFFSET,
+                                             FTGL_GLYPH_OFFSET);
 
-                                c = i+offset_u;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx;
-                                newdisty = cdisty+1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        raster->codepoint = codepoint;
+        raster->buffer = NULL;
 
-                                c = i+offset_ur;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx-1;
-                                newdisty = cdisty+1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
-                        }
+        // The atlas has to be RGB before the first glyph goes in
+        if ((font->rendermode == FTGL_RENDERMODE_MSDF) != (font->atlas->depth == 3)) {
+                FTGL_LOG_MESSAGE("Change render modes through ftgl_font_set_rendermode!");
+                return FTGL_ARGUMENT_ERROR;
+        }
 
-                        /* Rightmost pixel of row is special, has no right neighbors */
-                        olddist = dist[i];
+        if ((ret = ftgl_font_render(font, face, codepoint)) != FTGL_NO_ERROR) {
+                return ret;
+        }
 
-                        // If not already zero distance
-                        if(olddist > 0) {
-                                c = i+offset_l;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx+1;
-                                newdisty = cdisty;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        slot = face->glyph;
+        if (font->rendermode == FTGL_RENDERMODE_MSDF
+            || font->rendermode == FTGL_RENDERMODE_SDF_SUPERSAMPLED) {
+                return ftgl_font_rasterize_outline(font, slot, sdf, raster);
+        }
 
-                                c = i+offset_lu;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx+1;
-                                newdisty = cdisty+1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        src_w = slot->bitmap.width;
+        src_h = slot->bitmap.rows;
 
-                                c = i+offset_u;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx;
-                                newdisty = cdisty+1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
-                        }
+        tgt_w = src_w + padding.x + padding.z;
+        tgt_h = src_h + padding.y + padding.w;
 
-                        /* Move index to second rightmost pixel of current row. */
-                        /* Rightmost pixel is skipped, it has no right neighbor. */
-                        i = y*w + w-2;
+        buffer = FTGL_CALLOC(tgt_w * tgt_h, sizeof(*buffer));
+        if (!buffer) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
 
-                        /* scan left, propagate distance from right */
-                        for(x=w-2; x>=0; x--, i--) {
-                                olddist = dist[i];
-                                if(olddist <= 0) continue; // Already zero distance
+        dst_ptr = buffer + (padding.x * tgt_w + padding.w);
+        src_ptr = slot->bitmap.buffer;
+        for (i = 0; i < src_h; i++) {
+                memcpy(dst_ptr, src_ptr, slot->bitmap.width);
+                dst_ptr += tgt_w;
+                src_ptr += slot->bitmap.pitch;
+        }
 
-                                c = i+offset_r;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx-1;
-                                newdisty = cdisty;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
+        ret = FTGL_NO_ERROR;
+        if (font->rendermode == FTGL_RENDERMODE_SDF) {
+                ret = ftgl_distance_mapf(sdf, buffer, buffer, tgt_w, tgt_h);
+        } else if (font->rendermode == FTGL_RENDERMODE_SDF_EDT) {
+                ret = ftgl_distance_map_edt(sdf, buffer, buffer, tgt_w, tgt_h);
+        }
+
+        if (ret != FTGL_NO_ERROR) {
+                FTGL_FREE(buffer);
+                return ret;
+        }
+
+        raster->width = tgt_w;
+        raster->height = tgt_h;
+        raster->offset_x = slot->bitmap_left;
+        raster->offset_y = slot->bitmap_top;
+        raster->advance_x = ftgl_F26Dot6_to_float(slot->advance.x);
+        raster->advance_y = ftgl_F26Dot6_to_float(slot->advance.y);
+        raster->buffer = buffer;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Finds room for @raster in the atlas, evicting glyphs if the font
+ * allows it, then records the glyph and writes its pixels. Fills in
+ * the placeholder if the codepoint was requested asynchronously, or
+ * drops it when there is no room so the next request queues it again.
+ */
+static ftgl_glyph_t ftgl_font_commit(ftgl_font_t font, struct ftgl_raster_t *raster)
+{
+        ftgl_glyph_t glyph;
+        ivec4_t glyph_bbox;
+        GLuint glyph_page;
+        ftgl_return_t ret;
+        int fragmented;
+
+        glyph = ftgl_glyphmap_find_glyph(font->glyphmap, raster->codepoint);
+        if (glyph && !(glyph->flags & FTGL_GLYPH_PENDING)) {
+                return glyph;
+        }
+
+        // Reserve an extra texel so neighbouring glyphs never touch
+        fragmented = 0;
+        for (;;) {
+                ret = ftgl_atlas_insert(font->atlas, raster->width + FTGL_GLYPH_OFFSET,
+                                        raster->height + FTGL_GLYPH_OFFSET, &glyph_bbox,
+                                        &glyph_page);
+                if (ret != FTGL_ATLAS_FULL_ERROR || !font->eviction) break;
+
+                // Defragment the space released so far before evicting more.
+                // Only the owner of the atlas knows every glyph in it.
+                if (fragmented && font->atlas->refcount == 1) {
+                        if ((ret = ftgl_font_rebuild_atlas(font)) != FTGL_NO_ERROR) break;
+                        fragmented = 0;
+                        continue;
+                }
+
+                if ((ret = ftgl_font_evict_oldest(font)) != FTGL_NO_ERROR) break;
+                fragmented = 1;
+        }
+
+        if (ret != FTGL_NO_ERROR) {
+                FTGL_LOG_MESSAGE("Failed to find space in the font atlas!");
+                if (glyph) {
+                        ftgl_glyphmap_remove(font->glyphmap, raster->codepoint);
+                }
+                return NULL;
+        }
+
+        glyph_bbox.z = raster->width;
+        glyph_bbox.w = raster->height;
+        glyph = ftgl_glyphmap_insert(font->glyphmap, raster->codepoint, glyph_page,
+                                     glyph_bbox, raster->offset_x, raster->offset_y,
+                                     raster->advance_x, raster->advance_y);
+        if (!glyph) {
+                FTGL_LOG_MESSAGE("Failed to insert glyph!");
+                ftgl_atlas_release(font->atlas, glyph_page,
+                                   ll_ivec4_create4i(glyph_bbox.x, glyph_bbox.y,
+                                                     raster->width + FTGL_GLYPH_OFFSET,
+                                                     raster->height + FTGL_GLYPH_OFFSET));
+                return NULL;
+        }
+
+        if (glyph->flags & FTGL_GLYPH_PENDING) {
+                glyph->bbox = glyph_bbox;
+                glyph->page = glyph_page;
+                glyph->offset_x = raster->offset_x;
+                glyph->offset_y = raster->offset_y;
+                glyph->advance_x = raster->advance_x;
+                glyph->advance_y = raster->advance_y;
+                glyph->flags &= ~FTGL_GLYPH_PENDING;
+        }
+        glyph->generation = font->generation;
+
+        ftgl_atlas_write(font->atlas, glyph_page, glyph_bbox, raster->buffer);
+        return glyph;
+}
+
+FTGLDEF ftgl_glyph_t ftgl_font_load_codepoint(ftgl_font_t font, uint32_t codepoint)
+{
+        ftgl_glyph_t glyph;
+        struct ftgl_raster_t raster;
+
+        // A placeholder is rendered right away, its queued request is dropped later
+        glyph = ftgl_glyphmap_find_glyph(font->glyphmap, codepoint);
+        if (glyph && !(glyph->flags & FTGL_GLYPH_PENDING)) {
+                glyph->generation = font->generation;
+                return glyph;
+        }
+
+        if (ftgl_font_rasterize(font, ftgl_font_face(font), font->sdf, codepoint, &raster) != FTGL_NO_ERROR) {
+                return NULL;
+        }
+
+        glyph = ftgl_font_commit(font, &raster);
+        FTGL_FREE(raster.buffer);
+        return glyph;
+}
+
+/**
+ * Rasterizes @count codepoints, spreading them over the font's worker
+ * threads when it has any.
+ */
+static void ftgl_font_rasterize_batch(ftgl_font_t font, const uint32_t *codepoints,
+                                      struct ftgl_raster_t *rasters, size_t count)
+{
+        size_t i;
+#ifndef FTGL_NO_THREADS
+        if (font->pool) {
+                ftgl_pool_rasterize(font->pool, font, codepoints, rasters, count);
+                return;
+        }
+#endif /* FTGL_NO_THREADS */
+        for (i = 0; i < count; i++) {
+                ftgl_font_rasterize(font, ftgl_font_face(font), font->sdf, codepoints[i], &rasters[i]);
+        }
+}
+
+static int ftgl_codepoint_compare(const void *a, const void *b)
+{
+        uint32_t x, y;
+        x = *(const uint32_t *) a;
+        y = *(const uint32_t *) b;
+        return (x > y) - (x < y);
+}
+
+static int ftgl_raster_compare(const void *a, const void *b)
+{
+        const struct ftgl_raster_t *x, *y;
+        x = a;
+        y = b;
+        // Tallest first, the packers waste the least space that way
+        if (x->height != y->height) {
+                return y->height - x->height;
+        }
+        return y->width - x->width;
+}
+
+/**
+ * Commits @count rasters tallest first with a single upload at the end,
+ * taking ownership of their buffers. Returns how many were committed,
+ * those come first in @rasters and the ones that found no room after.
+ */
+static size_t ftgl_font_commit_batch(ftgl_font_t font, struct ftgl_raster_t *rasters,
+                                     size_t count)
+{
+        size_t i, committed;
+        int flags;
+        struct ftgl_raster_t raster;
+        ftgl_glyph_t glyph;
+
+        qsort(rasters, count, sizeof(*rasters), ftgl_raster_compare);
+
+        flags = font->atlas->flags;
+        font->atlas->flags |= FTGL_ATLAS_DEFERRED;
+        committed = 0;
+        for (i = 0; i < count; i++) {
+                glyph = ftgl_font_commit(font, &rasters[i]);
+                FTGL_FREE(rasters[i].buffer);
+                if (!glyph) continue;
+
+                raster = rasters[i];
+                rasters[i] = rasters[committed];
+                rasters[committed++] = raster;
+        }
+
+        font->atlas->flags = flags;
+        if (!(flags & FTGL_ATLAS_DEFERRED)) {
+                ftgl_atlas_flush(font->atlas);
+        }
+        return committed;
+}
+
+FTGLDEF ftgl_return_t ftgl_font_load_codepoints(ftgl_font_t font, const uint32_t *codepoints,
+                                                size_t count)
+{
+        size_t i, j, batch, nrasters, n;
+        uint32_t *pending;
+        struct ftgl_raster_t *rasters;
+        ftgl_return_t ret;
+
+        if (count == 0) {
+                return FTGL_NO_ERROR;
+        }
+
+        pending = FTGL_MALLOC(sizeof(*pending) * count);
+        if (!pending) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        memcpy(pending, codepoints, sizeof(*pending) * count);
+        qsort(pending, count, sizeof(*pending), ftgl_codepoint_compare);
+
+        // Drop duplicates and codepoints that are already resident
+        for (i = 0, j = 0; i < count; i++) {
+                if (j > 0 && pending[j - 1] == pending[i]) continue;
+                if (ftgl_font_lookup(font, pending[i])) continue;
+                pending[j++] = pending[i];
+        }
+        count = j;
+
+        batch = count < FTGL_FONT_LOAD_BATCH ? count : FTGL_FONT_LOAD_BATCH;
+        rasters = FTGL_MALLOC(sizeof(*rasters) * (batch ? batch : 1));
+        if (!rasters) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                FTGL_FREE(pending);
+                return FTGL_MEMORY_ERROR;
+        }
+
+        ret = FTGL_NO_ERROR;
+        for (i = 0; i < count; i += batch) {
+                n = count - i < batch ? count - i : batch;
+                ftgl_font_rasterize_batch(font, pending + i, rasters, n);
+
+                // Keep the glyphs that rendered
+                for (j = 0, nrasters = 0; j < n; j++) {
+                        if (!rasters[j].buffer) {
+                                ret = FTGL_FREETYPE_ERROR;
+                                continue;
                         }
+                        rasters[nrasters++] = rasters[j];
                 }
 
-                /* Scan rows in reverse order, except last row */
-                for(y=h-2; y>=0; y--) {
-                        /* move index to rightmost pixel of current row */
-                        i = y*w + w-1;
+                if (ftgl_font_commit_batch(font, rasters, nrasters) < nrasters) {
+                        ret = FTGL_ATLAS_FULL_ERROR;
+                }
+        }
 
-                        /* Scan left, propagate distances from below & right */
+        FTGL_FREE(rasters);
+        FTGL_FREE(pending);
+        return ret;
+}
 
-                        /* Rightmost pixel is special, has no right neighbors */
-                        olddist = dist[i];
+FTGLDEF ftgl_return_t ftgl_font_load_range(ftgl_font_t font, uint32_t first, uint32_t last)
+{
+        size_t i, count;
+        uint32_t *codepoints;
+        ftgl_return_t ret;
 
-                        // If not already zero distance
-                        if(olddist > 0) {
-                                c = i+offset_d;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx;
-                                newdisty = cdisty-1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        if (last < first) {
+                FTGL_LOG_MESSAGE("Invalid codepoint range!");
+                return FTGL_ARGUMENT_ERROR;
+        }
 
-                                c = i+offset_dl;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx+1;
-                                newdisty = cdisty-1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
-                        }
-                        i--;
+        count = (size_t) last - first + 1;
+        codepoints = FTGL_MALLOC(sizeof(*codepoints) * count);
+        if (!codepoints) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
 
-                        /* Middle pixels have all neighbors */
-                        for(x=w-2; x>0; x--, i--) {
-                                olddist = dist[i];
-                                if(olddist <= 0) continue; // Already zero distance
+        for (i = 0; i < count; i++) {
+                codepoints[i] = first + i;
+        }
 
-                                c = i+offset_r;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx-1;
-                                newdisty = cdisty;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        ret = ftgl_font_load_codepoints(font, codepoints, count);
+        FTGL_FREE(codepoints);
+        return ret;
+}
 
-                                c = i+offset_rd;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx-1;
-                                newdisty = cdisty-1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+FTGLDEF ftgl_return_t ftgl_font_load_utf8(ftgl_font_t font, const char *text, size_t len)
+{
+        size_t count;
+        uint32_t *codepoints;
+        ftgl_return_t ret;
 
-                                c = i+offset_d;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx;
-                                newdisty = cdisty-1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        codepoints = FTGL_MALLOC(sizeof(*codepoints) * (len ? len : 1));
+        if (!codepoints) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
 
-                                c = i+offset_dl;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx+1;
-                                newdisty = cdisty-1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
-                        }
-                        /* Leftmost pixel is special, has no left neighbors */
-                        olddist = dist[i];
+        count = ftgl_utf8_decode_string(text, len, codepoints);
+        ret = ftgl_font_load_codepoints(font, codepoints, count);
+        FTGL_FREE(codepoints);
+        return ret;
+}
 
-                        // If not already zero distance
-                        if(olddist > 0) {
-                                c = i+offset_r;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx-1;
-                                newdisty = cdisty;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+/**
+ * Returns the glyph for @codepoint, or a placeholder with its advance
+ * while a worker rasterizes it. The first request starts one worker
+ * unless ftgl_font_set_threads already added some.
+ */
+FTGLDEF ftgl_glyph_t ftgl_font_request_glyph(ftgl_font_t font, uint32_t codepoint)
+{
+#ifndef FTGL_NO_THREADS
+        ftgl_glyph_t glyph;
+        struct ftgl_pool_t *pool;
+        uint32_t *requests;
+        FT_Fixed advance;
+        FT_UInt index;
 
-                                c = i+offset_rd;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx-1;
-                                newdisty = cdisty-1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        olddist=newdist;
-                                        changed = 1;
-                                }
+        if ((glyph = ftgl_font_lookup(font, codepoint)) != NULL) {
+                return glyph;
+        }
 
-                                c = i+offset_d;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx;
-                                newdisty = cdisty-1;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
-                        }
+        if (!font->face) {
+                FTGL_LOG_MESSAGE("Bind a font before requesting glyphs!");
+                return NULL;
+        }
 
-                        /* Move index to second leftmost pixel of current row. */
-                        /* Leftmost pixel is skipped, it has no left neighbor. */
-                        i = y*w + 1;
-                        for(x=1; x<w; x++, i++) {
-                                /* scan right, propagate distance from left */
-                                olddist = dist[i];
-                                if(olddist <= 0) continue; // Already zero distance
+        // Requests never rasterize on the calling thread
+        if (!font->pool && ftgl_pool_create(&font->pool, font, 1) != FTGL_NO_ERROR) {
+                return NULL;
+        }
+        pool = font->pool;
+
+        // Far cheaper than a render, and lets text lay out correctly meanwhile.
+        // Hinted advances go through the glyph loader, so the face's
+        // transform is applied and the result is in 16.16 pixels.
+        index = codepoint & FTGL_GLYPH_INDEX ? codepoint & ~FTGL_GLYPH_INDEX
+                : FT_Get_Char_Index(font->face, codepoint);
+        if (FT_Get_Advance(ftgl_font_face(font), index, FT_LOAD_DEFAULT, &advance) != FT_Err_Ok) {
+                advance = 0;
+        }
 
-                                c = i+offset_l;
-                                cdistx = distx[c];
-                                cdisty = disty[c];
-                                newdistx = cdistx+1;
-                                newdisty = cdisty;
-                                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                                if(newdist < olddist-epsilon) {
-                                        distx[i]=newdistx;
-                                        disty[i]=newdisty;
-                                        dist[i]=newdist;
-                                        changed = 1;
-                                }
+        glyph = ftgl_glyphmap_insert(font->glyphmap, codepoint, 0,
+                                     ll_ivec4_create4i(0, 0, 0, 0), 0, 0,
+                                     advance / 65536.0f, 0.0f);
+        if (!glyph) {
+                FTGL_LOG_MESSAGE("Failed to insert glyph!");
+                return NULL;
+        }
+        glyph->flags = FTGL_GLYPH_PENDING;
+        glyph->generation = font->generation;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->nrequests == pool->requests_capacity) {
+                requests = FTGL_REALLOC(pool->requests,
+                                        sizeof(*requests) * pool->requests_capacity * 2);
+                if (!requests) {
+                        pthread_mutex_unlock(&pool->lock);
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        ftgl_glyphmap_remove(font->glyphmap, codepoint);
+                        return NULL;
+                }
+                pool->requests = requests;
+                pool->requests_capacity *= 2;
+        }
+        pool->requests[pool->nrequests++] = codepoint;
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        return glyph;
+#else /* defined(FTGL_NO_THREADS) */
+        return ftgl_font_load_codepoint(font, codepoint);
+#endif /* FTGL_NO_THREADS */
+}
+
+/**
+ * Packs and uploads up to @max glyphs the workers have finished, or
+ * all of them when @max is 0, and returns how many made it into the
+ * atlas.
+ * Never waits for the workers.
+ */
+FTGLDEF size_t ftgl_font_poll(ftgl_font_t font, size_t max)
+{
+#ifndef FTGL_NO_THREADS
+        size_t i, n, count, taken, committed;
+        struct ftgl_pool_t *pool;
+        struct ftgl_raster_t rasters[FTGL_FONT_POLL_BATCH];
+        ftgl_glyph_t glyph;
+
+        if (!(pool = font->pool)) {
+                return 0;
+        }
+
+        taken = committed = 0;
+        pthread_mutex_lock(&pool->lock);
+        for (;;) {
+                n = pool->nresults;
+                if (n > FTGL_FONT_POLL_BATCH) n = FTGL_FONT_POLL_BATCH;
+                if (max > 0 && n > max - taken) n = max - taken;
+                if (n == 0) break;
+
+                memcpy(rasters, pool->results, sizeof(*rasters) * n);
+                memmove(pool->results, pool->results + n,
+                        sizeof(*rasters) * (pool->nresults - n));
+                pool->nresults -= n;
+                pthread_mutex_unlock(&pool->lock);
+
+                // Failed glyphs stay blank, but stop being placeholders
+                for (i = 0, count = 0; i < n; i++) {
+                        if (!rasters[i].buffer) {
+                                glyph = ftgl_glyphmap_find_glyph(font->glyphmap,
+                                                                 rasters[i].codepoint);
+                                if (glyph) glyph->flags &= ~FTGL_GLYPH_PENDING;
+                                continue;
                         }
+                        rasters[count++] = rasters[i];
                 }
+
+                // Placeholders that found no room are gone, see ftgl_font_commit
+                committed += ftgl_font_commit_batch(font, rasters, count);
+                taken += n;
+                pthread_mutex_lock(&pool->lock);
         }
-        while(changed); // Sweep until no more updates are made
+        pthread_mutex_unlock(&pool->lock);
+        return committed;
+#else /* defined(FTGL_NO_THREADS) */
+        (void) font;
+        (void) max;
+        return 0;
+#endif /* FTGL_NO_THREADS */
+}
 
-        /* The transformation is completed. */
+/**
+ * The start of an atlas cache file. Everything that changes the atlas
+ * a font would build is part of the key, a cache written with any other
+ * value for one of them is a miss. The fields are laid out so that no
+ * padding is ever added.
+ */
+struct ftgl_cache_header_t {
+        uint32_t magic;
+        uint32_t version;
+
+        /**
+         * FNV-1a hash of the font file.
+         */
+        uint64_t hash;
+
+        /**
+         * The number of bytes following the header.
+         */
+        uint64_t payload;
+
+        float size;
+        int32_t freetype;
+        int32_t rendermode;
+        int32_t sdf_spread;
+        int32_t sdf_supersample;
+        int32_t sdf_filter;
+        int32_t packmode;
+        int32_t width;
+        int32_t height;
+        int32_t depth;
+        int32_t glyph_offset;
+        uint32_t npages;
+        uint32_t nglyphs;
+        uint32_t reserved;
+};
+
+/**
+ * Every page is stored as this record, the packer's skyline or free
+ * rectangles, its rectangles released below the skyline and then the
+ * page's pixels.
+ */
+struct ftgl_cache_page_t {
+        uint64_t used;
+        uint32_t size;
+        uint32_t nfreed;
+};
+
+/**
+ * The glyphs follow the last page.
+ */
+struct ftgl_cache_glyph_t {
+        uint32_t codepoint;
+        uint32_t page;
+        int32_t bbox[4];
+        int32_t offset_x;
+        int32_t offset_y;
+        float advance_x;
+        float advance_y;
+};
+
+static uint64_t ftgl_cache_hash(const unsigned char *data, size_t size)
+{
+        uint64_t hash;
+        size_t i;
+
+        hash = 0xcbf29ce484222325ull;
+        for (i = 0; i < size; i++) {
+                hash = (hash ^ data[i]) * 0x100000001b3ull;
+        }
+        return hash;
 }
 
-FTGLDEF double * ftgl_distance_mapd(double *data, unsigned int width,
-                   unsigned int height)
+/* Fills in the key of the cache @font would write */
+static ftgl_return_t ftgl_cache_header(ftgl_font_t font, struct ftgl_cache_header_t *header)
 {
-        short *xdist = FTGL_MALLOC(width * height * sizeof(*xdist));
-        short *ydist = FTGL_MALLOC(width * height * sizeof(*ydist));
-        double *gx = FTGL_MALLOC(width * height * sizeof(*gx));
-        double *gy = FTGL_MALLOC(width * height * sizeof(*gy));
-        double *outside = FTGL_MALLOC(width * height * sizeof(*outside));
-        double *inside = FTGL_MALLOC(width * height * sizeof(*inside));
-        double vmin = DBL_MAX;
-        unsigned int i;
+        if (!font->source || font->size == 0.0) {
+                FTGL_LOG_MESSAGE("Bind a font and set its size before caching it!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        memset(header, 0, sizeof(*header));
+        header->hash = ftgl_cache_hash(font->source->data, font->source->size);
+        header->magic = FTGL_CACHE_MAGIC;
+        header->version = FTGL_CACHE_VERSION;
+        header->size = font->size;
+        header->freetype = FREETYPE_MAJOR * 10000 + FREETYPE_MINOR * 100 + FREETYPE_PATCH;
+        header->rendermode = font->rendermode;
+        header->sdf_spread = font->sdf_spread;
+        header->sdf_supersample = font->sdf_supersample;
+        header->sdf_filter = font->sdf_filter;
+        header->packmode = font->atlas->packmode;
+        header->width = font->atlas->width;
+        header->height = font->atlas->height;
+        header->depth = font->atlas->depth;
+        header->glyph_offset = FTGL_GLYPH_OFFSET;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Writes the atlas of @font and every glyph in it to @path. The file
+ * is written next to @path and renamed over it once complete, so a
+ * reader never sees half of it.
+ */
+FTGLDEF ftgl_return_t ftgl_font_cache_save(ftgl_font_t font, const char *path)
+{
+        struct ftgl_cache_header_t header;
+        struct ftgl_cache_page_t record;
+        struct ftgl_cache_glyph_t entry;
+        struct ftgl_atlas_page_t *page;
+        ftgl_glyph_t glyph;
+        ftgl_return_t ret;
+        size_t i, len, pixels;
+        char *tmp;
+        FILE *file;
+        int ok;
 
-        // Compute outside = edtaa3(bitmap); % Transform background (0's)
-        ftgl_computegradient(data, width, height, gx, gy);
-        ftgl_edtaa3(data, gx, gy, width, height, xdist, ydist, outside);
-        for (i = 0; i < width * height; i++) {
-                if (outside[i] < 0.0) outside[i] = 0.0;
+        if ((ret = ftgl_cache_header(font, &header)) != FTGL_NO_ERROR) {
+                return ret;
         }
 
-        // Compute inside = ftgl_edtaa3(1 - bitmap); % Transform background (1's)
-        memset(gx, 0, sizeof(*gx)*width*height);
-        memset(gy, 0, sizeof(*gy)*width*height);
-        for (i = 0; i < width * height; i++) {
-                data[i] = 1 - data[i];
+        // Placeholders have nothing in the atlas yet, so they stay out
+        pixels = (size_t) font->atlas->width * font->atlas->height * font->atlas->depth;
+        header.npages = font->atlas->size;
+        for (i = 0; i < font->atlas->size; i++) {
+                page = &font->atlas->pages[i];
+                header.payload += sizeof(record) + pixels
+                        + (page->packer->size + page->packer->nfreed) * sizeof(ivec4_t);
+        }
+        for (i = 0; i < font->glyphmap->top; i++) {
+                glyph = ftgl_glyphmap_glyph(font->glyphmap, i);
+                if (glyph->codepoint == FTGL_FONT_GLYPHMAP_EMPTY) continue;
+                if (glyph->flags & FTGL_GLYPH_PENDING) continue;
+                header.nglyphs++;
         }
+        header.payload += header.nglyphs * sizeof(entry);
 
-        ftgl_computegradient(data, width, height, gx, gy);
-        ftgl_edtaa3(data, gx, gy, width, height, xdist, ydist, inside);
-        for (i = 0; i < width * height; i++) {
-                if (inside[i] < 0.0) {
-                        inside[i] =  0.0;
-                }
+        len = strlen(path);
+        tmp = FTGL_MALLOC(len + sizeof(".tmp"));
+        if (!tmp) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
         }
+        memcpy(tmp, path, len);
+        memcpy(tmp + len, ".tmp", sizeof(".tmp"));
 
-        // distmap = outside - inside % Bipolar distance field
-        for (i = 0; i < width * height; i++) {
-                outside[i] -= inside[i];
-                if (outside[i] < vmin) {
-                        vmin = outside[i];
-                }
+        if (!(file = fopen(tmp, "wb"))) {
+                FTGL_LOG_MESSAGE("Failed to open '%s'!", tmp);
+                FTGL_FREE(tmp);
+                return FTGL_IO_ERROR;
         }
 
-        vmin = fabs(vmin);
+        ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (i = 0; ok && i < font->atlas->size; i++) {
+                page = &font->atlas->pages[i];
+                record.used = page->packer->used;
+                record.size = page->packer->size;
+                record.nfreed = page->packer->nfreed;
+                ok = fwrite(&record, sizeof(record), 1, file) == 1
+                        && fwrite(page->packer->nodes, sizeof(ivec4_t), record.size, file)
+                        == record.size
+                        && (record.nfreed == 0
+                            || fwrite(page->packer->freed, sizeof(ivec4_t), record.nfreed, file)
+                            == record.nfreed)
+                        && fwrite(page->pixels, 1, pixels, file) == pixels;
+        }
 
-        for (i = 0; i < width * height; i++) {
-                double v = outside[i];
-                if (v < -vmin) outside[i] = -vmin;
-                else if (v > +vmin) outside[i] = +vmin;
-                data[i] = (outside[i] + vmin) / (2 * vmin);
+        for (i = 0; ok && i < font->glyphmap->top; i++) {
+                glyph = ftgl_glyphmap_glyph(font->glyphmap, i);
+                if (glyph->codepoint == FTGL_FONT_GLYPHMAP_EMPTY) continue;
+                if (glyph->flags & FTGL_GLYPH_PENDING) continue;
+                entry.codepoint = glyph->codepoint;
+                entry.page = glyph->page;
+                entry.bbox[0] = glyph->bbox.x;
+                entry.bbox[1] = glyph->bbox.y;
+                entry.bbox[2] = glyph->bbox.z;
+                entry.bbox[3] = glyph->bbox.w;
+                entry.offset_x = glyph->offset_x;
+                entry.offset_y = glyph->offset_y;
+                entry.advance_x = glyph->advance_x;
+                entry.advance_y = glyph->advance_y;
+                ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
         }
 
-        FTGL_FREE(xdist);
-        FTGL_FREE(ydist);
-        FTGL_FREE(gx);
-        FTGL_FREE(gy);
-        FTGL_FREE(outside);
-        FTGL_FREE(inside);
-        return data;
+        if (fclose(file) != 0) ok = 0;
+        if (!ok || rename(tmp, path) != 0) {
+                FTGL_LOG_MESSAGE("Failed to write '%s'!", path);
+                remove(tmp);
+                FTGL_FREE(tmp);
+                return FTGL_IO_ERROR;
+        }
+
+        FTGL_FREE(tmp);
+        return FTGL_NO_ERROR;
 }
 
-FTGLDEF unsigned char *ftgl_distance_mapb(unsigned char *img, unsigned int width,
-                   unsigned int height)
+static int ftgl_cache_rect_valid(const ivec4_t *rect, int width, int height)
 {
-        double *data = FTGL_CALLOC(width * height, sizeof(*data));
-        unsigned char *out = FTGL_MALLOC(width * height * sizeof(*out));
-        unsigned int i;
+        return rect->x >= 0 && rect->y >= 0 && rect->z >= 0 && rect->w >= 0
+                && rect->x <= width - rect->z && rect->y <= height - rect->w;
+}
 
-        // find minimum and maximum values
-        double img_min = DBL_MAX;
-        double img_max = DBL_MIN;
+/**
+ * Checks every page record of a cache payload before anything is
+ * restored from it. Returns the offset of the first glyph, or 0 when
+ * a record points past the payload or outside its page.
+ */
+static size_t ftgl_cache_validate(const struct ftgl_cache_header_t *header,
+                                  const unsigned char *payload)
+{
+        struct ftgl_cache_page_t record;
+        struct ftgl_cache_glyph_t entry;
+        ivec4_t rect;
+        size_t i, j, offset, pixels;
+
+        pixels = (size_t) header->width * header->height * header->depth;
+        offset = 0;
+        for (i = 0; i < header->npages; i++) {
+                if (header->payload - offset < sizeof(record)) return 0;
+                memcpy(&record, payload + offset, sizeof(record));
+                offset += sizeof(record);
+                if ((header->payload - offset) / sizeof(ivec4_t) < (uint64_t) record.size + record.nfreed
+                    || record.size == 0) return 0;
+
+                for (j = 0; j < (size_t) record.size + record.nfreed; j++) {
+                        memcpy(&rect, payload + offset, sizeof(rect));
+                        offset += sizeof(rect);
+                        if (!ftgl_cache_rect_valid(&rect, header->width, header->height)) return 0;
+                }
 
-        for (i = 0; i < width * height; i++) {
-                double v = img[i];
-                data[i] = v;
-                if (v > img_max) img_max = v;
-                if (v < img_min) img_min = v;
+                if (header->payload - offset < pixels) return 0;
+                offset += pixels;
         }
 
-        // Map values from 0 - 255 to 0.0 - 1.0
-        for (i = 0; i < width * height; i++)
-                data[i] = (img[i]-img_min)/img_max;
+        if ((header->payload - offset) / sizeof(entry) != header->nglyphs
+            || (header->payload - offset) % sizeof(entry) != 0) return 0;
 
-        data = ftgl_distance_mapd(data, width, height);
+        for (i = 0, j = offset; i < header->nglyphs; i++, j += sizeof(entry)) {
+                memcpy(&entry, payload + j, sizeof(entry));
+                rect = ll_ivec4_create4i(entry.bbox[0], entry.bbox[1],
+                                         entry.bbox[2], entry.bbox[3]);
+                if (entry.page >= header->npages
+                    || entry.codepoint == FTGL_FONT_GLYPHMAP_EMPTY
+                    || !ftgl_cache_rect_valid(&rect, header->width, header->height)) return 0;
+        }
+        return offset;
+}
 
-        for (i = 0; i < width * height; i++)
-                out[i] = (unsigned char)(255 * (1  - data[i]));
+/* Makes room for @count rectangles in @rects */
+static ftgl_return_t ftgl_cache_reserve_rects(ivec4_t **rects, size_t *capacity, size_t count)
+{
+        ivec4_t *new_rects;
 
-        FTGL_FREE(data);
-        return out;
+        if (count <= *capacity) {
+                return FTGL_NO_ERROR;
+        }
+
+        new_rects = FTGL_REALLOC(*rects, sizeof(*new_rects) * count);
+        if (!new_rects) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        *rects = new_rects;
+        *capacity = count;
+        return FTGL_NO_ERROR;
 }
 
-FTGLDEF ftgl_glyph_t ftgl_font_load_codepoint(ftgl_font_t font, uint32_t codepoint)
+/**
+ * Restores the atlas and the glyphs of @font from a cache written by
+ * ftgl_font_cache_save, with a single read of @path. Any glyph missing
+ * from it is rasterized as usual when first loaded, packed around the
+ * cached ones. Returns FTGL_CACHE_MISS_ERROR, leaving @font untouched,
+ * when there is no cache or it was written for another font file,
+ * size, render mode or packer.
+ */
+FTGLDEF ftgl_return_t ftgl_font_cache_load(ftgl_font_t font, const char *path)
 {
-        FT_Error ft_error;
-        FT_GlyphSlot slot;
+        struct ftgl_cache_header_t header, expected;
+        struct ftgl_cache_page_t record;
+        struct ftgl_cache_glyph_t entry;
+        struct ftgl_atlas_page_t *page;
+        ftgl_packer_t packer;
         ftgl_glyph_t glyph;
-        ivec4_t glyph_bbox;
-        size_t src_w, src_h, tgt_w, tgt_h;
+        ftgl_return_t ret;
+        unsigned char *payload;
+        size_t i, offset, pixels;
+        long length;
+        FILE *file;
 
-#define FTGL_GLYPH_OFFSET (1)
-        ivec4_t padding = ll_ivec4_create4i( FTGL_GLYPH_OFFSET,
-                                             FTGL_GLYPH_OFFSET,
-                                             FTGL_GLYPH_OFFSET,
-                                             FTGL_GLYPH_OFFSET);
+        if (font->glyphmap->size > 0) {
+                FTGL_LOG_MESSAGE("Can't load a cache once glyphs are loaded!");
+                return FTGL_ARGUMENT_ERROR;
+        }
 
-        if ((glyph = ftgl_glyphmap_find_glyph(font->glyphmap, codepoint)) != NULL) {
-                return glyph;
+        if (font->atlas->refcount > 1) {
+                FTGL_LOG_MESSAGE("Can't load a cache into a shared atlas!");
+                return FTGL_ARGUMENT_ERROR;
         }
 
-        ft_error = FT_Load_Char(font->face, codepoint, FT_LOAD_RENDER);
-        if (ft_error != FT_Err_Ok) {
-                FTGL_LOG_MESSAGE("Failed to load codepoint!");
-                return NULL;
+        if ((ret = ftgl_cache_header(font, &expected)) != FTGL_NO_ERROR) {
+                return ret;
         }
 
-        slot = font->face->glyph;
+        if (!(file = fopen(path, "rb"))) {
+                return FTGL_CACHE_MISS_ERROR;
+        }
 
-        if (font->tbox.x + slot->bitmap.width >= FTGL_FONT_ATLAS_WIDTH) {
-                font->tbox.y += font->tbox_yjump + FTGL_GLYPH_OFFSET;
-                font->tbox.x = FTGL_GLYPH_OFFSET;
-                font->tbox_yjump = 0;
+        if (fread(&header, sizeof(header), 1, file) != 1) {
+                fclose(file);
+                return FTGL_CACHE_MISS_ERROR;
         }
 
-        src_w = slot->bitmap.width;
-        src_h = slot->bitmap.rows;
+        // Everything but the payload size has to match exactly
+        expected.payload = header.payload;
+        expected.npages = header.npages;
+        expected.nglyphs = header.nglyphs;
+        if (memcmp(&header, &expected, sizeof(header)) != 0
+            || header.npages == 0
+            || (font->atlas->max_pages > 0 && header.npages > font->atlas->max_pages)
+            || fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < 0
+            || (uint64_t) length != sizeof(header) + header.payload
+            || fseek(file, sizeof(header), SEEK_SET) != 0) {
+                fclose(file);
+                return FTGL_CACHE_MISS_ERROR;
+        }
 
-        tgt_w = src_w + padding.x + padding.z;
-        tgt_h = src_h + padding.y + padding.w;
+        payload = FTGL_MALLOC(header.payload);
+        if (!payload) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                fclose(file);
+                return FTGL_MEMORY_ERROR;
+        }
 
-        if (font->tbox.y + tgt_h >= FTGL_FONT_ATLAS_HEIGHT) {
-                FTGL_LOG_MESSAGE("Font atlas is full!");
-                return NULL;
+        if (fread(payload, 1, header.payload, file) != header.payload
+            || (offset = ftgl_cache_validate(&header, payload)) == 0) {
+                FTGL_FREE(payload);
+                fclose(file);
+                return FTGL_CACHE_MISS_ERROR;
         }
+        fclose(file);
 
-        glyph_bbox = ll_ivec4_create4i(font->tbox.x, font->tbox.y,
-                                       tgt_w, tgt_h);
-        if (ftgl_glyphmap_insert(font->glyphmap, codepoint, glyph_bbox,
-                                 slot->bitmap_left, slot->bitmap_top,
-                                 ftgl_F26Dot6_to_float(slot->advance.x),
-                                 ftgl_F26Dot6_to_float(slot->advance.y)) != FTGL_NO_ERROR) {
-                FTGL_LOG_MESSAGE("Failed to insert glyph!");
+        while (font->atlas->size < header.npages) {
+                if ((ret = ftgl_atlas_add_page(font->atlas)) != FTGL_NO_ERROR) {
+                        FTGL_FREE(payload);
+                        return ret;
+                }
+        }
+
+        pixels = (size_t) header.width * header.height * header.depth;
+        offset = 0;
+        for (i = 0; i < header.npages; i++) {
+                page = &font->atlas->pages[i];
+                packer = page->packer;
+                memcpy(&record, payload + offset, sizeof(record));
+                offset += sizeof(record);
+                if ((ret = ftgl_cache_reserve_rects(&packer->nodes, &packer->capacity,
+                                                    record.size)) != FTGL_NO_ERROR
+                    || (ret = ftgl_cache_reserve_rects(&packer->freed, &packer->freed_capacity,
+                                                       record.nfreed)) != FTGL_NO_ERROR) {
+                        ftgl_packer_clear(packer);
+                        FTGL_FREE(payload);
+                        return ret;
+                }
+
+                packer->used = record.used;
+                packer->size = record.size;
+                packer->nfreed = record.nfreed;
+                memcpy(packer->nodes, payload + offset, record.size * sizeof(ivec4_t));
+                offset += record.size * sizeof(ivec4_t);
+                if (record.nfreed > 0) {
+                        memcpy(packer->freed, payload + offset, record.nfreed * sizeof(ivec4_t));
+                        offset += record.nfreed * sizeof(ivec4_t);
+                }
+
+                memcpy(page->pixels, payload + offset, pixels);
+                offset += pixels;
+                page->ndirty = 0;
+                ftgl_atlas_page_mark_dirty(page, ll_ivec4_create4i(0, 0, header.width,
+                                                                   header.height));
+        }
+
+        for (i = 0; i < header.nglyphs; i++, offset += sizeof(entry)) {
+                memcpy(&entry, payload + offset, sizeof(entry));
+                glyph = ftgl_glyphmap_insert(font->glyphmap, entry.codepoint, entry.page,
+                                             ll_ivec4_create4i(entry.bbox[0], entry.bbox[1],
+                                                               entry.bbox[2], entry.bbox[3]),
+                                             entry.offset_x, entry.offset_y,
+                                             entry.advance_x, entry.advance_y);
+                if (!glyph) {
+                        FTGL_LOG_MESSAGE("Failed to insert glyph!");
+                        FTGL_FREE(payload);
+                        return FTGL_MEMORY_ERROR;
+                }
+                glyph->generation = font->generation;
+        }
+
+        FTGL_FREE(payload);
+        if (!(font->atlas->flags & FTGL_ATLAS_DEFERRED)) {
+                ftgl_atlas_flush(font->atlas);
+        }
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_glyph_t ftgl_font_find_glyph(ftgl_font_t font,
+                                          uint32_t codepoint)
+{
+        return ftgl_font_lookup(font, codepoint);
+}
+
+/* Allocates a run with room for @count glyphs, its text and features */
+static ftgl_run_t ftgl_run_create(size_t count, const char *text, size_t len,
+                                  const char *features)
+{
+        ftgl_run_t run;
+        size_t features_len;
+
+        features_len = strlen(features);
+        run = FTGL_MALLOC(sizeof(*run) + sizeof(*run->glyphs) * count + len + features_len + 1);
+        if (!run) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
                 return NULL;
         }
 
-        glyph = ftgl_glyphmap_find_glyph(font->glyphmap, codepoint);
+        run->glyphs = (struct ftgl_shaped_glyph_t *) (run + 1);
+        run->text = (char *) (run->glyphs + count);
+        run->features = run->text + len;
+        memcpy(run->text, text, len);
+        memcpy(run->features, features, features_len + 1);
+        run->len = len;
+        run->count = 0;
+        run->width = 0.0f;
+        run->height = 0.0f;
+        run->measured = 0;
+        run->pins = 0;
+        run->cached = 0;
+        return run;
+}
 
-        unsigned char *buffer = FTGL_CALLOC(tgt_w * tgt_h, sizeof(*buffer));
-        unsigned char *dst_ptr = buffer + (padding.x * tgt_w + padding.w);
-        unsigned char *src_ptr = slot->bitmap.buffer;
+#ifdef FTGL_USE_HARFBUZZ
+static ftgl_run_t ftgl_font_shape_harfbuzz(ftgl_font_t font, FT_Face face, const char *text,
+                                           size_t len, const char *features)
+{
+        hb_feature_t feature[FTGL_SHAPE_FEATURES];
+        hb_face_t *hb_face;
+        hb_buffer_t *buffer;
+        hb_glyph_info_t *infos;
+        hb_glyph_position_t *positions;
+        unsigned int i, count, nfeatures;
+        const char *p, *end;
+        ftgl_run_t run;
+
+        // HarfBuzz reads the face's tables itself, so the widened
+        // horizontal resolution of the face doesn't leak into positions
+        if (!font->hb_font) {
+                hb_face = hb_ft_face_create_referenced(face);
+                font->hb_font = hb_font_create(hb_face);
+                hb_face_destroy(hb_face);
+        }
+        hb_font_set_scale(font->hb_font, (int) (font->size * FTGL_FONT_HRESf),
+                          (int) (font->size * FTGL_FONT_HRESf));
+
+        for (p = features, nfeatures = 0; *p && nfeatures < FTGL_SHAPE_FEATURES; p = end) {
+                end = strchr(p, ',');
+                if (!end) end = p + strlen(p);
+                if (hb_feature_from_string(p, end - p, &feature[nfeatures])) {
+                        nfeatures++;
+                } else {
+                        FTGL_LOG_MESSAGE("Ignoring the unknown feature '%.*s'!", (int) (end - p), p);
+                }
+                if (*end == ',') end++;
+        }
 
-        for (size_t i = 0; i < src_h; i++) {
-                memcpy(dst_ptr, src_ptr, slot->bitmap.width);
-                dst_ptr += tgt_w;
-                src_ptr += slot->bitmap.pitch;
+        buffer = hb_buffer_create();
+        hb_buffer_add_utf8(buffer, text, len, 0, len);
+        hb_buffer_guess_segment_properties(buffer);
+        hb_shape(font->hb_font, buffer, feature, nfeatures);
+        infos = hb_buffer_get_glyph_infos(buffer, &count);
+        positions = hb_buffer_get_glyph_positions(buffer, &count);
+
+        run = ftgl_run_create(count, text, len, features);
+        if (run) {
+                for (i = 0; i < count; i++) {
+                        run->glyphs[i].key = infos[i].codepoint | FTGL_GLYPH_INDEX;
+                        run->glyphs[i].cluster = infos[i].cluster;
+                        run->glyphs[i].x_advance = ftgl_F26Dot6_to_float(positions[i].x_advance);
+                        run->glyphs[i].y_advance = ftgl_F26Dot6_to_float(positions[i].y_advance);
+                        run->glyphs[i].x_offset = ftgl_F26Dot6_to_float(positions[i].x_offset);
+                        run->glyphs[i].y_offset = ftgl_F26Dot6_to_float(positions[i].y_offset);
+                        run->width += run->glyphs[i].x_advance;
+                }
+                run->count = count;
         }
 
-        if (font->rendermode == FTGL_RENDERMODE_SDF) {
-                unsigned char *sdf = ftgl_distance_mapb(buffer, tgt_w, tgt_h);
-                FTGL_FREE(buffer);
-                buffer = sdf;
+        hb_buffer_destroy(buffer);
+        return run;
+}
+#else /* !defined(FTGL_USE_HARFBUZZ) */
+/**
+ * Shapes without HarfBuzz: one glyph per codepoint, keyed by the
+ * codepoint, with pair kerning from the face. Features are ignored.
+ */
+static ftgl_run_t ftgl_font_shape_kerning(ftgl_font_t font, FT_Face face, const char *text,
+                                          size_t len, const char *features)
+{
+        size_t i, advance;
+        uint32_t codepoint;
+        FT_UInt index, previous;
+        FT_Fixed glyph_advance;
+        FT_Vector kerning;
+        struct ftgl_shaped_glyph_t *glyph;
+        ftgl_run_t run;
+
+        // Never more codepoints than bytes
+        run = ftgl_run_create(len, text, len, features);
+        if (!run) return NULL;
+
+        previous = 0;
+        for (i = 0; i < len; i += advance) {
+                codepoint = ftgl_utf8_decode(text + i, len - i, &advance);
+                index = FT_Get_Char_Index(face, codepoint);
+                if (FT_Get_Advance(face, index, FT_LOAD_DEFAULT, &glyph_advance) != FT_Err_Ok) {
+                        glyph_advance = 0;
+                }
+
+                // Kerning is in the face's widened horizontal resolution
+                if (previous && index && FT_HAS_KERNING(face)
+                    && FT_Get_Kerning(face, previous, index, FT_KERNING_DEFAULT,
+                                      &kerning) == FT_Err_Ok) {
+                        run->glyphs[run->count - 1].x_advance += kerning.x / (FTGL_FONT_HRESf * FTGL_FONT_HRESf);
+                        run->width += kerning.x / (FTGL_FONT_HRESf * FTGL_FONT_HRESf);
+                }
+
+                glyph = &run->glyphs[run->count++];
+                glyph->key = codepoint;
+                glyph->cluster = i;
+                glyph->x_advance = glyph_advance / 65536.0f;
+                glyph->y_advance = 0.0f;
+                glyph->x_offset = 0.0f;
+                glyph->y_offset = 0.0f;
+                run->width += glyph->x_advance;
+                previous = index;
         }
+        return run;
+}
+#endif /* FTGL_USE_HARFBUZZ */
 
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glBindTexture(GL_TEXTURE_2D, font->texture);
+/* Moves @run to the front of @font's list of runs by use */
+static void ftgl_font_touch_run(ftgl_font_t font, ftgl_run_t run)
+{
+        run->generation = font->generation;
+        if (font->runs_newest == run) return;
+
+        if (run->newer) run->newer->older = run->older;
+        if (run->older) run->older->newer = run->newer;
+        if (font->runs_oldest == run) font->runs_oldest = run->newer;
+
+        run->newer = NULL;
+        run->older = font->runs_newest;
+        if (font->runs_newest) font->runs_newest->newer = run;
+        font->runs_newest = run;
+        if (!font->runs_oldest) font->runs_oldest = run;
+}
 
-        glTexSubImage2D(GL_TEXTURE_2D, 0, font->tbox.x,
-                        font->tbox.y, tgt_w, tgt_h,
-                        GL_RED, GL_UNSIGNED_BYTE,
-                        buffer);
-        FTGL_FREE(buffer);
+/**
+ * Takes @run out of @font's cache, and frees it unless a renderer
+ * still has it queued.
+ */
+static void ftgl_font_drop_run(ftgl_font_t font, ftgl_run_t run)
+{
+        if (run->prev) run->prev->next = run->next;
+        else font->runs[run->hash % FTGL_RUN_BUCKETS] = run->next;
+        if (run->next) run->next->prev = run->prev;
+
+        if (run->newer) run->newer->older = run->older;
+        else font->runs_newest = run->older;
+        if (run->older) run->older->newer = run->newer;
+        else font->runs_oldest = run->newer;
+
+        font->nruns--;
+        run->cached = 0;
+        if (run->pins == 0) {
+                FTGL_FREE(run);
+        }
+}
 
-        font->tbox.x += tgt_w + FTGL_GLYPH_OFFSET;
-        if (tgt_h > font->tbox_yjump) {
-                font->tbox_yjump = tgt_h;
+/* Releases a renderer's hold on @run */
+static void ftgl_run_unpin(ftgl_run_t run)
+{
+        if (--run->pins == 0 && !run->cached) {
+                FTGL_FREE(run);
         }
+}
 
-#undef FTGL_GLYPH_OFFSET
+/**
+ * Shapes @len bytes of UTF-8 as a single line, with HarfBuzz when
+ * built with FTGL_USE_HARFBUZZ, and caches the run under its text, the
+ * font's size and @features, a comma-separated list in HarfBuzz's
+ * syntax such as "kern,liga=0". Asking again returns the cached run.
+ * Without HarfBuzz only the face's pair kerning is applied and
+ * @features are ignored.
+ * Runs stay valid until the font moves on to the next frame, unless
+ * more than FTGL_RUN_CACHE_LIMIT runs are shaped in one frame, and are
+ * dropped when the font is bound again or freed.
+ */
+FTGLDEF ftgl_run_t ftgl_font_shape(ftgl_font_t font, const char *text, size_t len,
+                                   const char *features)
+{
+        ftgl_run_t run;
+        uint64_t hash;
+        uint32_t size_bits;
+        size_t bucket;
 
-        glBindTexture(GL_TEXTURE_2D, 0);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-        return glyph;
+        if (!font->face) {
+                FTGL_LOG_MESSAGE("Bind a font before shaping text!");
+                return NULL;
+        }
+
+#ifdef FTGL_USE_HARFBUZZ
+        features = features ? features : "";
+#else /* !defined(FTGL_USE_HARFBUZZ) */
+        // Features change nothing, so they don't tell runs apart
+        features = "";
+#endif /* FTGL_USE_HARFBUZZ */
+        memcpy(&size_bits, &font->size, sizeof(size_bits));
+        hash = ftgl_cache_hash((const unsigned char *) text, len);
+        hash = (hash ^ ftgl_cache_hash((const unsigned char *) features, strlen(features)))
+                * 0x100000001b3ull;
+        hash = (hash ^ size_bits) * 0x100000001b3ull;
+        bucket = hash % FTGL_RUN_BUCKETS;
+
+        for (run = font->runs[bucket]; run; run = run->next) {
+                if (run->hash == hash && run->size == font->size && run->len == len
+                    && memcmp(run->text, text, len) == 0
+                    && strcmp(run->features, features) == 0) {
+                        ftgl_font_touch_run(font, run);
+                        return run;
+                }
+        }
+
+        // The least recently used run goes first, one per new run, so
+        // the cache never outgrows the limit even without frames
+        if (font->nruns >= FTGL_RUN_CACHE_LIMIT
+            || (font->nruns >= FTGL_RUN_CACHE_CAPACITY
+                && font->runs_oldest->generation != font->generation)) {
+                ftgl_font_drop_run(font, font->runs_oldest);
+        }
+
+#ifdef FTGL_USE_HARFBUZZ
+        run = ftgl_font_shape_harfbuzz(font, ftgl_font_face(font), text, len, features);
+#else /* !defined(FTGL_USE_HARFBUZZ) */
+        run = ftgl_font_shape_kerning(font, ftgl_font_face(font), text, len, features);
+#endif /* FTGL_USE_HARFBUZZ */
+        if (!run) return NULL;
+
+        run->hash = hash;
+        run->size = font->size;
+        run->cached = 1;
+        run->prev = NULL;
+        run->next = font->runs[bucket];
+        if (run->next) run->next->prev = run;
+        font->runs[bucket] = run;
+        run->newer = run->older = NULL;
+        ftgl_font_touch_run(font, run);
+        font->nruns++;
+        return run;
 }
 
-FTGLDEF ftgl_glyph_t ftgl_font_find_glyph(ftgl_font_t font,
-                                          uint32_t codepoint)
+/**
+ * Returns the summed advance of @run and its tallest glyph, loading
+ * the glyphs that aren't resident. Measured once per run.
+ */
+FTGLDEF vec2_t ftgl_run_dimensions(ftgl_font_t font, ftgl_run_t run)
 {
-        return ftgl_glyphmap_find_glyph(font->glyphmap, codepoint);
+        ftgl_glyph_t glyph;
+        size_t i;
+
+        if (!run->measured) {
+                run->height = 0.0f;
+                for (i = 0; i < run->count; i++) {
+                        glyph = ftgl_font_lookup(font, run->glyphs[i].key);
+                        if (!glyph && !(glyph = ftgl_font_load_codepoint(font, run->glyphs[i].key))) {
+                                return ll_vec2_create2f(-1, -1);
+                        }
+
+                        if (glyph->offset_y + run->glyphs[i].y_offset > run->height) {
+                                run->height = glyph->offset_y + run->glyphs[i].y_offset;
+                        }
+                }
+                run->measured = 1;
+        }
+        return ll_vec2_create2f(run->width, run->height);
 }
 
 FTGLDEF vec2_t ftgl_font_string_dimensions(const char *source, ftgl_font_t font)
 {
-        char c;
+        uint32_t codepoint;
         vec2_t v;
-        size_t i;
+        size_t i, len, advance;
         ftgl_glyph_t glyph;
         float glyph_height;
         v = ll_vec2_origin();
-        for (i = 0; (c = source[i]) != '\0'; i++) {
-                glyph = ftgl_font_find_glyph(font, c);
+        len = strlen(source);
+        for (i = 0; i < len; i += advance) {
+                if ((unsigned char) source[i] < 0x80) {
+                        codepoint = (unsigned char) source[i];
+                        advance = 1;
+                } else {
+                        codepoint = ftgl_utf8_decode(source + i, len - i, &advance);
+                }
+
+                glyph = ftgl_font_lookup(font, codepoint);
                 if (!glyph) {
                         FTGL_LOG_MESSAGE("Glyph not found in font!");
                         return ll_vec2_create2f(-1, -1);
@@ -1516,35 +8527,152 @@ FTGLDEF vec2_t ftgl_font_string_dimensions(const char *source, ftgl_font_t font)
                 if (glyph_height > v.y) {
                         v.y = glyph_height;
                 }
-                v.x += glyph->advance_x;
-        }
+                v.x += glyph->advance_x;
+        }
+
+        return v;
+}
+
+FTGLDEF ftgl_string_t ftgl_string_create(size_t reserve)
+{
+        ftgl_string_t s;
+        reserve = reserve == 0 ? FTGL_STRING_CAPACITY : reserve;
+        s = FTGL_MALLOC(sizeof(*s));
+        if (!s) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        s->size = 0;
+        s->capacity = reserve;
+        s->nchunks = reserve / FTGL_STRING_CHUNK + 1;
+        s->data = FTGL_CALLOC(s->capacity, sizeof(*s->data));
+        s->codepoints = FTGL_CALLOC(s->capacity, sizeof(*s->codepoints));
+        s->metrics = FTGL_CALLOC(s->capacity, sizeof(*s->metrics));
+        s->chunks = FTGL_CALLOC(s->nchunks, sizeof(*s->chunks));
+        s->tree = FTGL_CALLOC(s->nchunks, sizeof(*s->tree));
+        if (!s->data || !s->codepoints || !s->metrics || !s->chunks || !s->tree) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                ftgl_string_free(&s);
+                return NULL;
+        }
+
+        s->width = 0.0;
+        s->height = 0.0;
+        s->updated = 0;
+        s->font = NULL;
+        s->font_size = 0.0f;
+        s->dirty_start = 0;
+        s->dirty_end = 0;
+        s->laid_out = 0;
+        s->features = NULL;
+        s->reshape = 1;
+        return s;
+}
+
+/* Adds @delta to the advance of chunk @chunk in @s's Fenwick tree */
+static void ftgl_string_tree_add(ftgl_string_t s, size_t chunk, double delta)
+{
+        size_t i;
+        for (i = chunk + 1; i <= s->nchunks; i += i & -i) {
+                s->tree[i - 1] += delta;
+        }
+}
+
+/* The summed advance of the chunks before @chunk */
+static double ftgl_string_tree_sum(ftgl_string_t s, size_t chunk)
+{
+        double sum;
+        size_t i;
+        sum = 0.0;
+        for (i = chunk; i > 0; i -= i & -i) {
+                sum += s->tree[i - 1];
+        }
+        return sum;
+}
+
+/* Extends the dirty range of @s over [@start, @end) */
+static void ftgl_string_touch(ftgl_string_t s, size_t start, size_t end)
+{
+        if (!s->updated) {
+                s->dirty_start = start;
+                s->dirty_end = end;
+        } else {
+                if (start < s->dirty_start) s->dirty_start = start;
+                if (end > s->dirty_end) s->dirty_end = end;
+        }
+        s->updated = 1;
+        s->reshape = 1;
+}
+
+/**
+ * Lays out the dirty bytes of @s again, only revisiting the chunks
+ * they fall in. Everything is laid out again once @font or its size
+ * changes.
+ */
+static ftgl_return_t ftgl_string_relayout(ftgl_string_t s, ftgl_font_t font)
+{
+        size_t c, i, lo, hi, end;
+        ftgl_glyph_t glyph;
+        vec2_t chunk;
+        float old_height;
+        int rescan;
+
+        if (s->font != font || s->font_size != font->size) {
+                ftgl_string_touch(s, 0, s->size > s->laid_out ? s->size : s->laid_out);
+                s->font = font;
+                s->font_size = font->size;
+        }
+
+        if (!s->updated) return FTGL_NO_ERROR;
+
+        // Bytes cut off since the last layout have to leave their chunks
+        end = s->dirty_end;
+        if (s->size < s->laid_out && s->laid_out > end) end = s->laid_out;
+
+        old_height = s->height;
+        rescan = 0;
+        for (c = s->dirty_start / FTGL_STRING_CHUNK; c * FTGL_STRING_CHUNK < end; c++) {
+                lo = c * FTGL_STRING_CHUNK;
+                hi = lo + FTGL_STRING_CHUNK;
+                for (i = lo > s->dirty_start ? lo : s->dirty_start; i < hi && i < end; i++) {
+                        if (i >= s->size || s->codepoints[i] == FTGL_UTF8_CONTINUATION) {
+                                s->metrics[i] = ll_vec2_origin();
+                                continue;
+                        }
+
+                        glyph = ftgl_font_lookup(font, s->codepoints[i]);
+                        if (!glyph) {
+                                FTGL_LOG_MESSAGE("Glyph not in font!");
+                                return FTGL_ARGUMENT_ERROR;
+                        }
+                        s->metrics[i] = ll_vec2_create2f(glyph->advance_x, glyph->offset_y);
+                }
 
-        return v;
-}
+                chunk = ll_vec2_origin();
+                for (i = lo; i < hi && i < s->size; i++) {
+                        chunk.x += s->metrics[i].x;
+                        if (s->metrics[i].y > chunk.y) chunk.y = s->metrics[i].y;
+                }
 
-FTGLDEF ftgl_string_t ftgl_string_create(size_t reserve)
-{
-        ftgl_string_t s;
-        reserve = reserve == 0 ? FTGL_STRING_CAPACITY : reserve;
-        s = FTGL_MALLOC(sizeof(*s));
-        if (!s) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                return NULL;
+                // A chunk that used to be the tallest may have shrunk
+                if (s->chunks[c].y == old_height && chunk.y < old_height) rescan = 1;
+                if (chunk.y > s->height) s->height = chunk.y;
+                ftgl_string_tree_add(s, c, (double) chunk.x - s->chunks[c].x);
+                s->chunks[c] = chunk;
         }
 
-        s->size = 0;
-        s->capacity = reserve;
-        s->data = FTGL_CALLOC(s->capacity, sizeof(*s->data));
-        if (!s->data) {
-                FTGL_LOG_MESSAGE("Ran out of memory!");
-                FTGL_FREE(s);
-                return NULL;
+        if (rescan) {
+                s->height = 0.0f;
+                for (c = 0; c * FTGL_STRING_CHUNK < s->size; c++) {
+                        if (s->chunks[c].y > s->height) s->height = s->chunks[c].y;
+                }
         }
 
-        s->width = 0.0;
-        s->height = 0.0;
+        s->width = ftgl_string_tree_sum(s, s->nchunks);
+        s->laid_out = s->size;
         s->updated = 0;
-        return s;
+        return FTGL_NO_ERROR;
 }
 
 static size_t ftgl_npo2(size_t n)
@@ -1562,26 +8690,88 @@ static size_t ftgl_npo2(size_t n)
 static ftgl_return_t ftgl_string_resize(ftgl_string_t s)
 {
         char *new_data;
-        size_t new_capacity;
+        uint32_t *new_codepoints;
+        vec2_t *new_metrics, *new_chunks;
+        double *new_tree;
+        size_t i, new_capacity, new_nchunks;
 
         new_capacity = s->capacity << 1;
+        new_nchunks = new_capacity / FTGL_STRING_CHUNK + 1;
         new_data = FTGL_REALLOC(s->data, sizeof(*new_data) * new_capacity);
-        if (!new_data) {
+        if (new_data) s->data = new_data;
+        new_codepoints = FTGL_REALLOC(s->codepoints, sizeof(*new_codepoints) * new_capacity);
+        if (new_codepoints) s->codepoints = new_codepoints;
+        new_metrics = FTGL_REALLOC(s->metrics, sizeof(*new_metrics) * new_capacity);
+        if (new_metrics) s->metrics = new_metrics;
+        new_chunks = FTGL_REALLOC(s->chunks, sizeof(*new_chunks) * new_nchunks);
+        if (new_chunks) s->chunks = new_chunks;
+        new_tree = FTGL_REALLOC(s->tree, sizeof(*new_tree) * new_nchunks);
+        if (new_tree) s->tree = new_tree;
+        if (!new_data || !new_codepoints || !new_metrics || !new_chunks || !new_tree) {
                 FTGL_LOG_MESSAGE("Ran out of memory!");
                 return FTGL_MEMORY_ERROR;
         }
 
-        s->data = new_data;
         memset(s->data + s->capacity, 0,
                sizeof(*s->data) * (new_capacity - s->capacity));
+        memset(s->metrics + s->capacity, 0,
+               sizeof(*s->metrics) * (new_capacity - s->capacity));
+        memset(s->chunks + s->nchunks, 0,
+               sizeof(*s->chunks) * (new_nchunks - s->nchunks));
         s->capacity = new_capacity;
+        s->nchunks = new_nchunks;
+
+        // Higher nodes of the tree cover older chunks, so it is rebuilt
+        memset(s->tree, 0, sizeof(*s->tree) * new_nchunks);
+        for (i = 0; i < new_nchunks; i++) {
+                ftgl_string_tree_add(s, i, s->chunks[i].x);
+        }
         return FTGL_NO_ERROR;
 }
 
+/**
+ * Decodes the bytes [@start, @end) of @s, which held @old_size bytes
+ * before the write, and marks them for layout. Sequences the write
+ * cut into are decoded again as a whole, on both ends.
+ */
+static void ftgl_string_decode(ftgl_string_t s, size_t start, size_t end, size_t old_size)
+{
+        const unsigned char *u;
+        size_t i, k, advance;
+
+        // A continuation byte may complete the sequence in front of it,
+        // so start over from the lead byte of that sequence
+        u = (const unsigned char *) s->data;
+        if (start > 0 && start < s->size && (u[start] & 0xc0) == 0x80) {
+                start--;
+        }
+        while (start > 0 && start < old_size
+               && s->codepoints[start] == FTGL_UTF8_CONTINUATION) {
+                start--;
+        }
+
+        i = start;
+        while (i < s->size && (i < end || (u[i] & 0xc0) == 0x80)) {
+                if (u[i] < 0x80) {
+                        i += ftgl_utf8_widen_ascii(u + i, end - i, s->codepoints + i);
+                        continue;
+                }
+
+                s->codepoints[i] = ftgl_utf8_decode(s->data + i, s->size - i, &advance);
+                for (k = 1; k < advance; k++) {
+                        s->codepoints[i + k] = FTGL_UTF8_CONTINUATION;
+                }
+                i += advance;
+        }
+
+        ftgl_string_touch(s, start, i > end ? i : end);
+}
+
 FTGLDEF ftgl_return_t ftgl_string_write_at(ftgl_string_t s, ftgl_font_t font,
                      char *buffer, size_t buffer_len, size_t pos)
 {
         ftgl_return_t ret;
+        size_t start, old_size;
         while (buffer_len + pos >= s->capacity) {
                 if ((ret = ftgl_string_resize(s)) != FTGL_NO_ERROR) {
                         return ret;
@@ -1589,11 +8779,13 @@ FTGLDEF ftgl_return_t ftgl_string_write_at(ftgl_string_t s, ftgl_font_t font,
         }
 
         memcpy(s->data + pos, buffer, buffer_len);
+        start = pos > s->size ? s->size : pos;
+        old_size = s->size;
         if (buffer_len + pos > s->size) {
                 s->size = buffer_len + pos;
         }
         s->data[s->size] = '\0';
-        s->updated = 1;
+        ftgl_string_decode(s, start, buffer_len + pos, old_size);
         return FTGL_NO_ERROR;
 }
 
@@ -1610,7 +8802,7 @@ FTGLDEF ftgl_return_t ftgl_string_write(ftgl_string_t s, ftgl_font_t font,
         memcpy(s->data, buffer, buffer_len);
         s->size = buffer_len;
         s->data[s->size] = '\0';
-        s->updated = 1;
+        ftgl_string_decode(s, 0, buffer_len, 0);
         return FTGL_NO_ERROR;
 }
 
@@ -1620,40 +8812,595 @@ FTGLDEF ftgl_return_t ftgl_string_append(ftgl_string_t s, ftgl_font_t font,
         return ftgl_string_write_at(s, font, buffer, buffer_len, s->size);
 }
 
+/**
+ * Only lays out the bytes edited since the last call, and the rest of
+ * the chunks they fall in.
+ */
 FTGLDEF vec2_t ftgl_string_dimensions(ftgl_string_t s, ftgl_font_t font)
 {
+        ftgl_run_t run;
         vec2_t v;
-        size_t i;
+
+        // Shaping needs the whole line, the run cache makes up for it
+        if (s->features) {
+                if (!s->reshape && s->font == font && s->font_size == font->size) {
+                        return ll_vec2_create2f(s->width, s->height);
+                }
+
+                if (!(run = ftgl_font_shape(font, s->data, s->size, s->features))) {
+                        return ll_vec2_create2f(-1, -1);
+                }
+
+                v = ftgl_run_dimensions(font, run);
+                if (v.x < 0) return v;
+
+                // The per-byte layout no longer matches the totals
+                ftgl_string_touch(s, 0, s->size);
+                s->width = v.x;
+                s->height = v.y;
+                s->font = font;
+                s->font_size = font->size;
+                s->reshape = 0;
+                return v;
+        }
+
+        if (ftgl_string_relayout(s, font) != FTGL_NO_ERROR) {
+                return ll_vec2_create2f(-1, -1);
+        }
+        return ll_vec2_create2f(s->width, s->height);
+}
+
+/**
+ * Shapes @s with @features from now on, see ftgl_font_shape, or lays
+ * it out a codepoint at a time again when NULL.
+ */
+FTGLDEF ftgl_return_t ftgl_string_set_features(ftgl_string_t s, const char *features)
+{
+        char *copy;
+
+        copy = NULL;
+        if (features && !(copy = FTGL_STRDUP(features))) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return FTGL_MEMORY_ERROR;
+        }
+
+        FTGL_FREE(s->features);
+        s->features = copy;
+        ftgl_string_touch(s, 0, s->size);
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Returns the pen's x offset in front of byte @pos, -1 on failure.
+ * Unshaped, whether or not @s has features.
+ */
+FTGLDEF GLfloat ftgl_string_advance_to(ftgl_string_t s, ftgl_font_t font, size_t pos)
+{
+        size_t i, chunk;
+        double x;
+
+        if (pos > s->size) {
+                FTGL_LOG_MESSAGE("Position past the end of the string!");
+                return -1;
+        }
+
+        if (ftgl_string_relayout(s, font) != FTGL_NO_ERROR) {
+                return -1;
+        }
+
+        chunk = pos / FTGL_STRING_CHUNK;
+        x = ftgl_string_tree_sum(s, chunk);
+        for (i = chunk * FTGL_STRING_CHUNK; i < pos; i++) {
+                x += s->metrics[i].x;
+        }
+        return x;
+}
+
+FTGLDEF void ftgl_mesh_init(ftgl_mesh_t mesh, void *vertices, size_t vertex_capacity,
+                            GLuint *indices, size_t index_capacity, int flags)
+{
+        mesh->vertices = vertices;
+        mesh->vertex_capacity = vertex_capacity;
+        mesh->indices = indices;
+        mesh->index_capacity = index_capacity;
+        mesh->flags = flags;
+        memset(mesh->color, 0xff, sizeof(mesh->color));
+        mesh->page = 0;
+        ftgl_mesh_clear(mesh);
+}
+
+FTGLDEF void ftgl_mesh_clear(ftgl_mesh_t mesh)
+{
+        mesh->nvertices = 0;
+        mesh->nindices = 0;
+        mesh->skipped = 0;
+}
+
+/**
+ * Appends the quad of @glyph, its origin at (@x, @y), to @mesh when the
+ * glyph is visible and on the mesh's page.
+ */
+static ftgl_return_t ftgl_mesh_quad(ftgl_mesh_t mesh, ftgl_font_t font, ftgl_glyph_t glyph,
+                                    float x, float y)
+{
+        size_t stride;
+        struct ftgl_vertex_t *vertex;
+        struct ftgl_color_vertex_t *colored;
+        unsigned char *vertices;
+        GLuint *index, base;
+        float x0, y0, x1, y1, u0, v0, u1, v1, sign;
+        int k;
+
+        // Blank glyphs, only padding, and placeholders just move the pen
+        if (glyph->w <= 2 * FTGL_GLYPH_OFFSET || glyph->h <= 2 * FTGL_GLYPH_OFFSET
+            || (glyph->flags & FTGL_GLYPH_PENDING)) {
+                return FTGL_NO_ERROR;
+        }
+
+        if (glyph->page != mesh->page) {
+                mesh->skipped++;
+                return FTGL_NO_ERROR;
+        }
+
+        if (mesh->nvertices + 4 > mesh->vertex_capacity
+            || mesh->nindices + 6 > mesh->index_capacity) {
+                FTGL_LOG_MESSAGE("The mesh buffers are full!");
+                return FTGL_ARGUMENT_ERROR;
+        }
+
+        stride = mesh->flags & FTGL_MESH_COLOR
+                ? sizeof(struct ftgl_color_vertex_t) : sizeof(struct ftgl_vertex_t);
+        sign = mesh->flags & FTGL_MESH_Y_DOWN ? -1.0f : 1.0f;
+
+        // The glyph's cell includes its padding
+        x0 = x + glyph->offset_x - FTGL_GLYPH_OFFSET;
+        x1 = x0 + glyph->w;
+        y0 = y + sign * (glyph->offset_y + FTGL_GLYPH_OFFSET);
+        y1 = y0 - sign * glyph->h;
+        u0 = (float) glyph->x / font->atlas->width;
+        u1 = (float) (glyph->x + glyph->w) / font->atlas->width;
+        v0 = (float) glyph->y / font->atlas->height;
+        v1 = (float) (glyph->y + glyph->h) / font->atlas->height;
+
+        // Bottom left, bottom right, top right, top left
+        vertices = (unsigned char *) mesh->vertices + mesh->nvertices * stride;
+        for (k = 0; k < 4; k++) {
+                vertex = (struct ftgl_vertex_t *) (vertices + k * stride);
+                vertex->x = k == 1 || k == 2 ? x1 : x0;
+                vertex->y = k >= 2 ? y0 : y1;
+                vertex->u = k == 1 || k == 2 ? u1 : u0;
+                vertex->v = k >= 2 ? v0 : v1;
+                if (mesh->flags & FTGL_MESH_COLOR) {
+                        colored = (struct ftgl_color_vertex_t *) vertex;
+                        colored->r = mesh->color[0];
+                        colored->g = mesh->color[1];
+                        colored->b = mesh->color[2];
+                        colored->a = mesh->color[3];
+                }
+        }
+
+        base = mesh->nvertices;
+        index = mesh->indices + mesh->nindices;
+        index[0] = base;
+        index[1] = base + 1;
+        index[2] = base + 2;
+        index[3] = base + 2;
+        index[4] = base + 3;
+        index[5] = base;
+        mesh->nvertices += 4;
+        mesh->nindices += 6;
+        return FTGL_NO_ERROR;
+}
+
+/* Lays out @text, or the per-byte @codepoints of a string when given */
+static ftgl_return_t ftgl_mesh_layout(ftgl_mesh_t mesh, ftgl_font_t font, const char *text,
+                                      const uint32_t *codepoints, size_t len, vec2_t *pen)
+{
+        size_t i, advance;
+        uint32_t codepoint;
         ftgl_glyph_t glyph;
-        float glyph_height;
-        if (!s->updated) {
-                return ll_vec2_create2f(s->width, s->height);
+        ftgl_return_t ret;
+        float start, sign;
+
+        sign = mesh->flags & FTGL_MESH_Y_DOWN ? -1.0f : 1.0f;
+        start = pen->x;
+        for (i = 0; i < len; i += advance) {
+                if (codepoints) {
+                        codepoint = codepoints[i];
+                        advance = 1;
+                        if (codepoint == FTGL_UTF8_CONTINUATION) continue;
+                } else if ((unsigned char) text[i] < 0x80) {
+                        codepoint = (unsigned char) text[i];
+                        advance = 1;
+                } else {
+                        codepoint = ftgl_utf8_decode(text + i, len - i, &advance);
+                }
+
+                if (codepoint == '\n') {
+                        pen->x = start;
+                        pen->y -= sign * font->height;
+                        continue;
+                }
+
+                glyph = ftgl_font_lookup(font, codepoint);
+                if (!glyph && !(glyph = ftgl_font_load_codepoint(font, codepoint))) {
+                        return FTGL_ARGUMENT_ERROR;
+                }
+
+                if ((ret = ftgl_mesh_quad(mesh, font, glyph, pen->x, pen->y)) != FTGL_NO_ERROR) {
+                        return ret;
+                }
+                pen->x += glyph->advance_x;
         }
+        return FTGL_NO_ERROR;
+}
 
-        v = ll_vec2_origin();
-        for (i = 0; i < s->size; i++) {
-                glyph = ftgl_font_find_glyph(font, s->data[i]);
-                if (!glyph) {
-                        FTGL_LOG_MESSAGE("Glyph not in font!");
-                        return ll_vec2_create2f(-1, -1);
+/**
+ * Lays out @len bytes of UTF-8 from *@pen, the baseline origin, and
+ * appends a textured quad for every visible glyph on the mesh's page.
+ * Glyphs that aren't resident are loaded on the way. A newline returns
+ * to the starting x, one line further. *@pen is left after the last
+ * glyph, so further text can be appended to the same run. Fails with
+ * FTGL_ARGUMENT_ERROR, keeping every glyph laid out so far, when the
+ * mesh buffers are full.
+ */
+FTGLDEF ftgl_return_t ftgl_mesh_utf8(ftgl_mesh_t mesh, ftgl_font_t font, const char *text,
+                                     size_t len, vec2_t *pen)
+{
+        return ftgl_mesh_layout(mesh, font, text, NULL, len, pen);
+}
+
+/**
+ * Like ftgl_mesh_utf8, on the codepoints @s already decoded, or on its
+ * shaped run when @s has features.
+ */
+FTGLDEF ftgl_return_t ftgl_mesh_string(ftgl_mesh_t mesh, ftgl_font_t font, ftgl_string_t s,
+                                       vec2_t *pen)
+{
+        ftgl_run_t run;
+
+        if (s->features) {
+                if (!(run = ftgl_font_shape(font, s->data, s->size, s->features))) {
+                        return FTGL_ARGUMENT_ERROR;
                 }
+                return ftgl_mesh_run(mesh, font, run, pen);
+        }
+        return ftgl_mesh_layout(mesh, font, s->data, s->codepoints, s->size, pen);
+}
 
-                glyph_height = glyph->offset_y;
-                if (glyph_height > v.y) {
-                        v.y = glyph_height;
+/**
+ * Like ftgl_mesh_utf8, placing the glyphs of a shaped @run.
+ */
+FTGLDEF ftgl_return_t ftgl_mesh_run(ftgl_mesh_t mesh, ftgl_font_t font, ftgl_run_t run,
+                                    vec2_t *pen)
+{
+        struct ftgl_shaped_glyph_t *shaped;
+        ftgl_glyph_t glyph;
+        ftgl_return_t ret;
+        float sign;
+        size_t i;
+
+        sign = mesh->flags & FTGL_MESH_Y_DOWN ? -1.0f : 1.0f;
+        for (i = 0; i < run->count; i++) {
+                shaped = &run->glyphs[i];
+                glyph = ftgl_font_lookup(font, shaped->key);
+                if (!glyph && !(glyph = ftgl_font_load_codepoint(font, shaped->key))) {
+                        return FTGL_ARGUMENT_ERROR;
                 }
-                v.x += glyph->advance_x;
+
+                ret = ftgl_mesh_quad(mesh, font, glyph, pen->x + shaped->x_offset,
+                                     pen->y + sign * shaped->y_offset);
+                if (ret != FTGL_NO_ERROR) return ret;
+
+                pen->x += shaped->x_advance;
+                pen->y += sign * shaped->y_advance;
         }
+        return FTGL_NO_ERROR;
+}
 
-        s->width = v.x;
-        s->height = v.y;
-        s->updated = 0;
-        return v;
+/**
+ * Creates a renderer that streams up to @quads glyphs per frame
+ * through @backend, the OpenGL one when NULL.
+ */
+FTGLDEF ftgl_renderer_t ftgl_renderer_create(size_t quads, ftgl_stream_backend_t backend)
+{
+        ftgl_renderer_t renderer;
+        void *mapped;
+        size_t size;
+
+        if (quads == 0) {
+                FTGL_LOG_MESSAGE("A renderer needs room for at least one quad!");
+                return NULL;
+        }
+
+        renderer = FTGL_CALLOC(1, sizeof(*renderer));
+        if (!renderer) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        renderer->backend = backend ? backend : &ftgl_stream_backend_opengl;
+        renderer->quads = quads;
+        renderer->index_offset = quads * 4 * sizeof(struct ftgl_color_vertex_t);
+        renderer->segment_size = renderer->index_offset + quads * 6 * sizeof(GLuint);
+        renderer->runs_capacity = FTGL_RENDERER_CAPACITY;
+        renderer->draws_capacity = FTGL_RENDERER_CAPACITY;
+        renderer->runs = FTGL_MALLOC(sizeof(*renderer->runs) * renderer->runs_capacity);
+        renderer->draws = FTGL_MALLOC(sizeof(*renderer->draws) * renderer->draws_capacity);
+        if (!renderer->runs || !renderer->draws) {
+                FTGL_LOG_MESSAGE("Ran out of memory!");
+                goto fail;
+        }
+
+        size = renderer->segment_size * FTGL_RENDERER_SEGMENTS;
+        if (renderer->backend->create(renderer->backend->userdata, size, &renderer->buffer,
+                                      &renderer->vertex_array, &mapped) != FTGL_NO_ERROR) {
+                renderer->buffer = 0;
+                goto fail;
+        }
+
+        // Without a mapping only one segment is ever staged
+        renderer->mapped = mapped;
+        if (!mapped) {
+                renderer->staging = FTGL_MALLOC(renderer->segment_size);
+                if (!renderer->staging) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        goto fail;
+                }
+        }
+        return renderer;
+
+fail:
+        ftgl_renderer_free(&renderer);
+        return NULL;
+}
+
+/**
+ * Queues @len bytes of UTF-8 to be drawn from @pen in @color on the
+ * next flush. @text has to stay alive until then.
+ */
+FTGLDEF ftgl_return_t ftgl_renderer_add_utf8(ftgl_renderer_t renderer, ftgl_font_t font,
+                                             const char *text, size_t len, vec2_t pen,
+                                             vec4_t color)
+{
+        size_t new_capacity;
+        struct ftgl_text_run_t *new_runs, *run;
+        float c;
+        int i;
+
+        if (renderer->nruns == renderer->runs_capacity) {
+                new_capacity = renderer->runs_capacity << 1;
+                new_runs = FTGL_REALLOC(renderer->runs, sizeof(*new_runs) * new_capacity);
+                if (!new_runs) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        return FTGL_MEMORY_ERROR;
+                }
+
+                renderer->runs = new_runs;
+                renderer->runs_capacity = new_capacity;
+        }
+
+        run = &renderer->runs[renderer->nruns++];
+        run->font = font;
+        run->shaped = NULL;
+        run->text = text;
+        run->len = len;
+        run->pen = pen;
+        for (i = 0; i < 4; i++) {
+                c = color.data[i] < 0.0f ? 0.0f : color.data[i] > 1.0f ? 1.0f : color.data[i];
+                run->color[i] = (GLubyte) (c * 255.0f + 0.5f);
+        }
+        run->done = 0;
+        return FTGL_NO_ERROR;
+}
+
+FTGLDEF ftgl_return_t ftgl_renderer_add_string(ftgl_renderer_t renderer, ftgl_font_t font,
+                                               ftgl_string_t s, vec2_t pen, vec4_t color)
+{
+        ftgl_run_t run;
+
+        if (s->features) {
+                if (!(run = ftgl_font_shape(font, s->data, s->size, s->features))) {
+                        return FTGL_ARGUMENT_ERROR;
+                }
+                return ftgl_renderer_add_run(renderer, font, run, pen, color);
+        }
+        return ftgl_renderer_add_utf8(renderer, font, s->data, s->size, pen, color);
+}
+
+/**
+ * Queues a shaped @run, which stays alive until the next flush even
+ * if @font drops it from its cache.
+ */
+FTGLDEF ftgl_return_t ftgl_renderer_add_run(ftgl_renderer_t renderer, ftgl_font_t font,
+                                            ftgl_run_t run, vec2_t pen, vec4_t color)
+{
+        ftgl_return_t ret;
+
+        ret = ftgl_renderer_add_utf8(renderer, font, run->text, run->len, pen, color);
+        if (ret == FTGL_NO_ERROR) {
+                renderer->runs[renderer->nruns - 1].shaped = run;
+                run->pins++;
+        }
+        return ret;
+}
+
+/* Forgets the queued text, letting go of the shaped runs */
+static void ftgl_renderer_clear_runs(ftgl_renderer_t renderer)
+{
+        size_t i;
+
+        for (i = 0; i < renderer->nruns; i++) {
+                if (renderer->runs[i].shaped) {
+                        ftgl_run_unpin(renderer->runs[i].shaped);
+                }
+        }
+        renderer->nruns = 0;
+}
+
+static ftgl_return_t ftgl_renderer_push_draw(ftgl_renderer_t renderer, GLuint texture,
+                                             size_t first, size_t count)
+{
+        size_t new_capacity;
+        struct ftgl_draw_t *new_draws, *draw;
+
+        if (renderer->ndraws == renderer->draws_capacity) {
+                new_capacity = renderer->draws_capacity << 1;
+                new_draws = FTGL_REALLOC(renderer->draws, sizeof(*new_draws) * new_capacity);
+                if (!new_draws) {
+                        FTGL_LOG_MESSAGE("Ran out of memory!");
+                        return FTGL_MEMORY_ERROR;
+                }
+
+                renderer->draws = new_draws;
+                renderer->draws_capacity = new_capacity;
+        }
+
+        draw = &renderer->draws[renderer->ndraws++];
+        draw->texture = texture;
+        draw->first = first;
+        draw->count = count;
+        return FTGL_NO_ERROR;
+}
+
+/**
+ * Lays out every queued run into the next segment of the ring, uploads
+ * the atlases they touched and issues one draw per atlas page. Text
+ * past the renderer's capacity is dropped with FTGL_ARGUMENT_ERROR,
+ * the rest is still drawn.
+ */
+FTGLDEF ftgl_return_t ftgl_renderer_flush(ftgl_renderer_t renderer)
+{
+        struct ftgl_mesh_t mesh;
+        struct ftgl_text_run_t *run;
+        ftgl_atlas_t atlas;
+        ftgl_return_t ret, status;
+        unsigned char *segment;
+        size_t i, j, k, first, base, segment_index;
+        GLuint page;
+        vec2_t pen;
+
+        segment_index = renderer->frame % FTGL_RENDERER_SEGMENTS;
+        if (renderer->mapped) {
+                if (renderer->fences[segment_index]) {
+                        renderer->backend->wait(renderer->backend->userdata, renderer->buffer,
+                                                renderer->fences[segment_index]);
+                        renderer->fences[segment_index] = NULL;
+                }
+                base = segment_index * renderer->segment_size;
+                segment = renderer->mapped + base;
+        } else {
+                base = 0;
+                segment = renderer->staging;
+        }
+
+        ftgl_mesh_init(&mesh, segment, renderer->quads * 4,
+                       (GLuint *) (segment + renderer->index_offset), renderer->quads * 6,
+                       FTGL_MESH_COLOR);
+        renderer->ndraws = 0;
+        status = FTGL_NO_ERROR;
+
+        // Runs sharing an atlas are laid out together, once per page
+        for (i = 0; i < renderer->nruns; i++) {
+                if (renderer->runs[i].done) continue;
+
+                atlas = renderer->runs[i].font->atlas;
+                // Laying out page 0 adds it to an atlas still empty
+                for (page = 0; page == 0 || page < atlas->size; page++) {
+                        first = mesh.nindices;
+                        mesh.page = page;
+                        mesh.skipped = 0;
+                        for (j = i; j < renderer->nruns; j++) {
+                                run = &renderer->runs[j];
+                                if (run->font->atlas != atlas) continue;
+
+                                run->done = 1;
+                                pen = run->pen;
+                                for (k = 0; k < 4; k++) {
+                                        mesh.color[k] = run->color[k];
+                                }
+                                ret = run->shaped
+                                        ? ftgl_mesh_run(&mesh, run->font, run->shaped, &pen)
+                                        : ftgl_mesh_utf8(&mesh, run->font, run->text, run->len, &pen);
+                                if (ret != FTGL_NO_ERROR) status = ret;
+                        }
+
+                        if (mesh.nindices > first) {
+                                ret = ftgl_renderer_push_draw(renderer, atlas->pages[page].texture,
+                                                              first, mesh.nindices - first);
+                                if (ret != FTGL_NO_ERROR) status = ret;
+                        }
+
+                        // Every glyph was on the first page
+                        if (page == 0 && mesh.skipped == 0) break;
+                }
+
+                ftgl_atlas_flush(atlas);
+        }
+
+        if (!renderer->mapped && mesh.nvertices > 0) {
+                // Orphaning needs the indices right behind the vertices in use
+                memmove(segment + mesh.nvertices * sizeof(struct ftgl_color_vertex_t),
+                        mesh.indices, mesh.nindices * sizeof(GLuint));
+                renderer->backend->upload(renderer->backend->userdata, renderer->buffer,
+                                          segment, mesh.nvertices * sizeof(struct ftgl_color_vertex_t)
+                                          + mesh.nindices * sizeof(GLuint));
+        }
+
+        for (i = 0; i < renderer->ndraws; i++) {
+                renderer->backend->draw(renderer->backend->userdata, renderer->vertex_array,
+                                        renderer->buffer, renderer->draws[i].texture, base,
+                                        base + (renderer->mapped ? renderer->index_offset
+                                                : mesh.nvertices * sizeof(struct ftgl_color_vertex_t))
+                                        + renderer->draws[i].first * sizeof(GLuint),
+                                        renderer->draws[i].count);
+        }
+
+        if (renderer->mapped && renderer->ndraws > 0) {
+                renderer->fences[segment_index] = renderer->backend->fence(renderer->backend->userdata,
+                                                                           renderer->buffer);
+        }
+
+        ftgl_renderer_clear_runs(renderer);
+        renderer->frame++;
+        return status;
+}
+
+FTGLDEF void ftgl_renderer_free(ftgl_renderer_t *renderer)
+{
+        size_t i;
+
+        if (!*renderer) return;
+
+        for (i = 0; i < FTGL_RENDERER_SEGMENTS; i++) {
+                if ((*renderer)->fences[i]) {
+                        (*renderer)->backend->wait((*renderer)->backend->userdata,
+                                                   (*renderer)->buffer, (*renderer)->fences[i]);
+                }
+        }
+
+        if ((*renderer)->buffer) {
+                (*renderer)->backend->destroy((*renderer)->backend->userdata,
+                                              (*renderer)->vertex_array, (*renderer)->buffer,
+                                              (*renderer)->mapped);
+        }
+
+        ftgl_renderer_clear_runs(*renderer);
+        FTGL_FREE((*renderer)->staging);
+        FTGL_FREE((*renderer)->runs);
+        FTGL_FREE((*renderer)->draws);
+        FTGL_FREE(*renderer);
+        *renderer = NULL;
 }
 
 FTGLDEF void ftgl_string_free(ftgl_string_t *s)
 {
         FTGL_FREE((*s)->data);
+        FTGL_FREE((*s)->codepoints);
+        FTGL_FREE((*s)->features);
+        FTGL_FREE((*s)->metrics);
+        FTGL_FREE((*s)->chunks);
+        FTGL_FREE((*s)->tree);
         (*s)->data = NULL;
         (*s)->size = 0;
         (*s)->capacity = 0;
@@ -1662,13 +9409,34 @@ FTGLDEF void ftgl_string_free(ftgl_string_t *s)
 
 FTGLDEF void ftgl_font_free(ftgl_font_t *font)
 {
-        glDeleteTextures(1, &(*font)->texture);
-        FT_Done_Face((*font)->face);
+        uint32_t i;
+        ftgl_glyph_t glyph;
+
+#ifndef FTGL_NO_THREADS
+        if ((*font)->pool) {
+                ftgl_pool_free(&(*font)->pool);
+        }
+#endif /* FTGL_NO_THREADS */
+
+        // The other fonts keep packing into a shared atlas, hand the
+        // space of this font's glyphs back to it
+        if ((*font)->atlas->refcount > 1) {
+                for (i = 0; i < (*font)->glyphmap->top; i++) {
+                        glyph = ftgl_glyphmap_glyph((*font)->glyphmap, i);
+                        if (glyph->codepoint == FTGL_FONT_GLYPHMAP_EMPTY) continue;
+                        if (glyph->w == 0) continue;
+                        ftgl_atlas_release((*font)->atlas, glyph->page,
+                                           ll_ivec4_create4i(glyph->x, glyph->y,
+                                                             glyph->w + FTGL_GLYPH_OFFSET,
+                                                             glyph->h + FTGL_GLYPH_OFFSET));
+                }
+        }
+
+        ftgl_sdf_free(&(*font)->sdf);
+        ftgl_atlas_free(&(*font)->atlas);
+        ftgl_font_unbind(*font);
         ftgl_glyphmap_free(&(*font)->glyphmap);
-        (*font)->face = NULL;
         (*font)->glyphmap = NULL;
-        (*font)->tbox = ll_ivec2_create2i(0,0);
-        (*font)->tbox_yjump = 0;
         (*font)->scale = 0.0;
         FTGL_FREE(*font);
 }